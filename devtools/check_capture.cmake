@@ -0,0 +1,26 @@
+# Capture a software-rendered run to a y4m file, check it has every frame, then delete it
+# Usage: cmake -DMOTH06=<exe> -DCAPTURE=<file.y4m> -DFRAMES=<n> -P check_capture.cmake
+
+execute_process(COMMAND "${MOTH06}" --software --frames ${FRAMES} --capture "${CAPTURE}" RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    file(REMOVE "${CAPTURE}")
+    message(FATAL_ERROR "moth06 exited with ${result}")
+endif()
+
+# 640x480 at the simulation rate, see SOFT_WIDTH, SOFT_HEIGHT and SIM_HZ
+set(header "YUV4MPEG2 W640 H480 F60:1 Ip A1:1 C420jpeg\n")
+string(LENGTH "${header}" header_size)
+file(READ "${CAPTURE}" actual_header LIMIT ${header_size})
+file(SIZE "${CAPTURE}" size)
+file(REMOVE "${CAPTURE}")
+
+if(NOT actual_header STREQUAL header)
+    message(FATAL_ERROR "Unexpected header: ${actual_header}")
+endif()
+# "FRAME\n" and a 4:2:0 frame each
+math(EXPR frame_size "6 + 640 * 480 * 3 / 2")
+math(EXPR frames "(${size} - ${header_size}) / ${frame_size}")
+math(EXPR rest "(${size} - ${header_size}) % ${frame_size}")
+if(NOT frames EQUAL FRAMES OR NOT rest EQUAL 0)
+    message(FATAL_ERROR "Captured ${frames} frames and ${rest} more bytes, expected ${FRAMES} frames")
+endif()
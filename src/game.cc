@@ -2,7 +2,336 @@
 #include "game_private.hh"
 
 const EngineInterface* ei = nullptr;
-#define dbgmsg(...) ei->dbg_log(__VA_ARGS__)
+#define dbgmsg(...) ei->log(hk::logging::encode("GAME | " __VA_ARGS__))
+
+// Game state
+
+// Textures of the drawn state's files, made by this copy of the library. Handles don't outlive
+// it, unlike the files in the state
+static AnmTextureSet anm_textures;
+static const GameState* anm_textures_state = nullptr;
+
+// Demo scripts, built in code so the simulation has real work to do without the game's data.
+// Between them they use every kind of interpolation the VM has
+enum DemoScript : u32 {
+    DEMO_SHOT,
+    DEMO_SPARK,
+    DEMO_ORBIT,
+};
+constexpr u32 DEMO_FILE = 0;
+constexpr u32 DEMO_SPRITES = 4;
+// Label of DEMO_ORBIT's exit
+constexpr i32 DEMO_ORBIT_EXIT = 1;
+
+static void build_demo_anm(Array<u8>& out) {
+    constexpr u32 NUM_SCRIPTS = 3;
+    out.resize(0);
+    for (usize i = 0; i < 16; ++i) {
+        put<u32>(out, 0);
+    }
+    patch<u32>(out, 0, DEMO_SPRITES);
+    patch<u32>(out, 4, NUM_SCRIPTS);
+    patch<u32>(out, 12, DEMO_SPRITES * 16);
+    patch<u32>(out, 16, 16);
+    const usize sprite_table = out.length();
+    for (u32 i = 0; i < DEMO_SPRITES; ++i) {
+        put<u32>(out, 0);
+    }
+    const usize script_table = out.length();
+    for (u32 i = 0; i < NUM_SCRIPTS; ++i) {
+        put<u32>(out, 0);
+        put<u32>(out, 0);
+    }
+    for (u32 i = 0; i < DEMO_SPRITES; ++i) {
+        patch<u32>(out, sprite_table + i * 4, (u32)out.length());
+        put<u32>(out, i);
+        put<f32>(out, 16.0f * i);
+        put<f32>(out, 0.0f);
+        put<f32>(out, 16.0f);
+        put<f32>(out, 16.0f);
+    }
+    auto begin_script = [&](u32 script) {
+        const usize offset = out.length();
+        patch<u32>(out, script_table + script * 8, script);
+        patch<u32>(out, script_table + script * 8 + 4, (u32)offset);
+        return offset;
+    };
+
+    // Spins down the screen, fading out
+    begin_script(DEMO_SHOT);
+    put_op(out, 0, AnmOpcode::SetRandomSprite, 8);
+    put<i32>(out, 0); put<i32>(out, DEMO_SPRITES);
+    put_op(out, 0, AnmOpcode::Set3DRotationsSpeed, 12);
+    put<f32>(out, 0.0f); put<f32>(out, 0.0f); put<f32>(out, 0.1f);
+    put_op(out, 0, AnmOpcode::MoveToDecel, 16);
+    put<f32>(out, 320.0f); put<f32>(out, 480.0f); put<f32>(out, 0.0f); put<i32>(out, 60);
+    put_op(out, 30, AnmOpcode::Fade, 8);
+    put<i32>(out, 0); put<i32>(out, 30);
+    put_op(out, 60, AnmOpcode::Delete, 0);
+
+    // Additive, growing and speeding up
+    begin_script(DEMO_SPARK);
+    put_op(out, 0, AnmOpcode::SetSprite, 4);
+    put<u32>(out, 1);
+    put_op(out, 0, AnmOpcode::SetBlendModeAdd, 0);
+    put_op(out, 0, AnmOpcode::SetScaleSpeed, 8);
+    put<f32>(out, 0.02f); put<f32>(out, 0.02f);
+    put_op(out, 0, AnmOpcode::MoveToAccel, 16);
+    put<f32>(out, 320.0f); put<f32>(out, 0.0f); put<f32>(out, 0.0f); put<i32>(out, 40);
+    put_op(out, 10, AnmOpcode::ShiftTextureY, 4);
+    put<f32>(out, 0.01f);
+    put_op(out, 40, AnmOpcode::Delete, 0);
+
+    // Loops between two points until interrupted
+    const usize orbit = begin_script(DEMO_ORBIT);
+    put_op(out, 0, AnmOpcode::SetSprite, 4);
+    put<u32>(out, 2);
+    put_op(out, 0, AnmOpcode::Set3DRotations, 12);
+    put<f32>(out, 0.0f); put<f32>(out, 0.0f); put<f32>(out, 0.5f);
+    put_op(out, 0, AnmOpcode::ScaleIn, 12);
+    put<f32>(out, 2.0f); put<f32>(out, 2.0f); put<i32>(out, 30);
+    const usize loop = put_op(out, 0, AnmOpcode::MoveToLinear, 16) - orbit;
+    put<f32>(out, 160.0f); put<f32>(out, 240.0f); put<f32>(out, 0.0f); put<i32>(out, 30);
+    put_op(out, 30, AnmOpcode::SetColor, 4);
+    put<u8>(out, 255); put<u8>(out, 128); put<u8>(out, 64); put<u8>(out, 0);
+    put_op(out, 30, AnmOpcode::MoveToLinear, 16);
+    put<f32>(out, 480.0f); put<f32>(out, 240.0f); put<f32>(out, 0.0f); put<i32>(out, 30);
+    put_op(out, 30, AnmOpcode::ShiftTextureX, 4);
+    put<f32>(out, 0.25f);
+    put_op(out, 60, AnmOpcode::Jump, 4);
+    put<u32>(out, (u32)loop);
+    put_op(out, 60, AnmOpcode::InterruptLabel, 4);
+    put<i32>(out, DEMO_ORBIT_EXIT);
+    put_op(out, 60, AnmOpcode::Fade, 8);
+    put<i32>(out, 0); put<i32>(out, 15);
+    put_op(out, 75, AnmOpcode::SetVisible, 4);
+    put<i32>(out, 0);
+    put_op(out, 76, AnmOpcode::Delete, 0);
+}
+
+// White shapes for the instances' colours to tint: a disc, a ring, a diamond and a square
+static void build_demo_texture(Array<u8>& out) {
+    constexpr u32 WIDTH = DEMO_SPRITES * 16, HEIGHT = 16;
+    out.resize(WIDTH * HEIGHT * 4);
+    for (u32 y = 0; y < HEIGHT; ++y) {
+        for (u32 x = 0; x < WIDTH; ++x) {
+            // Twice the offset from the sprite's centre, so it's a whole number
+            const i32 dx = 2 * (i32)(x % 16) - 15, dy = 2 * (i32)y - 15;
+            const i32 r2 = dx * dx + dy * dy;
+            bool inside = true;
+            switch (x / 16) {
+            case 0: inside = r2 < 225; break;
+            case 1: inside = r2 < 225 && r2 > 81; break;
+            case 2: inside = max(dx, -dx) + max(dy, -dy) < 16; break;
+            }
+            u8* p = &out[(y * WIDTH + x) * 4];
+            p[0] = p[1] = p[2] = 255;
+            p[3] = inside ? 255 : 0;
+        }
+    }
+}
+
+// Pixels of a file's texture. Only the demo has one so far, made in code
+static bool load_anm_texture(u32 file, Array<u8>& out) {
+    if (file != DEMO_FILE) {
+        return false;
+    }
+    build_demo_texture(out);
+    return true;
+}
+
+// Parse the resident files into a new state and pack their sprites onto atlas pages. The files
+// stay put for the state's lifetime, only their textures are made again after a reload
+static void load_resident(GameState* g) {
+    HK_PROFILE_ZONE("Load resident assets");
+    Array<u8> file = Array<u8>();
+    build_demo_anm(file);
+    const char* error = nullptr;
+    AnmFile* anm = anm_load(file.const_bytes(), g->resident, &error);
+    if (!anm) {
+        dbgmsg("Demo scripts failed to load: %s", error);
+        return;
+    }
+    HK_ASSERT(g->anm_files.num_files == DEMO_FILE);
+    anm_file_set_add(g->anm_files, anm);
+
+    AnmFile* files[MAX_ANM_FILES];
+    for (u32 f = 0; f < g->anm_files.num_files; ++f) {
+        files[f] = (AnmFile*)g->anm_files.files[f];
+    }
+    AnmAtlas atlas = AnmAtlas();
+    if (!anm_atlas_build(atlas, files, g->anm_files.num_files, &error)) {
+        dbgmsg("Sprites are drawn from their own files' textures: %s", error);
+        return;
+    }
+    // The sprites have moved, so without the blits they can't be drawn at all
+    g->anm_blits = g->resident.alloc<AnmAtlasBlit>(atlas.blits.length());
+    HK_ASSERT(g->anm_blits && "No room for the atlas blits, see MIN_RESIDENT_CAPACITY");
+    mem::copy(g->anm_blits, atlas.blits.buffer(), atlas.blits.length());
+    g->num_anm_blits = (u32)atlas.blits.length();
+    g->num_anm_pages = atlas.num_pages;
+}
+
+static void destroy_anm_textures() {
+    for (GfxTexture& texture : anm_textures.files) {
+        ei->gfx.destroy_texture(texture);
+    }
+    for (GfxTexture& page : anm_textures.pages) {
+        ei->gfx.destroy_texture(page);
+    }
+    anm_textures = { };
+    anm_textures_state = nullptr;
+}
+
+// Upload the state's atlas pages, or each file's texture if its sprites weren't packed
+static void upload_anm_textures(const GameState* g) {
+    HK_PROFILE_ZONE("Upload ANM textures");
+    destroy_anm_textures();
+    anm_textures_state = g;
+    const AnmFileSet& files = g->anm_files;
+    Array<u8> texture = Array<u8>();
+    if (!g->num_anm_pages) {
+        for (u32 f = 0; f < files.num_files; ++f) {
+            if (load_anm_texture(f, texture)) {
+                anm_textures.files[f] = ei->gfx.create_texture(files.files[f]->width, files.files[f]->height, texture.buffer());
+            }
+        }
+        return;
+    }
+
+    // Regions of files without a texture are white, so they're still drawn in their colour
+    static const u8 white[4] = { 255, 255, 255, 255 };
+    Array<u8> page = Array<u8>((usize)ANM_ATLAS_SIZE * ANM_ATLAS_SIZE * 4);
+    for (u32 p = 0; p < g->num_anm_pages; ++p) {
+        std::memset(page.buffer(), 0, page.length());
+        for (u32 f = 0; f < files.num_files; ++f) {
+            const bool textured = load_anm_texture(f, texture);
+            for (u32 b = 0; b < g->num_anm_blits; ++b) {
+                const AnmAtlasBlit& blit = g->anm_blits[b];
+                if (blit.page != p || blit.file != f) {
+                    continue;
+                }
+                if (textured) {
+                    anm_atlas_blit(blit, texture.buffer(), files.files[f]->width, files.files[f]->height, page.buffer());
+                } else {
+                    anm_atlas_blit(blit, white, 1, 1, page.buffer());
+                }
+            }
+        }
+        if (!(anm_textures.pages[p] = ei->gfx.create_texture(ANM_ATLAS_SIZE, ANM_ATLAS_SIZE, page.buffer()))) {
+            dbgmsg("No room for atlas page %u, its sprites are drawn untextured", p);
+        }
+    }
+}
+
+// The same every run: positions and timing come from the tick alone
+static void spawn_demo(GameState* g) {
+    const AnmFileSet& files = g->anm_files;
+    if (files.num_files <= DEMO_FILE) {
+        return;
+    }
+    const u64 t = g->tick;
+    for (u32 i = 0; i < 8; ++i) {
+        const f32 x = (f32)((t * 37 + i * 80) % 640);
+        anm_vm_spawn(g->anm, files, DEMO_FILE, DEMO_SHOT, x, (f32)(i * 8));
+    }
+    if (t % 2 == 0) {
+        anm_vm_spawn(g->anm, files, DEMO_FILE, DEMO_SPARK, (f32)((t * 13) % 640), 480.0f);
+    }
+    if (t % 30 == 0) {
+        u32& slot = g->orbits[(t / 30) % DEMO_ORBITS];
+        anm_vm_interrupt(g->anm, files, slot, DEMO_ORBIT_EXIT);
+        slot = anm_vm_spawn(g->anm, files, DEMO_FILE, DEMO_ORBIT, 320.0f, (f32)((t / 30) % 480));
+    }
+}
+
+// Changes whenever a field of GameState moves or resizes. Every field must be listed
+#define GAME_STATE_FIELD(f) h = hk::hash_combine(hk::hash_combine(h, offsetof(GameState, f)), sizeof(GameState::f))
+static constexpr u64 game_state_layout_hash() {
+    u64 h = hk::str::hash("GameState");
+    h = hk::hash_combine(h, sizeof(GameState));
+    GAME_STATE_FIELD(tick);
+    GAME_STATE_FIELD(anm);
+    GAME_STATE_FIELD(orbits);
+    GAME_STATE_FIELD(resident);
+    GAME_STATE_FIELD(anm_files);
+    GAME_STATE_FIELD(num_anm_pages);
+    GAME_STATE_FIELD(num_anm_blits);
+    GAME_STATE_FIELD(anm_blits);
+    // The resident files are kept too
+    h = hk::hash_combine(h, sizeof(AnmFile));
+    h = hk::hash_combine(h, sizeof(AnmOp));
+    h = hk::hash_combine(h, sizeof(AnmAtlasBlit));
+    return h;
+}
+#undef GAME_STATE_FIELD
+
+static void init_state(GameContext* ctx) {
+    GameState* g = get_state(ctx);
+    u8* resident = (u8*)g + sizeof(GameState);
+    g->tick = 0;
+    anm_vm_init(g->anm, 1);
+    for (u32& orbit : g->orbits) {
+        orbit = INVALID_ANM_INSTANCE;
+    }
+    g->resident = mem::Arena(resident, ctx->state_capacity - GAME_STATE_OFFSET - sizeof(GameState));
+    g->anm_files = { };
+    g->num_anm_pages = 0;
+    g->num_anm_blits = 0;
+    g->anm_blits = nullptr;
+    // A new state where the drawn one was gets its own textures
+    if (anm_textures_state == g) {
+        destroy_anm_textures();
+    }
+    load_resident(g);
+}
+
+static u64 checksum_state(const GameContext* ctx) {
+    const GameState* g = get_state(ctx);
+    u64 h = hk::str::hash("GameState");
+    h = hk::hash_combine(h, g->tick);
+    h = hk::hash_combine(h, anm_vm_checksum(g->anm));
+    for (u32 orbit : g->orbits) {
+        h = hk::hash_combine(h, orbit);
+    }
+    return h;
+}
+
+static void update(GameContext* ctx) {
+    GameState* g = get_state(ctx);
+    spawn_demo(g);
+    ++g->tick;
+    anm_vm_step(g->anm, g->anm_files);
+}
+
+// Instances per job, and per draw_sprites() call
+constexpr u32 ANM_DRAW_BATCH = 512;
+
+struct AnmDrawJob {
+    const GameState* g;
+    f32 alpha;
+};
+
+static void draw_anm_batch(void* user, usize begin, usize end) {
+    HK_PROFILE_ZONE("Draw ANM");
+    const AnmDrawJob& job = *(const AnmDrawJob*)user;
+    const GameState* g = job.g;
+    GfxSprite sprites[ANM_DRAW_BATCH];
+    for (usize b = begin; b < end; b += ANM_DRAW_BATCH) {
+        const u32 n = anm_vm_sprites(g->anm, g->anm_files, anm_textures, job.alpha, (u32)b, (u32)min<usize>(end, b + ANM_DRAW_BATCH), sprites);
+        // Ordered by the first instance, whichever thread gets the batch
+        ei->gfx.draw_sprites(sprites, n, (u32)b);
+    }
+}
+
+static void draw(const GameContext* ctx, f32 alpha) {
+    const GameState* g = get_state(ctx);
+    if (anm_textures_state != g) {
+        upload_anm_textures(g);
+    }
+    AnmDrawJob job = { g, alpha };
+    ei->jobs.parallel_for(g->anm.count, ANM_DRAW_BATCH, draw_anm_batch, &job);
+}
 
 // PBG3 parsing
 
@@ -14,6 +343,7 @@ static int pbg_read_int( BitStream& b ) {
 }
 
 static bool pbg_parse_entries( Span<const u8> archive, Array<PBGEntry>& entries ) {
+    HK_PROFILE_ZONE( "PBG parse entries" );
     BitStream bits = BitStream( archive );
     const char magic[4] = {
         (char)pbg_read_int( bits ),
@@ -48,6 +378,7 @@ static bool pbg_parse_entries( Span<const u8> archive, Array<PBGEntry>& entries
 }
 
 static bool pbg_decompress_data( Span<const u8> archive, const PBGEntry& file, Array<u8>& data ) {
+    HK_COUNTER_ZONE( "PBG decompress" );
     BitStream bits = BitStream( archive );
     // Touhou-specific LZSS encoding options
     // XXX(HK): These are copy/pasted from PyTouhou, confirm these
@@ -85,6 +416,10 @@ static bool pbg_decompress_data( Span<const u8> archive, const PBGEntry& file, A
     return !bits.overrun();
 }
 
+static void disconnect_game() {
+    destroy_anm_textures();
+}
+
 extern "C" HK_DLL_EXPORT bool connect_game(const EngineInterface* ei_, GameInterface* gi) {
     ei = ei_;
     // Cannot reload if structure layout changed
@@ -92,9 +427,23 @@ extern "C" HK_DLL_EXPORT bool connect_game(const EngineInterface* ei_, GameInter
         return false;
     }
 
+    hk::sys::set_clock_calibration(ei->clock);
+    hk::prof::set_thread_buffer_source(ei->prof_thread_buffer);
+
     gi->pbg.parse_entries = pbg_parse_entries;
     gi->pbg.decompress_data = pbg_decompress_data;
+    gi->state.version = GAME_STATE_VERSION;
+    gi->state.layout_hash = game_state_layout_hash();
+    gi->state.min_capacity = GAME_STATE_OFFSET + sizeof(GameState) + MIN_RESIDENT_CAPACITY;
+    gi->state.init = init_state;
+    // No migrations yet, states from older versions start over
+    gi->state.migrate = nullptr;
+    gi->state.checksum = checksum_state;
+    gi->update = update;
+    gi->draw = draw;
+    gi->test = game_test;
+    gi->disconnect = disconnect_game;
 
-    ei->dbg_log("Game connected");
+    dbgmsg("Game connected");
     return true;
 }
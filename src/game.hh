@@ -3,6 +3,38 @@
 
 #include "hk.hh"
 
+//
+// Drawing, the game hands sprites to the engine
+//
+
+// Texture handle. 0 is no texture, sprites without one are drawn in their colour
+typedef u32 GfxTexture;
+constexpr u32 MAX_GFX_TEXTURES = 64;
+
+enum class GfxBlend : u8 {
+	Alpha,
+	Add,
+};
+
+// One textured quad
+struct GfxSprite {
+	// Centre, in window pixels
+	f32 x, y;
+	// Size in pixels
+	f32 width, height;
+	// Radians, clockwise around the centre
+	f32 rotation;
+	// Texture coordinates of the top left and bottom right corners
+	f32 u0, v0, u1, v1;
+	// Bytes R, G, B, A in memory, like SDL_Color
+	u32 color;
+	GfxTexture texture;
+	GfxBlend blend;
+	// Layers draw back to front. Within a layer sprites are grouped by blend mode and texture,
+	// then drawn in the order they were queued with, see draw_sprites()
+	u8 layer;
+};
+
 //
 // Engine->Game interface
 //
@@ -19,6 +51,24 @@ struct PBGEntry {
 	char e_name[MAX_PBG_NAME];
 };
 
+// Engine-owned block holding all game state, so the simulation and resident assets survive
+// reloading the game library. The game's state follows this header, cache line aligned
+struct GameStateHeader {
+	// Layout of the state currently in the block, zero if there is none
+	u32   version;
+	u64   layout_hash;
+};
+
+constexpr usize GAME_STATE_OFFSET = (sizeof(GameStateHeader) + HK_CACHE_LINE - 1) & ~(usize)(HK_CACHE_LINE - 1);
+
+// One simulation, passed to every GameInterface call that touches game state. The game keeps
+// no mutable globals, so any number of contexts can run at once, one per thread
+struct GameContext {
+	// Game state block, see GameStateHeader. Cache line aligned and never moves
+	void* state;
+	usize state_capacity;
+};
+
 struct GameInterface {
 	usize size;
 	// PBG parsing
@@ -26,6 +76,28 @@ struct GameInterface {
 		bool(*parse_entries)(Span<const u8> archive, Array<PBGEntry>& entries);
 		bool(*decompress_data)(Span<const u8> archive, const PBGEntry& file, Array<u8>& data);
 	} pbg;
+	// State layout this library expects
+	struct {
+		u32   version;
+		u64   layout_hash;
+		// Smallest block the state fits in, header included
+		usize min_capacity;
+		// Set up fresh state
+		void (*init)(GameContext* ctx);
+		// Optional. Convert state left by another build in place, false to start over
+		bool (*migrate)(GameContext* ctx, u32 from_version, u64 from_layout_hash);
+		// Hash of the simulation state, equal for contexts that have seen the same inputs
+		u64  (*checksum)(const GameContext* ctx);
+	} state;
+	// Advance the simulation
+	void (*update)(GameContext* ctx);
+	// Queue the state's sprites with EngineInterface::gfx, between begin_frame() and end_frame().
+	// `alpha` is how far from the second to last update to the last one to draw things, 0 to 1
+	void (*draw)(const GameContext* ctx, f32 alpha);
+	// Self-tests, asserts on failure
+	void (*test)();
+	// Release what connect_game() created, before the library is replaced or the engine exits
+	void (*disconnect)();
 };
 
 //
@@ -34,10 +106,31 @@ struct GameInterface {
 
 struct EngineInterface {
 	usize size;
-	// Debugging
-	void (*dbg_log)(const char* fmt, ...);
-	// Asset loading
-	bool (*load_asset)(const char* path, Array<u8>& data);
+	// Debugging - queue a message on the engine's logger
+	void (*log)(const hk::logging::Record& record);
+	// Profiling - share the engine's clock and zone buffers
+	sys::ClockCalibration clock;
+	prof::ThreadBuffer* (*prof_thread_buffer)();
+	// Asset loading. Any thread, the data is shared by every context and stays loaded
+	bool (*load_asset)(const char* path, Span<const u8>& data);
+	// Job system, shared with the engine
+	struct {
+		u32  (*thread_count)();
+		void (*run)(sys::Job* jobs, usize count, sys::JobCounter* counter);
+		void (*run_after)(sys::JobCounter* dependency, sys::Job* jobs, usize count, sys::JobCounter* counter);
+		void (*wait)(sys::JobCounter* counter);
+		void (*parallel_for)(usize count, usize batch, sys::ParallelForFn fn, void* user);
+	} jobs;
+	// Drawing. Any job thread, each queues into its own command buffer
+	struct {
+		// Sprites are sorted by layer, blend mode, texture and then `order`. Ties keep the order
+		// they were queued in on each job thread, and lower job thread indices draw first
+		void (*draw_sprites)(const GfxSprite* sprites, usize count, u32 order);
+		// Main thread only, never from a job. Sprites queued in the same frame can use it. Pixels
+		// are RGBA bytes, rows top to bottom. Returns 0 if there's no room for another
+		GfxTexture (*create_texture)(u32 width, u32 height, const u8* pixels);
+		void (*destroy_texture)(GfxTexture texture);
+	} gfx;
 };
 
 typedef bool(*ConnectGameFn)(const EngineInterface* ei, GameInterface* gi);
@@ -0,0 +1,854 @@
+#include "game_anm_simd.hh"
+
+//
+// ANM loading
+//
+
+// Operand encoding of each opcode: f = f32, i = i32, u = u32, b = u8, x = padding byte
+static constexpr const char* ANM_OPERANDS[(usize)AnmOpcode::Count] = {
+    "",         // Delete
+    "u",        // SetSprite
+    "ff",       // SetScale
+    "u",        // SetAlpha
+    "bbbx",     // SetColor
+    "u",        // Jump
+    "",         // Unknown6
+    "",         // ToggleMirrored
+    "",         // Unknown8
+    "fff",      // Set3DRotations
+    "fff",      // Set3DRotationsSpeed
+    "ff",       // SetScaleSpeed
+    "ii",       // Fade
+    "",         // SetBlendModeAdd
+    "",         // SetBlendModeAlphaBlend
+    "",         // KeepStill
+    "ii",       // SetRandomSprite
+    "fff",      // Set3DTranslation
+    "fffi",     // MoveToLinear
+    "fffi",     // MoveToDecel
+    "fffi",     // MoveToAccel
+    "",         // Wait
+    "i",        // InterruptLabel
+    "",         // SetCornerRelativePlacement
+    "",         // WaitEx
+    "i",        // SetAllowOffset
+    "i",        // SetAutoOrientation
+    "f",        // ShiftTextureX
+    "f",        // ShiftTextureY
+    "i",        // SetVisible
+    "ffi",      // ScaleIn
+};
+
+static constexpr bool anm_operands_fit() {
+    for ( const char* fmt : ANM_OPERANDS ) {
+        usize n = 0;
+        for ( ; *fmt; ++fmt ) {
+            n += *fmt != 'x';
+        }
+        if ( n > MAX_ANM_OPERANDS ) {
+            return false;
+        }
+    }
+    return true;
+}
+static_assert( anm_operands_fit(), "ANM op has more operands than AnmOp holds" );
+
+// Header, then a table of sprite offsets and a table of script ID/offset pairs
+struct AnmHeader {
+    u32 num_sprites;
+    u32 num_scripts;
+    u32 unk1;
+    u32 width;
+    u32 height;
+    u32 format;
+    u32 unk2;
+    u32 texture_path_offset;
+    u32 unk3;
+    u32 texture_alpha_path_offset;
+    u32 version;
+    u32 unk4;
+    u32 texture_offset;
+    u32 has_data;
+    u32 next_offset;
+    u32 unk5;
+};
+
+// Size of the time/opcode/size prefix of every op
+constexpr usize ANM_OP_HEADER_SIZE = 4;
+
+// Count a script's ops, the closing Delete included, and add its InterruptLabels to `interrupts`.
+// Zero if it runs off the file or has an unknown opcode
+static u32 anm_count_ops( ByteStream& bytes, usize offset, u32& interrupts ) {
+    bytes.seek( offset );
+    for ( u32 count = 1; ; ++count ) {
+        bytes.read<u16>();
+        const u8 opcode = bytes.read<u8>();
+        const u8 size = bytes.read<u8>();
+        if ( bytes.overrun() || opcode >= (u8)AnmOpcode::Count ) {
+            return 0;
+        }
+        interrupts += opcode == (u8)AnmOpcode::InterruptLabel;
+        if ( opcode == (u8)AnmOpcode::Delete ) {
+            return count;
+        }
+        bytes.seek( bytes.tell() + size );
+    }
+}
+
+// Decode as many operands as the op's `size` payload bytes hold
+static void anm_decode_operands( ByteStream& bytes, AnmOp& op, usize size ) {
+    usize n = 0, used = 0;
+    for ( const char* fmt = ANM_OPERANDS[(usize)op.opcode]; *fmt; ++fmt ) {
+        const usize width = ( *fmt == 'b' || *fmt == 'x' ) ? 1 : 4;
+        if ( used + width > size ) {
+            break;
+        }
+        used += width;
+        switch ( *fmt ) {
+        case 'f': op.f[n++] = bytes.read<f32>(); break;
+        case 'i': op.i[n++] = bytes.read<i32>(); break;
+        case 'u': op.u[n++] = bytes.read<u32>(); break;
+        case 'b': op.u[n++] = bytes.read<u8>(); break;
+        case 'x': bytes.read<u8>(); break;
+        }
+    }
+}
+
+static i32 anm_find_sprite( const AnmFile* anm, u32 id ) {
+    for ( u32 i = 0; i < anm->num_sprites; ++i ) {
+        if ( anm->sprite_ids[i] == id ) {
+            return (i32)i;
+        }
+    }
+    return -1;
+}
+
+// Into `arena` when there is one, otherwise into a block of its own
+static AnmFile* anm_load_into( Span<const u8> file, mem::Arena* arena, const char** error ) {
+    HK_PROFILE_ZONE( "ANM load" );
+    ByteStream bytes = ByteStream( file );
+    const AnmHeader hdr = bytes.read<AnmHeader>();
+    if ( bytes.overrun() ) {
+        *error = "File is shorter than the ANM header";
+        return nullptr;
+    }
+    if ( hdr.version != 0 ) {
+        *error = "Unsupported ANM version";
+        return nullptr;
+    }
+    const usize sprite_table = sizeof( AnmHeader );
+    const usize script_table = sprite_table + (usize)hdr.num_sprites * sizeof( u32 );
+    if ( script_table + (usize)hdr.num_scripts * 2 * sizeof( u32 ) > file.length() ) {
+        *error = "Sprite and script tables run off the end of the file";
+        return nullptr;
+    }
+
+    // Count every op first so the whole file fits in one allocation
+    u32 num_ops = 0, num_interrupts = 0;
+    for ( u32 i = 0; i < hdr.num_scripts; ++i ) {
+        bytes.seek( script_table + i * 2 * sizeof( u32 ) + sizeof( u32 ) );
+        const u32 count = anm_count_ops( bytes, bytes.read<u32>(), num_interrupts );
+        if ( !count ) {
+            *error = "Script runs off the end of the file or has an unknown opcode";
+            return nullptr;
+        }
+        num_ops += count;
+    }
+
+    // Alignment padding for each of the arrays below
+    const usize capacity = sizeof( AnmFile ) + 12 * alignof( AnmFile )
+        + (usize)hdr.num_sprites * ( 5 * sizeof( u32 ) + sizeof( u8 ) )
+        + (usize)hdr.num_scripts * 3 * sizeof( u32 ) + sizeof( u32 )
+        + (usize)num_ops * sizeof( AnmOp )
+        + (usize)num_interrupts * 2 * sizeof( u32 );
+    static_assert( alignof( AnmFile ) <= alignof( u64 ) );
+    const usize mark = arena ? arena->used() : 0;
+    u8* block = arena ? (u8*)arena->alloc<u64>( ( capacity + sizeof( u64 ) - 1 ) / sizeof( u64 ) ) : mem::alloc<u8>( capacity );
+    if ( !block ) {
+        *error = "No room for the file";
+        return nullptr;
+    }
+    const auto discard = [&]( AnmFile* anm ) {
+        if ( arena ) {
+            arena->rewind( mark );
+        } else {
+            anm_free( anm );
+        }
+    };
+    mem::Arena file_arena = mem::Arena( block, capacity );
+    AnmFile* anm = file_arena.alloc<AnmFile>();
+    anm->width = hdr.width;
+    anm->height = hdr.height;
+    anm->num_sprites = hdr.num_sprites;
+    anm->num_scripts = hdr.num_scripts;
+    anm->num_ops = num_ops;
+    anm->sprite_ids = file_arena.alloc<u32>( hdr.num_sprites );
+    anm->sprite_x = file_arena.alloc<f32>( hdr.num_sprites );
+    anm->sprite_y = file_arena.alloc<f32>( hdr.num_sprites );
+    anm->sprite_w = file_arena.alloc<f32>( hdr.num_sprites );
+    anm->sprite_h = file_arena.alloc<f32>( hdr.num_sprites );
+    anm->sprite_page = file_arena.alloc<u8>( hdr.num_sprites );
+    anm->script_ids = file_arena.alloc<u32>( hdr.num_scripts );
+    anm->script_begin = file_arena.alloc<u32>( hdr.num_scripts );
+    anm->ops = file_arena.alloc<AnmOp>( num_ops );
+    anm->num_interrupts = num_interrupts;
+    anm->interrupt_begin = file_arena.alloc<u32>( hdr.num_scripts + 1 );
+    anm->interrupt_labels = file_arena.alloc<i32>( num_interrupts );
+    anm->interrupt_ops = file_arena.alloc<u32>( num_interrupts );
+    HK_ASSERT( anm->ops || !num_ops );
+
+    // A name that fills the buffer may have been cut short
+    bool names_fit = true;
+    if ( hdr.texture_path_offset ) {
+        bytes.seek( hdr.texture_path_offset );
+        names_fit &= bytes.read_c_string( anm->texture_path, arrlen( anm->texture_path ) ) + 1 < arrlen( anm->texture_path );
+    }
+    if ( hdr.texture_alpha_path_offset ) {
+        bytes.seek( hdr.texture_alpha_path_offset );
+        names_fit &= bytes.read_c_string( anm->texture_alpha_path, arrlen( anm->texture_alpha_path ) ) + 1 < arrlen( anm->texture_alpha_path );
+    }
+    if ( !names_fit ) {
+        *error = "Texture path is longer than a PBG entry name";
+        discard( anm );
+        return nullptr;
+    }
+
+    for ( u32 i = 0; i < hdr.num_sprites; ++i ) {
+        bytes.seek( sprite_table + i * sizeof( u32 ) );
+        bytes.seek( bytes.read<u32>() );
+        anm->sprite_ids[i] = bytes.read<u32>();
+        anm->sprite_x[i] = bytes.read<f32>();
+        anm->sprite_y[i] = bytes.read<f32>();
+        anm->sprite_w[i] = bytes.read<f32>();
+        anm->sprite_h[i] = bytes.read<f32>();
+        anm->sprite_page[i] = ANM_NO_ATLAS_PAGE;
+    }
+
+    // Jumps are byte offsets from the start of their script
+    Array<u32> op_offsets = Array<u32>( num_ops );
+    u32 next = 0, next_interrupt = 0;
+    for ( u32 i = 0; i < hdr.num_scripts; ++i ) {
+        bytes.seek( script_table + i * 2 * sizeof( u32 ) );
+        anm->script_ids[i] = bytes.read<u32>();
+        const usize script_offset = bytes.read<u32>();
+        const u32 begin = anm->script_begin[i] = next;
+        anm->interrupt_begin[i] = next_interrupt;
+        bytes.seek( script_offset );
+        for ( bool done = false; !done; ++next ) {
+            const usize op_offset = bytes.tell();
+            AnmOp& op = anm->ops[next];
+            op.time = bytes.read<u16>();
+            op.opcode = (AnmOpcode)bytes.read<u8>();
+            const u8 size = bytes.read<u8>();
+            anm_decode_operands( bytes, op, size );
+            op_offsets[next] = (u32)( op_offset - script_offset );
+            bytes.seek( op_offset + ANM_OP_HEADER_SIZE + size );
+            done = op.opcode == AnmOpcode::Delete;
+        }
+
+        // An op timed before one that already ran is due at once and doesn't turn the script's
+        // clock back, so later ops stay timed from the latest time reached
+        u16 clock = 0;
+        for ( u32 j = begin; j < next; ++j ) {
+            AnmOp& op = anm->ops[j];
+            clock = max( clock, op.time );
+            if ( j + 1 < next && anm->ops[j + 1].time > clock ) {
+                op.delay = anm->ops[j + 1].time - clock;
+            }
+            if ( op.opcode == AnmOpcode::InterruptLabel ) {
+                anm->interrupt_labels[next_interrupt] = op.i[0];
+                anm->interrupt_ops[next_interrupt++] = j;
+            } else if ( op.opcode == AnmOpcode::Jump ) {
+                u32 target = begin;
+                while ( target < next && op_offsets[target] != op.u[0] ) {
+                    ++target;
+                }
+                if ( target == next ) {
+                    *error = "Jump doesn't land on an op of its script";
+                    discard( anm );
+                    return nullptr;
+                }
+                op.u[0] = target;
+            } else if ( op.opcode == AnmOpcode::SetSprite || op.opcode == AnmOpcode::SetRandomSprite ) {
+                const i32 sprite = anm_find_sprite( anm, op.u[0] );
+                if ( sprite < 0 ) {
+                    *error = "Script uses a sprite the file doesn't have";
+                    discard( anm );
+                    return nullptr;
+                }
+                op.u[0] = (u32)sprite;
+            }
+        }
+    }
+    anm->interrupt_begin[hdr.num_scripts] = next_interrupt;
+
+    if ( bytes.overrun() ) {
+        *error = "Sprite or string offset out of bounds";
+        discard( anm );
+        return nullptr;
+    }
+    return anm;
+}
+
+AnmFile* anm_load( Span<const u8> file, const char** error ) {
+    return anm_load_into( file, nullptr, error );
+}
+
+AnmFile* anm_load( Span<const u8> file, mem::Arena& arena, const char** error ) {
+    return anm_load_into( file, &arena, error );
+}
+
+void anm_free( AnmFile* anm ) {
+    // The AnmFile is at the start of its block
+    mem::free( (u8*)anm );
+}
+
+i32 anm_find_script( const AnmFile* anm, u32 id ) {
+    for ( u32 i = 0; i < anm->num_scripts; ++i ) {
+        if ( anm->script_ids[i] == id ) {
+            return (i32)i;
+        }
+    }
+    return -1;
+}
+
+//
+// ANM virtual machine
+//
+
+// Jumps back to an op with the same time would otherwise loop forever
+constexpr u32 MAX_ANM_OPS_PER_STEP = 256;
+
+i32 anm_file_set_add( AnmFileSet& set, const AnmFile* anm ) {
+    if ( set.num_files == MAX_ANM_FILES || anm->num_scripts > MAX_ANM_SCRIPTS ) {
+        return -1;
+    }
+    set.files[set.num_files] = anm;
+    return (i32)set.num_files++;
+}
+
+void anm_vm_init( AnmVm& vm, u32 seed ) {
+    vm.count = 0;
+    vm.dirty = false;
+    vm.rng = seed ? seed : 1;
+    vm.num_free_ids = MAX_ANM_INSTANCES;
+    for ( u32 i = 0; i < MAX_ANM_INSTANCES; ++i ) {
+        // Low IDs are handed out first
+        vm.free_ids[i] = MAX_ANM_INSTANCES - 1 - i;
+        vm.slots[i] = INVALID_ANM_INSTANCE;
+    }
+}
+
+// xorshift32, part of the state so runs replay exactly
+static u32 anm_vm_random( AnmVm& vm ) {
+    u32 x = vm.rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return vm.rng = x;
+}
+
+u32 anm_vm_spawn( AnmVm& vm, const AnmFileSet& files, u32 file, u32 script, f32 x, f32 y ) {
+    if ( !vm.num_free_ids || file >= files.num_files || script >= files.files[file]->num_scripts ) {
+        return INVALID_ANM_INSTANCE;
+    }
+    const u32 id = vm.free_ids[--vm.num_free_ids];
+    const u32 i = vm.count++;
+#define X( type, name ) vm.name[i] = type();
+    ANM_VM_FIELDS( X )
+#undef X
+    vm.file[i] = (u16)file;
+    vm.script[i] = (u16)script;
+    vm.id[i] = id;
+    vm.pc[i] = files.files[file]->script_begin[script];
+    vm.wait[i] = files.files[file]->ops[vm.pc[i]].time;
+    vm.flags[i] = ANM_RUNNING | ANM_VISIBLE;
+    vm.x[i] = x;
+    vm.y[i] = y;
+    vm.prev_x[i] = x;
+    vm.prev_y[i] = y;
+    vm.scale_x[i] = 1.0f;
+    vm.scale_y[i] = 1.0f;
+    vm.color[i] = 0xFFFFFF;
+    vm.alpha[i] = 0xFF;
+    vm.slots[id] = i;
+    vm.dirty = true;
+    return id;
+}
+
+i32 anm_vm_find( const AnmVm& vm, u32 id ) {
+    if ( id >= MAX_ANM_INSTANCES || vm.slots[id] == INVALID_ANM_INSTANCE || ( vm.flags[vm.slots[id]] & ANM_REMOVED ) ) {
+        return -1;
+    }
+    return (i32)vm.slots[id];
+}
+
+void anm_vm_interrupt( AnmVm& vm, const AnmFileSet& files, u32 id, i32 label ) {
+    const i32 i = anm_vm_find( vm, id );
+    if ( i < 0 ) {
+        return;
+    }
+    const AnmFile* anm = files.files[vm.file[i]];
+    const u32 script = vm.script[i];
+    for ( u32 k = anm->interrupt_begin[script]; k < anm->interrupt_begin[script + 1]; ++k ) {
+        if ( anm->interrupt_labels[k] == label ) {
+            vm.pc[i] = anm->interrupt_ops[k];
+            vm.wait[i] = 0;
+            vm.flags[i] = ( vm.flags[i] & ~ANM_WAITING ) | ANM_RUNNING;
+            return;
+        }
+    }
+}
+
+// Dispatch jumps straight from the end of one op's handler to the next op's, where the compiler allows it
+#if defined(HK_GCC) || defined(HK_CLANG)
+#   define ANM_COMPUTED_GOTO
+#endif
+
+// Run the ops of instance `i` that are due this frame
+static void anm_vm_run( AnmVm& vm, const AnmFileSet& files, u32 i ) {
+    u32 flags = vm.flags[i];
+    if ( ( flags & ( ANM_RUNNING | ANM_WAITING ) ) != ANM_RUNNING ) {
+        return;
+    }
+    if ( vm.wait[i] ) {
+        --vm.wait[i];
+        return;
+    }
+    const AnmOp* ops = files.files[vm.file[i]]->ops;
+    const AnmOp* op = &ops[vm.pc[i]];
+    u32 wait = 0;
+    u32 budget = MAX_ANM_OPS_PER_STEP;
+
+    // ANM_NEXT() follows an op that ran: stop if the next op is due on a later frame, run it otherwise.
+    // ANM_STOP() follows an op that ends the frame, with `op` left at the op to resume from
+#ifdef ANM_COMPUTED_GOTO
+    static void* const handlers[] = {
+        &&op_Delete, &&op_SetSprite, &&op_SetScale, &&op_SetAlpha, &&op_SetColor, &&op_Jump,
+        &&op_Unknown6, &&op_ToggleMirrored, &&op_Unknown8, &&op_Set3DRotations,
+        &&op_Set3DRotationsSpeed, &&op_SetScaleSpeed, &&op_Fade, &&op_SetBlendModeAdd,
+        &&op_SetBlendModeAlphaBlend, &&op_KeepStill, &&op_SetRandomSprite, &&op_Set3DTranslation,
+        &&op_MoveToLinear, &&op_MoveToDecel, &&op_MoveToAccel, &&op_Wait, &&op_InterruptLabel,
+        &&op_SetCornerRelativePlacement, &&op_WaitEx, &&op_SetAllowOffset, &&op_SetAutoOrientation,
+        &&op_ShiftTextureX, &&op_ShiftTextureY, &&op_SetVisible, &&op_ScaleIn,
+    };
+    static_assert( arrlen( handlers ) == (usize)AnmOpcode::Count );
+#   define ANM_OP( name ) op_##name:
+#   define ANM_DISPATCH() if ( !budget-- ) { goto done; } goto *handlers[(usize)op->opcode]
+    ANM_DISPATCH();
+    {
+#else
+#   define ANM_OP( name ) case AnmOpcode::name:
+#   define ANM_DISPATCH() continue
+    while ( budget-- ) switch ( op->opcode ) {
+    default:
+#endif
+#define ANM_NEXT() if ( op->delay ) { wait = op->delay - 1; ++op; goto done; } ++op; ANM_DISPATCH()
+#define ANM_STOP() ++op; goto done
+
+    ANM_OP( Unknown6 ) ANM_OP( Unknown8 ) ANM_OP( InterruptLabel ) {
+        ANM_NEXT();
+    }
+    ANM_OP( Delete ) {
+        flags = ( flags & ~ANM_RUNNING ) | ANM_REMOVED;
+        vm.dirty = true;
+        goto done;
+    }
+    ANM_OP( SetSprite ) {
+        vm.sprite[i] = op->i[0];
+        ANM_NEXT();
+    }
+    ANM_OP( SetScale ) {
+        vm.scale_x[i] = op->f[0];
+        vm.scale_y[i] = op->f[1];
+        ANM_NEXT();
+    }
+    ANM_OP( SetAlpha ) {
+        vm.alpha[i] = (u8)op->u[0];
+        ANM_NEXT();
+    }
+    ANM_OP( SetColor ) {
+        // Operands are B, G, R. Kept as R, G, B bytes in memory like GfxSprite::color
+        vm.color[i] = ( op->u[2] & 0xFF ) | ( ( op->u[1] & 0xFF ) << 8 ) | ( ( op->u[0] & 0xFF ) << 16 );
+        ANM_NEXT();
+    }
+    ANM_OP( Jump ) {
+        // The target is due right away, whatever its time
+        op = &ops[op->u[0]];
+        ANM_DISPATCH();
+    }
+    ANM_OP( ToggleMirrored ) {
+        flags ^= ANM_MIRRORED;
+        ANM_NEXT();
+    }
+    ANM_OP( Set3DRotations ) {
+        vm.rotation_x[i] = op->f[0];
+        vm.rotation_y[i] = op->f[1];
+        vm.rotation_z[i] = op->f[2];
+        ANM_NEXT();
+    }
+    ANM_OP( Set3DRotationsSpeed ) {
+        vm.rotation_speed_x[i] = op->f[0];
+        vm.rotation_speed_y[i] = op->f[1];
+        vm.rotation_speed_z[i] = op->f[2];
+        ANM_NEXT();
+    }
+    ANM_OP( SetScaleSpeed ) {
+        vm.scale_speed_x[i] = op->f[0];
+        vm.scale_speed_y[i] = op->f[1];
+        ANM_NEXT();
+    }
+    ANM_OP( Fade ) {
+        vm.fade_from[i] = vm.alpha[i];
+        vm.fade_to[i] = (u8)op->i[0];
+        vm.fade_time[i] = 0;
+        vm.fade_duration[i] = max( op->i[1], 0 );
+        if ( !vm.fade_duration[i] ) {
+            vm.alpha[i] = vm.fade_to[i];
+        }
+        ANM_NEXT();
+    }
+    ANM_OP( SetBlendModeAdd ) {
+        vm.blend[i] = AnmBlend::Add;
+        ANM_NEXT();
+    }
+    ANM_OP( SetBlendModeAlphaBlend ) {
+        vm.blend[i] = AnmBlend::Alpha;
+        ANM_NEXT();
+    }
+    ANM_OP( KeepStill ) {
+        flags &= ~ANM_RUNNING;
+        ANM_STOP();
+    }
+    ANM_OP( SetRandomSprite ) {
+        vm.sprite[i] = op->i[0] + ( op->i[1] > 0 ? (i32)( anm_vm_random( vm ) % (u32)op->i[1] ) : 0 );
+        ANM_NEXT();
+    }
+    ANM_OP( Set3DTranslation ) {
+        vm.x[i] = op->f[0];
+        vm.y[i] = op->f[1];
+        vm.z[i] = op->f[2];
+        ANM_NEXT();
+    }
+    ANM_OP( MoveToLinear ) {
+        vm.move_ease[i] = AnmEase::Linear;
+        goto move;
+    }
+    ANM_OP( MoveToDecel ) {
+        vm.move_ease[i] = AnmEase::Decelerate;
+        goto move;
+    }
+    ANM_OP( MoveToAccel ) {
+        vm.move_ease[i] = AnmEase::Accelerate;
+        goto move;
+    }
+    move: {
+        vm.move_from_x[i] = vm.x[i];
+        vm.move_from_y[i] = vm.y[i];
+        vm.move_from_z[i] = vm.z[i];
+        vm.move_to_x[i] = op->f[0];
+        vm.move_to_y[i] = op->f[1];
+        vm.move_to_z[i] = op->f[2];
+        vm.move_time[i] = 0;
+        vm.move_duration[i] = max( op->i[3], 0 );
+        if ( !vm.move_duration[i] ) {
+            vm.x[i] = op->f[0];
+            vm.y[i] = op->f[1];
+            vm.z[i] = op->f[2];
+        }
+        ANM_NEXT();
+    }
+    ANM_OP( Wait ) ANM_OP( WaitEx ) {
+        flags |= ANM_WAITING;
+        ANM_STOP();
+    }
+    ANM_OP( SetCornerRelativePlacement ) {
+        flags |= ANM_CORNER_RELATIVE;
+        ANM_NEXT();
+    }
+    ANM_OP( SetAllowOffset ) {
+        flags = op->i[0] ? ( flags | ANM_ALLOW_OFFSET ) : ( flags & ~ANM_ALLOW_OFFSET );
+        ANM_NEXT();
+    }
+    ANM_OP( SetAutoOrientation ) {
+        flags = op->i[0] ? ( flags | ANM_AUTO_ORIENT ) : ( flags & ~ANM_AUTO_ORIENT );
+        ANM_NEXT();
+    }
+    ANM_OP( ShiftTextureX ) {
+        vm.uv_speed_x[i] = op->f[0];
+        ANM_NEXT();
+    }
+    ANM_OP( ShiftTextureY ) {
+        vm.uv_speed_y[i] = op->f[0];
+        ANM_NEXT();
+    }
+    ANM_OP( SetVisible ) {
+        flags = op->i[0] ? ( flags | ANM_VISIBLE ) : ( flags & ~ANM_VISIBLE );
+        ANM_NEXT();
+    }
+    ANM_OP( ScaleIn ) {
+        vm.scale_from_x[i] = vm.scale_x[i];
+        vm.scale_from_y[i] = vm.scale_y[i];
+        vm.scale_to_x[i] = op->f[0];
+        vm.scale_to_y[i] = op->f[1];
+        vm.scale_time[i] = 0;
+        vm.scale_duration[i] = max( op->i[2], 0 );
+        if ( !vm.scale_duration[i] ) {
+            vm.scale_x[i] = op->f[0];
+            vm.scale_y[i] = op->f[1];
+        }
+        ANM_NEXT();
+    }
+    }
+#undef ANM_OP
+#undef ANM_DISPATCH
+#undef ANM_NEXT
+#undef ANM_STOP
+
+done:
+    vm.pc[i] = (u32)( op - ops );
+    vm.wait[i] = wait;
+    vm.flags[i] = flags;
+}
+
+static f32 anm_ease( AnmEase ease, f32 t ) {
+    switch ( ease ) {
+    case AnmEase::Decelerate: return 1.0f - ( 1.0f - t ) * ( 1.0f - t );
+    case AnmEase::Accelerate: return t * t;
+    default: return t;
+    }
+}
+
+void anm_integrate_scalar( AnmVm& vm, u32 begin, u32 end ) {
+    for ( u32 i = begin; i < end; ++i ) {
+        if ( !( vm.flags[i] & ANM_RUNNING ) ) {
+            continue;
+        }
+        vm.rotation_x[i] += vm.rotation_speed_x[i];
+        vm.rotation_y[i] += vm.rotation_speed_y[i];
+        vm.rotation_z[i] += vm.rotation_speed_z[i];
+        vm.scale_x[i] += vm.scale_speed_x[i];
+        vm.scale_y[i] += vm.scale_speed_y[i];
+        vm.uv_x[i] += vm.uv_speed_x[i];
+        vm.uv_y[i] += vm.uv_speed_y[i];
+
+        if ( vm.fade_duration[i] ) {
+            const i32 t = ++vm.fade_time[i];
+            const f32 s = (f32)t / (f32)vm.fade_duration[i];
+            vm.alpha[i] = (u8)(i32)( (f32)vm.fade_from[i] + (f32)( (i32)vm.fade_to[i] - (i32)vm.fade_from[i] ) * s );
+            if ( t >= vm.fade_duration[i] ) {
+                vm.fade_duration[i] = 0;
+            }
+        }
+        if ( vm.move_duration[i] ) {
+            const i32 t = ++vm.move_time[i];
+            const f32 s = anm_ease( vm.move_ease[i], (f32)t / (f32)vm.move_duration[i] );
+            vm.x[i] = vm.move_from_x[i] + ( vm.move_to_x[i] - vm.move_from_x[i] ) * s;
+            vm.y[i] = vm.move_from_y[i] + ( vm.move_to_y[i] - vm.move_from_y[i] ) * s;
+            vm.z[i] = vm.move_from_z[i] + ( vm.move_to_z[i] - vm.move_from_z[i] ) * s;
+            if ( t >= vm.move_duration[i] ) {
+                vm.move_duration[i] = 0;
+            }
+        }
+        if ( vm.scale_duration[i] ) {
+            const i32 t = ++vm.scale_time[i];
+            const f32 s = (f32)t / (f32)vm.scale_duration[i];
+            vm.scale_x[i] = vm.scale_from_x[i] + ( vm.scale_to_x[i] - vm.scale_from_x[i] ) * s;
+            vm.scale_y[i] = vm.scale_from_y[i] + ( vm.scale_to_y[i] - vm.scale_from_y[i] ) * s;
+            if ( t >= vm.scale_duration[i] ) {
+                vm.scale_duration[i] = 0;
+            }
+        }
+    }
+}
+
+const char* anm_simd_name( AnmSimd simd ) {
+    switch ( simd ) {
+    case AnmSimd::Scalar: return "scalar";
+    case AnmSimd::Sse2: return "SSE2";
+    case AnmSimd::Avx2: return "AVX2";
+    case AnmSimd::Neon: return "NEON";
+    default: return "unknown";
+    }
+}
+
+bool anm_simd_supported( AnmSimd simd ) {
+    const u32 cpu = sys::get_cpu_features();
+    switch ( simd ) {
+    case AnmSimd::Scalar: return true;
+#if defined(HK_X64)
+    case AnmSimd::Sse2: return cpu & sys::CPU_SSE2;
+    case AnmSimd::Avx2: return cpu & sys::CPU_AVX2;
+#elif defined(HK_ARM64)
+    case AnmSimd::Neon: return cpu & sys::CPU_NEON;
+#endif
+    default: return false;
+    }
+}
+
+AnmSimd anm_simd_best() {
+    static const AnmSimd best = [] {
+        for ( AnmSimd simd : { AnmSimd::Avx2, AnmSimd::Sse2, AnmSimd::Neon } ) {
+            if ( anm_simd_supported( simd ) ) {
+                return simd;
+            }
+        }
+        return AnmSimd::Scalar;
+    }();
+    return best;
+}
+
+void anm_vm_integrate( AnmVm& vm, AnmSimd simd ) {
+    HK_PROFILE_ZONE( "ANM integrate" );
+    HK_DEBUG_ASSERT( anm_simd_supported( simd ) );
+    u32 done = 0;
+    switch ( simd ) {
+#if defined(HK_X64)
+    case AnmSimd::Sse2: done = anm_integrate_sse2( vm, vm.count ); break;
+    case AnmSimd::Avx2: done = anm_integrate_avx2( vm, vm.count ); break;
+#elif defined(HK_ARM64)
+    case AnmSimd::Neon: done = anm_integrate_neon( vm, vm.count ); break;
+#endif
+    default: break;
+    }
+    anm_integrate_scalar( vm, done, vm.count );
+}
+
+// Instances sort by file, then script
+static u32 anm_vm_key( const AnmVm& vm, u32 i ) {
+    return (u32)vm.file[i] * MAX_ANM_SCRIPTS + vm.script[i];
+}
+
+template <typename T>
+static void anm_vm_permute( T* field, const u32* order, u32 count, u32* scratch ) {
+    static_assert( sizeof( T ) <= sizeof( u32 ) );
+    T* sorted = (T*)scratch;
+    for ( u32 k = 0; k < count; ++k ) {
+        sorted[k] = field[order[k]];
+    }
+    mem::copy( field, sorted, count );
+}
+
+// Drop deleted instances and group the rest by file and script, keeping their order within a script
+static void anm_vm_sort( AnmVm& vm ) {
+    HK_PROFILE_ZONE( "ANM sort" );
+    u32* order = vm.order[0];
+    u32* sorted = vm.order[1];
+    u32 count = 0;
+    for ( u32 i = 0; i < vm.count; ++i ) {
+        if ( vm.flags[i] & ANM_REMOVED ) {
+            vm.slots[vm.id[i]] = INVALID_ANM_INSTANCE;
+            vm.free_ids[vm.num_free_ids++] = vm.id[i];
+        } else {
+            order[count++] = i;
+        }
+    }
+    vm.count = count;
+    vm.dirty = false;
+    if ( !count ) {
+        return;
+    }
+
+    // LSD radix sort on a 16-bit key, a byte at a time
+    static_assert( MAX_ANM_FILES * MAX_ANM_SCRIPTS <= 0x10000 );
+    for ( u32 shift = 0; shift < 16; shift += 8 ) {
+        u32 offsets[257] = { };
+        for ( u32 k = 0; k < count; ++k ) {
+            const u32 key = anm_vm_key( vm, order[k] );
+            ++offsets[( ( key >> shift ) & 0xFF ) + 1];
+        }
+        for ( u32 b = 1; b < arrlen( offsets ); ++b ) {
+            offsets[b] += offsets[b - 1];
+        }
+        for ( u32 k = 0; k < count; ++k ) {
+            const u32 key = anm_vm_key( vm, order[k] );
+            sorted[offsets[( key >> shift ) & 0xFF]++] = order[k];
+        }
+        u32* t = order; order = sorted; sorted = t;
+    }
+
+#define X( type, name ) anm_vm_permute( vm.name, order, count, vm.scratch );
+    ANM_VM_FIELDS( X )
+#undef X
+    for ( u32 i = 0; i < count; ++i ) {
+        vm.slots[vm.id[i]] = i;
+    }
+}
+
+void anm_vm_step( AnmVm& vm, const AnmFileSet& files ) {
+    HK_PROFILE_ZONE( "ANM step" );
+    if ( vm.dirty ) {
+        anm_vm_sort( vm );
+    }
+    mem::copy( vm.prev_x, vm.x, vm.count );
+    mem::copy( vm.prev_y, vm.y, vm.count );
+    for ( u32 i = 0; i < vm.count; ++i ) {
+        anm_vm_run( vm, files, i );
+    }
+    anm_vm_integrate( vm, anm_simd_best() );
+}
+
+// Mix bytes into a running hash, 8 at a time. Floats by their bits, so -0 and NaNs count too
+static u64 anm_hash_bytes( u64 h, const void* data, usize size ) {
+    const u8* bytes = (const u8*)data;
+    for ( ; size >= sizeof( u64 ); bytes += sizeof( u64 ), size -= sizeof( u64 ) ) {
+        u64 v;
+        std::memcpy( &v, bytes, sizeof( v ) );
+        h = hash_combine( h, v );
+    }
+    if ( size ) {
+        u64 v = 0;
+        std::memcpy( &v, bytes, size );
+        h = hash_combine( h, v );
+    }
+    return h;
+}
+
+u64 anm_vm_checksum( const AnmVm& vm ) {
+    u64 h = hash_combine( hash_combine( vm.count, vm.rng ), ( (u64)vm.num_free_ids << 1 ) | vm.dirty );
+    // IDs are handed out from the top of the free list, so its order decides future IDs
+    h = anm_hash_bytes( h, vm.free_ids, vm.num_free_ids * sizeof( u32 ) );
+#define X( type, name ) h = anm_hash_bytes( h, vm.name, vm.count * sizeof( type ) );
+    ANM_VM_FIELDS( X )
+#undef X
+    return h;
+}
+
+u32 anm_vm_sprites( const AnmVm& vm, const AnmFileSet& files, const AnmTextureSet& textures, f32 alpha, u32 begin, u32 end, GfxSprite* out ) {
+    u32 n = 0;
+    for ( u32 i = begin; i < end; ++i ) {
+        const AnmFile* anm = files.files[vm.file[i]];
+        if ( ( vm.flags[i] & ( ANM_VISIBLE | ANM_REMOVED ) ) != ANM_VISIBLE || (u32)vm.sprite[i] >= anm->num_sprites ) {
+            continue;
+        }
+        const u32 s = (u32)vm.sprite[i];
+        // Rects are in texels of the file's texture until they're moved to a page
+        const bool paged = anm->sprite_page[s] != ANM_NO_ATLAS_PAGE;
+        const f32 tw = paged ? (f32)ANM_ATLAS_SIZE : (f32)anm->width;
+        const f32 th = paged ? (f32)ANM_ATLAS_SIZE : (f32)anm->height;
+        GfxSprite& sprite = out[n++];
+        sprite.x = vm.prev_x[i] + ( vm.x[i] - vm.prev_x[i] ) * alpha;
+        sprite.y = vm.prev_y[i] + ( vm.y[i] - vm.prev_y[i] ) * alpha;
+        sprite.width = anm->sprite_w[s] * vm.scale_x[i];
+        sprite.height = anm->sprite_h[s] * vm.scale_y[i];
+        sprite.rotation = vm.rotation_z[i];
+        // Scrolling is in units of the file's texture. On a page there's no wrapping around it,
+        // a scrolled sprite shows whatever lies next to its region
+        const f32 du = vm.uv_x[i] * (f32)anm->width / tw;
+        const f32 dv = vm.uv_y[i] * (f32)anm->height / th;
+        sprite.u0 = anm->sprite_x[s] / tw + du;
+        sprite.v0 = anm->sprite_y[s] / th + dv;
+        sprite.u1 = ( anm->sprite_x[s] + anm->sprite_w[s] ) / tw + du;
+        sprite.v1 = ( anm->sprite_y[s] + anm->sprite_h[s] ) / th + dv;
+        if ( vm.flags[i] & ANM_MIRRORED ) {
+            const f32 u = sprite.u0;
+            sprite.u0 = sprite.u1;
+            sprite.u1 = u;
+        }
+        sprite.color = vm.color[i] | ( (u32)vm.alpha[i] << 24 );
+        sprite.texture = paged ? textures.pages[anm->sprite_page[s]] : textures.files[vm.file[i]];
+        sprite.blend = vm.blend[i] == AnmBlend::Add ? GfxBlend::Add : GfxBlend::Alpha;
+        sprite.layer = 0;
+    }
+    return n;
+}
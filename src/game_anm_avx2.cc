@@ -0,0 +1,51 @@
+#include "game_anm_simd.hh"
+
+// Built with AVX2 enabled, see CMakeLists.txt. Only called once anm_simd_supported() says the
+// CPU has it, so nothing else belongs in this file
+
+#if defined(HK_X64)
+
+#include <immintrin.h>
+
+struct AnmLanesAvx2 {
+    using F = __m256;
+    using I = __m256i;
+    static constexpr u32 WIDTH = 8;
+
+    static F load_f( const f32* p ) { return _mm256_loadu_ps( p ); }
+    static void store_f( f32* p, F v ) { _mm256_storeu_ps( p, v ); }
+    static I load_i( const void* p ) { return _mm256_loadu_si256( (const __m256i*)p ); }
+    static void store_i( void* p, I v ) { _mm256_storeu_si256( (__m256i*)p, v ); }
+    static I load_u8( const u8* p ) { return _mm256_cvtepu8_epi32( _mm_loadl_epi64( (const __m128i*)p ) ); }
+    static void store_u8( u8* p, I v ) {
+        // Packs work within 128-bit halves, leaving 4 bytes at the bottom of each
+        v = _mm256_packs_epi32( v, v );
+        v = _mm256_packus_epi16( v, v );
+        const i32 lo = _mm256_extract_epi32( v, 0 );
+        const i32 hi = _mm256_extract_epi32( v, 4 );
+        std::memcpy( p, &lo, sizeof( lo ) );
+        std::memcpy( p + sizeof( lo ), &hi, sizeof( hi ) );
+    }
+    static F splat_f( f32 x ) { return _mm256_set1_ps( x ); }
+    static I splat_i( i32 x ) { return _mm256_set1_epi32( x ); }
+    static F add( F a, F b ) { return _mm256_add_ps( a, b ); }
+    static F sub( F a, F b ) { return _mm256_sub_ps( a, b ); }
+    static F mul( F a, F b ) { return _mm256_mul_ps( a, b ); }
+    static F div( F a, F b ) { return _mm256_div_ps( a, b ); }
+    static I add_i( I a, I b ) { return _mm256_add_epi32( a, b ); }
+    static I sub_i( I a, I b ) { return _mm256_sub_epi32( a, b ); }
+    static I and_i( I a, I b ) { return _mm256_and_si256( a, b ); }
+    static I andnot_i( I m, I v ) { return _mm256_andnot_si256( m, v ); }
+    static I eq_i( I a, I b ) { return _mm256_cmpeq_epi32( a, b ); }
+    static I gt_i( I a, I b ) { return _mm256_cmpgt_epi32( a, b ); }
+    static F to_f( I v ) { return _mm256_cvtepi32_ps( v ); }
+    static I to_i( F v ) { return _mm256_cvttps_epi32( v ); }
+    static F select_f( I m, F a, F b ) { return _mm256_blendv_ps( b, a, _mm256_castsi256_ps( m ) ); }
+    static I select_i( I m, I a, I b ) { return _mm256_blendv_epi8( b, a, m ); }
+};
+
+u32 anm_integrate_avx2( AnmVm& vm, u32 count ) {
+    return anm_integrate_lanes<AnmLanesAvx2>( vm, count );
+}
+
+#endif
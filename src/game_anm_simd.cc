@@ -0,0 +1,100 @@
+#include "game_anm_simd.hh"
+
+// Baseline instruction sets, no special compiler flags needed. AVX2 is in game_anm_avx2.cc
+
+#if defined(HK_X64)
+
+#include <emmintrin.h>
+
+struct AnmLanesSse2 {
+    using F = __m128;
+    using I = __m128i;
+    static constexpr u32 WIDTH = 4;
+
+    static F load_f( const f32* p ) { return _mm_loadu_ps( p ); }
+    static void store_f( f32* p, F v ) { _mm_storeu_ps( p, v ); }
+    static I load_i( const void* p ) { return _mm_loadu_si128( (const __m128i*)p ); }
+    static void store_i( void* p, I v ) { _mm_storeu_si128( (__m128i*)p, v ); }
+    static I load_u8( const u8* p ) {
+        i32 bytes;
+        std::memcpy( &bytes, p, sizeof( bytes ) );
+        const I v = _mm_unpacklo_epi8( _mm_cvtsi32_si128( bytes ), _mm_setzero_si128() );
+        return _mm_unpacklo_epi16( v, _mm_setzero_si128() );
+    }
+    static void store_u8( u8* p, I v ) {
+        v = _mm_packs_epi32( v, v );
+        const i32 bytes = _mm_cvtsi128_si32( _mm_packus_epi16( v, v ) );
+        std::memcpy( p, &bytes, sizeof( bytes ) );
+    }
+    static F splat_f( f32 x ) { return _mm_set1_ps( x ); }
+    static I splat_i( i32 x ) { return _mm_set1_epi32( x ); }
+    static F add( F a, F b ) { return _mm_add_ps( a, b ); }
+    static F sub( F a, F b ) { return _mm_sub_ps( a, b ); }
+    static F mul( F a, F b ) { return _mm_mul_ps( a, b ); }
+    static F div( F a, F b ) { return _mm_div_ps( a, b ); }
+    static I add_i( I a, I b ) { return _mm_add_epi32( a, b ); }
+    static I sub_i( I a, I b ) { return _mm_sub_epi32( a, b ); }
+    static I and_i( I a, I b ) { return _mm_and_si128( a, b ); }
+    static I andnot_i( I m, I v ) { return _mm_andnot_si128( m, v ); }
+    static I eq_i( I a, I b ) { return _mm_cmpeq_epi32( a, b ); }
+    static I gt_i( I a, I b ) { return _mm_cmpgt_epi32( a, b ); }
+    static F to_f( I v ) { return _mm_cvtepi32_ps( v ); }
+    static I to_i( F v ) { return _mm_cvttps_epi32( v ); }
+    static F select_f( I m, F a, F b ) {
+        const F mask = _mm_castsi128_ps( m );
+        return _mm_or_ps( _mm_and_ps( mask, a ), _mm_andnot_ps( mask, b ) );
+    }
+    static I select_i( I m, I a, I b ) { return _mm_or_si128( _mm_and_si128( m, a ), _mm_andnot_si128( m, b ) ); }
+};
+
+u32 anm_integrate_sse2( AnmVm& vm, u32 count ) {
+    return anm_integrate_lanes<AnmLanesSse2>( vm, count );
+}
+
+#elif defined(HK_ARM64)
+
+#include <arm_neon.h>
+
+struct AnmLanesNeon {
+    using F = float32x4_t;
+    using I = int32x4_t;
+    static constexpr u32 WIDTH = 4;
+
+    static F load_f( const f32* p ) { return vld1q_f32( p ); }
+    static void store_f( f32* p, F v ) { vst1q_f32( p, v ); }
+    static I load_i( const void* p ) { return vld1q_s32( (const i32*)p ); }
+    static void store_i( void* p, I v ) { vst1q_s32( (i32*)p, v ); }
+    static I load_u8( const u8* p ) {
+        u32 bytes;
+        std::memcpy( &bytes, p, sizeof( bytes ) );
+        const uint16x8_t v = vmovl_u8( vreinterpret_u8_u32( vdup_n_u32( bytes ) ) );
+        return vreinterpretq_s32_u32( vmovl_u16( vget_low_u16( v ) ) );
+    }
+    static void store_u8( u8* p, I v ) {
+        const uint16x4_t half = vmovn_u32( vreinterpretq_u32_s32( v ) );
+        const u32 bytes = vget_lane_u32( vreinterpret_u32_u8( vmovn_u16( vcombine_u16( half, half ) ) ), 0 );
+        std::memcpy( p, &bytes, sizeof( bytes ) );
+    }
+    static F splat_f( f32 x ) { return vdupq_n_f32( x ); }
+    static I splat_i( i32 x ) { return vdupq_n_s32( x ); }
+    static F add( F a, F b ) { return vaddq_f32( a, b ); }
+    static F sub( F a, F b ) { return vsubq_f32( a, b ); }
+    static F mul( F a, F b ) { return vmulq_f32( a, b ); }
+    static F div( F a, F b ) { return vdivq_f32( a, b ); }
+    static I add_i( I a, I b ) { return vaddq_s32( a, b ); }
+    static I sub_i( I a, I b ) { return vsubq_s32( a, b ); }
+    static I and_i( I a, I b ) { return vandq_s32( a, b ); }
+    static I andnot_i( I m, I v ) { return vbicq_s32( v, m ); }
+    static I eq_i( I a, I b ) { return vreinterpretq_s32_u32( vceqq_s32( a, b ) ); }
+    static I gt_i( I a, I b ) { return vreinterpretq_s32_u32( vcgtq_s32( a, b ) ); }
+    static F to_f( I v ) { return vcvtq_f32_s32( v ); }
+    static I to_i( F v ) { return vcvtq_s32_f32( v ); }
+    static F select_f( I m, F a, F b ) { return vbslq_f32( vreinterpretq_u32_s32( m ), a, b ); }
+    static I select_i( I m, I a, I b ) { return vbslq_s32( vreinterpretq_u32_s32( m ), a, b ); }
+};
+
+u32 anm_integrate_neon( AnmVm& vm, u32 count ) {
+    return anm_integrate_lanes<AnmLanesNeon>( vm, count );
+}
+
+#endif
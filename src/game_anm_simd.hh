@@ -0,0 +1,100 @@
+#ifndef _GAME_ANM_SIMD_HH_
+#define _GAME_ANM_SIMD_HH_
+
+#include "game_private.hh"
+
+//
+// ANM integration kernels
+// One kernel body, instantiated for each instruction set with a lane type `V` wrapping its
+// intrinsics. Lanes of an instance that isn't running, or whose interpolation isn't active,
+// compute a value anyway and select the old one back, so there are no branches. Every step
+// matches anm_integrate_scalar() operation for operation, which keeps the results bit-identical
+//
+// V provides:
+//   F, I                       float and 32-bit integer vectors, masks are all-ones I lanes
+//   WIDTH                      lanes per vector
+//   load_f/store_f             f32 arrays
+//   load_i/store_i             32-bit integer arrays
+//   load_u8/store_u8           u8 arrays, widened to and narrowed from 32-bit lanes
+//   splat_f/splat_i
+//   add/sub/mul/div            F
+//   add_i/sub_i/and_i          I
+//   andnot_i( m, v )           v & ~m
+//   eq_i/gt_i                  signed comparisons, to a mask
+//   to_f/to_i                  conversions, to_i truncates
+//   select_f/select_i( m, a, b )  a where m is set, b elsewhere
+//
+
+// Covers [begin, end) of the instances. Every kernel after the scalar one covers whole vectors
+// only: it returns where it stopped and the scalar kernel finishes the rest
+void anm_integrate_scalar( AnmVm& vm, u32 begin, u32 end );
+u32 anm_integrate_sse2( AnmVm& vm, u32 count );
+u32 anm_integrate_avx2( AnmVm& vm, u32 count );
+u32 anm_integrate_neon( AnmVm& vm, u32 count );
+
+template <typename V>
+static u32 anm_integrate_lanes( AnmVm& vm, u32 count ) {
+    using F = typename V::F;
+    using I = typename V::I;
+    const I zero = V::splat_i( 0 );
+    const I one = V::splat_i( 1 );
+    const I running_bit = V::splat_i( ANM_RUNNING );
+    const I decelerate = V::splat_i( (i32)AnmEase::Decelerate );
+    const I accelerate = V::splat_i( (i32)AnmEase::Accelerate );
+    const F onef = V::splat_f( 1.0f );
+
+    const u32 end = count - count % V::WIDTH;
+    for ( u32 i = 0; i < end; i += V::WIDTH ) {
+        const I running = V::eq_i( V::and_i( V::load_i( &vm.flags[i] ), running_bit ), running_bit );
+        const auto add_speed = [&]( f32* value, const f32* speed ) {
+            const F v = V::load_f( &value[i] );
+            V::store_f( &value[i], V::select_f( running, V::add( v, V::load_f( &speed[i] ) ), v ) );
+        };
+        add_speed( vm.rotation_x, vm.rotation_speed_x );
+        add_speed( vm.rotation_y, vm.rotation_speed_y );
+        add_speed( vm.rotation_z, vm.rotation_speed_z );
+        add_speed( vm.scale_x, vm.scale_speed_x );
+        add_speed( vm.scale_y, vm.scale_speed_y );
+        add_speed( vm.uv_x, vm.uv_speed_x );
+        add_speed( vm.uv_y, vm.uv_speed_y );
+
+        // Advance an interpolation's time where it's active. Returns the active lanes and how far along they are
+        const auto advance = [&]( i32* time, i32* duration, F& s ) {
+            const I d = V::load_i( &duration[i] );
+            const I active = V::andnot_i( V::eq_i( d, zero ), running );
+            const I t = V::select_i( active, V::add_i( V::load_i( &time[i] ), one ), V::load_i( &time[i] ) );
+            V::store_i( &time[i], t );
+            // Finished once t >= d, i.e. unless d > t
+            V::store_i( &duration[i], V::select_i( V::andnot_i( V::gt_i( d, t ), active ), zero, d ) );
+            s = V::div( V::to_f( t ), V::to_f( d ) );
+            return active;
+        };
+        const auto lerp = [&]( f32* value, const f32* from, const f32* to, I active, F s ) {
+            const F a = V::load_f( &from[i] );
+            const F lerped = V::add( a, V::mul( V::sub( V::load_f( &to[i] ), a ), s ) );
+            V::store_f( &value[i], V::select_f( active, lerped, V::load_f( &value[i] ) ) );
+        };
+
+        F s;
+        I active = advance( vm.fade_time, vm.fade_duration, s );
+        const I from = V::load_u8( &vm.fade_from[i] );
+        const F alpha = V::add( V::to_f( from ), V::mul( V::to_f( V::sub_i( V::load_u8( &vm.fade_to[i] ), from ) ), s ) );
+        V::store_u8( &vm.alpha[i], V::select_i( active, V::to_i( alpha ), V::load_u8( &vm.alpha[i] ) ) );
+
+        active = advance( vm.move_time, vm.move_duration, s );
+        const I ease = V::load_u8( (const u8*)&vm.move_ease[i] );
+        const F inv = V::sub( onef, s );
+        s = V::select_f( V::eq_i( ease, decelerate ), V::sub( onef, V::mul( inv, inv ) ), s );
+        s = V::select_f( V::eq_i( ease, accelerate ), V::mul( s, s ), s );
+        lerp( vm.x, vm.move_from_x, vm.move_to_x, active, s );
+        lerp( vm.y, vm.move_from_y, vm.move_to_y, active, s );
+        lerp( vm.z, vm.move_from_z, vm.move_to_z, active, s );
+
+        active = advance( vm.scale_time, vm.scale_duration, s );
+        lerp( vm.scale_x, vm.scale_from_x, vm.scale_to_x, active, s );
+        lerp( vm.scale_y, vm.scale_from_y, vm.scale_to_y, active, s );
+    }
+    return end;
+}
+
+#endif // _GAME_ANM_SIMD_HH_
@@ -0,0 +1,241 @@
+#include "game_private.hh"
+
+#include <cmath>
+
+//
+// Skyline packer
+// A page is filled from the top down. The skyline is the bottom edge of everything placed so far,
+// as segments left to right covering the page's width. Each rect goes wherever its bottom edge
+// ends up highest, which keeps the waste under the skyline low for rects sorted tallest first
+//
+
+struct SkylineSegment {
+    u32 x;
+    u32 y;
+    u32 width;
+};
+
+struct AtlasPage {
+    Array<SkylineSegment> skyline;
+};
+
+static void skyline_init( AtlasPage& page ) {
+    page.skyline.resize( 1 );
+    page.skyline[0] = { 0, 0, ANM_ATLAS_SIZE };
+}
+
+// Where a w x h rect fits with the highest bottom edge, then furthest left. False if it doesn't
+static bool skyline_find( AtlasPage& page, u32 w, u32 h, u32& index, u32& x, u32& y ) {
+    Array<SkylineSegment>& sky = page.skyline;
+    u32 best_bottom = ~0u;
+    for ( u32 i = 0; i < sky.length() && sky[i].x + w <= ANM_ATLAS_SIZE; ++i ) {
+        // Rests on the highest segment under it
+        u32 top = 0;
+        for ( u32 j = i, covered = 0; covered < w; covered += sky[j++].width ) {
+            top = max( top, sky[j].y );
+        }
+        if ( top + h <= ANM_ATLAS_SIZE && top + h < best_bottom ) {
+            best_bottom = top + h;
+            index = i;
+            x = sky[i].x;
+            y = top;
+        }
+    }
+    return best_bottom != ~0u;
+}
+
+static void skyline_place( AtlasPage& page, u32 index, u32 x, u32 bottom, u32 w ) {
+    Array<SkylineSegment>& sky = page.skyline;
+    // Cut what the rect covers out of the segments from `index` on, then put it in their place
+    u32 end = index;
+    while ( end < sky.length() && sky[end].x + sky[end].width <= x + w ) {
+        ++end;
+    }
+    if ( end < sky.length() && sky[end].x < x + w ) {
+        sky[end].width -= x + w - sky[end].x;
+        sky[end].x = x + w;
+    }
+    const usize length = sky.length();
+    const usize removed = end - index;
+    if ( removed == 0 ) {
+        sky.resize( length + 1 );
+        std::memmove( sky.buffer() + index + 1, sky.buffer() + index, ( length - index ) * sizeof( SkylineSegment ) );
+    } else if ( removed > 1 ) {
+        std::memmove( sky.buffer() + index + 1, sky.buffer() + end, ( length - end ) * sizeof( SkylineSegment ) );
+        sky.resize( length - removed + 1 );
+    }
+    sky[index] = { x, bottom, w };
+
+    // Neighbours at the same height are one segment
+    for ( u32 i = 1; i < sky.length(); ) {
+        if ( sky[i - 1].y == sky[i].y ) {
+            sky[i - 1].width += sky[i].width;
+            std::memmove( sky.buffer() + i, sky.buffer() + i + 1, ( sky.length() - i - 1 ) * sizeof( SkylineSegment ) );
+            sky.resize( sky.length() - 1 );
+        } else {
+            ++i;
+        }
+    }
+}
+
+//
+// Atlas building
+//
+
+// Whole texels of a texture, the sprites inside it round outwards to these
+struct AtlasRegion {
+    u64 texture;
+    u16 file;
+    u16 x;
+    u16 y;
+    u16 width;
+    u16 height;
+    u16 page;
+    u16 dst_x;
+    u16 dst_y;
+};
+
+static bool atlas_region_equal( const AtlasRegion& a, const AtlasRegion& b ) {
+    return a.texture == b.texture && a.x == b.x && a.y == b.y && a.width == b.width && a.height == b.height;
+}
+
+static u64 atlas_region_hash( const AtlasRegion& r ) {
+    return hash_combine( hash_combine( r.texture, ( (u64)r.x << 16 ) | r.y ), ( (u64)r.width << 16 ) | r.height );
+}
+
+bool anm_atlas_build( AnmAtlas& atlas, AnmFile* const* files, u32 num_files, const char** error ) {
+    HK_PROFILE_ZONE( "ANM atlas build" );
+    u32 num_sprites = 0;
+    for ( u32 f = 0; f < num_files; ++f ) {
+        num_sprites += files[f]->num_sprites;
+    }
+
+    // Collect each file's regions, once per texture, through an open-addressed table
+    u32 table_size = 16;
+    while ( table_size < num_sprites * 2 ) {
+        table_size *= 2;
+    }
+    Array<u32> table = Array<u32>( table_size );
+    for ( u32& slot : table ) {
+        slot = ~0u;
+    }
+    Array<AtlasRegion> regions = Array<AtlasRegion>();
+    Array<u32> sprite_regions = Array<u32>( num_sprites );
+    for ( u32 f = 0, sprite = 0; f < num_files; ++f ) {
+        const AnmFile* anm = files[f];
+        const u64 texture = hash_combine( str::hash( anm->texture_path ), str::hash( anm->texture_alpha_path ) );
+        for ( u32 i = 0; i < anm->num_sprites; ++i, ++sprite ) {
+            const f32 x0 = std::floor( anm->sprite_x[i] );
+            const f32 y0 = std::floor( anm->sprite_y[i] );
+            const f32 x1 = std::ceil( anm->sprite_x[i] + anm->sprite_w[i] );
+            const f32 y1 = std::ceil( anm->sprite_y[i] + anm->sprite_h[i] );
+            if ( !( x0 >= 0.0f && y0 >= 0.0f && x1 - x0 + 2 * ANM_ATLAS_PADDING <= (f32)ANM_ATLAS_SIZE
+                && y1 - y0 + 2 * ANM_ATLAS_PADDING <= (f32)ANM_ATLAS_SIZE && x1 <= 0xFFFF && y1 <= 0xFFFF ) ) {
+                *error = "Sprite doesn't fit on an atlas page";
+                return false;
+            }
+            AtlasRegion region = { };
+            region.texture = texture;
+            region.file = (u16)f;
+            region.x = (u16)x0;
+            region.y = (u16)y0;
+            region.width = (u16)( x1 - x0 );
+            region.height = (u16)( y1 - y0 );
+            u32 slot = (u32)atlas_region_hash( region ) & ( table_size - 1 );
+            while ( table[slot] != ~0u && !atlas_region_equal( regions[table[slot]], region ) ) {
+                slot = ( slot + 1 ) & ( table_size - 1 );
+            }
+            if ( table[slot] == ~0u ) {
+                table[slot] = (u32)regions.length();
+                regions.append( region );
+            }
+            sprite_regions[sprite] = table[slot];
+        }
+    }
+
+    // Tallest first, then widest. LSD radix sort on 12 bits of each, a byte at a time
+    static_assert( ANM_ATLAS_SIZE <= 0x1000 );
+    const u32 num_regions = (u32)regions.length();
+    Array<u32> order = Array<u32>( num_regions );
+    Array<u32> sorted = Array<u32>( num_regions );
+    const auto key = [&]( u32 r ) {
+        return ( ( 0xFFFu - regions[r].height ) << 12 ) | ( 0xFFFu - regions[r].width );
+    };
+    for ( u32 r = 0; r < num_regions; ++r ) {
+        order[r] = r;
+    }
+    for ( u32 shift = 0; shift < 24; shift += 8 ) {
+        u32 offsets[257] = { };
+        for ( u32 r = 0; r < num_regions; ++r ) {
+            ++offsets[( ( key( order[r] ) >> shift ) & 0xFF ) + 1];
+        }
+        for ( u32 b = 1; b < arrlen( offsets ); ++b ) {
+            offsets[b] += offsets[b - 1];
+        }
+        for ( u32 r = 0; r < num_regions; ++r ) {
+            sorted[offsets[( key( order[r] ) >> shift ) & 0xFF]++] = order[r];
+        }
+        for ( u32 r = 0; r < num_regions; ++r ) {
+            order[r] = sorted[r];
+        }
+    }
+
+    // Each region goes on the first page with room for it
+    AtlasPage pages[MAX_ANM_ATLAS_PAGES];
+    u32 num_pages = 0;
+    for ( u32 r : order ) {
+        AtlasRegion& region = regions[r];
+        const u32 w = region.width + 2 * ANM_ATLAS_PADDING;
+        const u32 h = region.height + 2 * ANM_ATLAS_PADDING;
+        u32 p = 0, index = 0, x = 0, y = 0;
+        while ( p < num_pages && !skyline_find( pages[p], w, h, index, x, y ) ) {
+            ++p;
+        }
+        if ( p == num_pages ) {
+            if ( num_pages == MAX_ANM_ATLAS_PAGES ) {
+                *error = "Sprites don't fit in the atlas pages";
+                return false;
+            }
+            // Always fits, sizes were checked when collecting the regions
+            skyline_init( pages[num_pages++] );
+            skyline_find( pages[p], w, h, index, x, y );
+        }
+        skyline_place( pages[p], index, x, y + h, w );
+        region.page = (u16)p;
+        region.dst_x = (u16)( x + ANM_ATLAS_PADDING );
+        region.dst_y = (u16)( y + ANM_ATLAS_PADDING );
+    }
+
+    atlas.num_pages = num_pages;
+    atlas.blits.resize( num_regions );
+    for ( u32 r = 0; r < num_regions; ++r ) {
+        const AtlasRegion& region = regions[r];
+        atlas.blits[r] = { region.file, region.page, region.x, region.y, region.width, region.height, region.dst_x, region.dst_y };
+    }
+    // Sprites keep their offset inside their region
+    for ( u32 f = 0, sprite = 0; f < num_files; ++f ) {
+        AnmFile* anm = files[f];
+        for ( u32 i = 0; i < anm->num_sprites; ++i, ++sprite ) {
+            const AtlasRegion& region = regions[sprite_regions[sprite]];
+            anm->sprite_x[i] += (f32)region.dst_x - (f32)region.x;
+            anm->sprite_y[i] += (f32)region.dst_y - (f32)region.y;
+            anm->sprite_page[i] = (u8)region.page;
+        }
+    }
+    return true;
+}
+
+void anm_atlas_blit( const AnmAtlasBlit& blit, const u8* src, u32 src_width, u32 src_height, u8* page ) {
+    const i32 pad = (i32)ANM_ATLAS_PADDING;
+    for ( i32 y = -pad; y < (i32)blit.height + pad; ++y ) {
+        // Inside the region, then inside the texture
+        const u32 ry = (u32)min( max( y, 0 ), (i32)blit.height - 1 );
+        const u32 sy = min( blit.src_y + ry, src_height - 1 );
+        u8* dst = page + ( (usize)( (i32)blit.dst_y + y ) * ANM_ATLAS_SIZE + blit.dst_x - ANM_ATLAS_PADDING ) * 4;
+        for ( i32 x = -pad; x < (i32)blit.width + pad; ++x, dst += 4 ) {
+            const u32 rx = (u32)min( max( x, 0 ), (i32)blit.width - 1 );
+            const u32 sx = min( blit.src_x + rx, src_width - 1 );
+            std::memcpy( dst, src + ( (usize)sy * src_width + sx ) * 4, 4 );
+        }
+    }
+}
@@ -3,6 +3,390 @@
 
 #include "game.hh"
 
+// Set once by connect_game() and the same for every context
 extern const EngineInterface* ei;
 
+//
+// ANM animations
+// A file loads into one allocation: the AnmFile, sprite rects, and a single op stream holding
+// every script back to back with operands already decoded, so running a script only ever
+// scans forward through memory. See docs/patterns/anm.hexpat
+//
+
+// Texture paths name entries of the PBG archive, so they're never longer than those
+constexpr usize MAX_ANM_NAME = MAX_PBG_NAME;
+
+// Operands as decoded into AnmOp, in file order
+enum class AnmOpcode : u8 {
+    Delete                      = 0,    // Ends every script
+    SetSprite                   = 1,    // u: sprite index (resolved from the sprite ID)
+    SetScale                    = 2,    // f: x, y
+    SetAlpha                    = 3,    // u: alpha
+    SetColor                    = 4,    // u: b, g, r
+    Jump                        = 5,    // u: op index in the file (resolved from a byte offset)
+    Unknown6                    = 6,
+    ToggleMirrored              = 7,
+    Unknown8                    = 8,
+    Set3DRotations              = 9,    // f: x, y, z
+    Set3DRotationsSpeed         = 10,   // f: x, y, z
+    SetScaleSpeed               = 11,   // f: x, y
+    Fade                        = 12,   // i: alpha, duration
+    SetBlendModeAdd             = 13,
+    SetBlendModeAlphaBlend      = 14,
+    KeepStill                   = 15,
+    SetRandomSprite             = 16,   // i: first sprite index, count
+    Set3DTranslation            = 17,   // f: x, y, z
+    MoveToLinear                = 18,   // f: x, y, z, i: duration
+    MoveToDecel                 = 19,   // f: x, y, z, i: duration
+    MoveToAccel                 = 20,   // f: x, y, z, i: duration
+    Wait                        = 21,
+    InterruptLabel              = 22,   // i: label
+    SetCornerRelativePlacement  = 23,
+    WaitEx                      = 24,
+    SetAllowOffset              = 25,   // i: allow
+    SetAutoOrientation          = 26,   // i: enable
+    ShiftTextureX               = 27,   // f: dx
+    ShiftTextureY               = 28,   // f: dy
+    SetVisible                  = 29,   // i: visible
+    ScaleIn                     = 30,   // f: x, y, i: duration
+
+    Count,
+};
+
+constexpr usize MAX_ANM_OPERANDS = 4;
+
+struct AnmOp {
+    // Frame the op runs on, counted from the start of the script
+    u16         time;
+    // Frames from this op to the next op of the script, zero if they run on the same frame
+    u16         delay;
+    AnmOpcode   opcode;
+    // Operands the op is too short for are zero
+    union {
+        i32     i[MAX_ANM_OPERANDS];
+        u32     u[MAX_ANM_OPERANDS];
+        f32     f[MAX_ANM_OPERANDS];
+    };
+};
+
+struct AnmFile {
+    char    texture_path[MAX_ANM_NAME];
+    char    texture_alpha_path[MAX_ANM_NAME];
+    u32     width;
+    u32     height;
+    u32     num_sprites;
+    u32     num_scripts;
+    u32     num_ops;
+    // Sprites by index, rects in texels of the file's texture, or of their atlas page once
+    // anm_atlas_build() has moved them
+    u32*    sprite_ids;
+    f32*    sprite_x;
+    f32*    sprite_y;
+    f32*    sprite_w;
+    f32*    sprite_h;
+    u8*     sprite_page;
+    // Scripts by index: the ID scripts are referred to by and the script's first op
+    u32*    script_ids;
+    u32*    script_begin;
+    AnmOp*  ops;
+    // InterruptLabels of script `s` are [interrupt_begin[s], interrupt_begin[s + 1]), with the op they're at
+    u32     num_interrupts;
+    u32*    interrupt_begin;
+    i32*    interrupt_labels;
+    u32*    interrupt_ops;
+};
+
+// Parse an ANM file. Null on failure, with `error` set to a static description
+AnmFile* anm_load( Span<const u8> file, const char** error );
+void anm_free( AnmFile* anm );
+// The same, but allocated from `arena` and freed with it rather than by anm_free()
+AnmFile* anm_load( Span<const u8> file, mem::Arena& arena, const char** error );
+
+// Index of the script with the given ID, -1 if there's none
+i32 anm_find_script( const AnmFile* anm, u32 id );
+
+// Little-endian writer for building files in code, for the tests and the demo scripts
+template <typename T>
+inline usize put( Array<u8>& out, T value ) {
+    const usize offset = out.length();
+    out.resize( offset + sizeof( T ) );
+    mem::copy( &out[offset], (const u8*)&value, sizeof( T ) );
+    return offset;
+}
+
+template <typename T>
+inline void patch( Array<u8>& out, usize offset, T value ) {
+    mem::copy( &out[offset], (const u8*)&value, sizeof( T ) );
+}
+
+inline usize put_op( Array<u8>& out, u16 time, AnmOpcode opcode, u8 size ) {
+    const usize offset = put( out, time );
+    put( out, (u8)opcode );
+    put( out, size );
+    return offset;
+}
+
+//
+// Texture atlases, see game_atlas.cc
+// Every file has its own texture, so a frame drawn straight from them binds dozens. Instead the
+// sprite rects of every file a stage uses are packed into a few large pages: the packer says
+// where each region of each texture goes, and the sprites are pointed at their copy
+//
+
+constexpr u32 ANM_ATLAS_SIZE = 2048;
+constexpr u32 MAX_ANM_ATLAS_PAGES = 16;
+// Around every region, so filtering at a sprite's edge never samples its neighbour
+constexpr u32 ANM_ATLAS_PADDING = 1;
+// sprite_page of sprites still on their own file's texture
+constexpr u8 ANM_NO_ATLAS_PAGE = 0xFF;
+
+// Copy a region of a file's texture to a page. The padding around the destination is the
+// region's edge texels repeated
+struct AnmAtlasBlit {
+    u16 file;
+    u16 page;
+    u16 src_x;
+    u16 src_y;
+    u16 width;
+    u16 height;
+    u16 dst_x;
+    u16 dst_y;
+};
+
+struct AnmAtlas {
+    u32                 num_pages;
+    Array<AnmAtlasBlit> blits;
+};
+
+// Pack the sprites of `files` into pages of ANM_ATLAS_SIZE squared and move the sprites there.
+// Regions shared by files with the same texture are stored once. Fails without changing the
+// files if a sprite is larger than a page or they need more than MAX_ANM_ATLAS_PAGES
+bool anm_atlas_build( AnmAtlas& atlas, AnmFile* const* files, u32 num_files, const char** error );
+
+// Copy a blit's region of its file's texture onto its page, both RGBA. Texels past the edge of
+// the texture repeat its edge, like the padding repeats the region's
+void anm_atlas_blit( const AnmAtlasBlit& blit, const u8* src, u32 src_width, u32 src_height, u8* page );
+
+//
+// ANM virtual machine
+// Runs every live animation instance together. Instances are stored as parallel arrays and
+// kept sorted by script, so instances running the same ops sit next to each other: one
+// pass runs the ops that are due, a second applies speeds and interpolation to everything
+//
+
+constexpr u32 MAX_ANM_INSTANCES = 16384;
+constexpr u32 MAX_ANM_FILES = 32;
+// Scripts per file the sort key has room for
+constexpr u32 MAX_ANM_SCRIPTS = 2048;
+constexpr u32 INVALID_ANM_INSTANCE = ~0u;
+
+enum : u32 {
+    ANM_RUNNING         = 1 << 0,
+    // Stopped until interrupted
+    ANM_WAITING         = 1 << 1,
+    // Deleted, dropped on the next step
+    ANM_REMOVED         = 1 << 2,
+    ANM_VISIBLE         = 1 << 3,
+    ANM_MIRRORED        = 1 << 4,
+    ANM_CORNER_RELATIVE = 1 << 5,
+    ANM_ALLOW_OFFSET    = 1 << 6,
+    ANM_AUTO_ORIENT     = 1 << 7,
+};
+
+enum class AnmBlend : u8 {
+    Alpha,
+    Add,
+};
+
+enum class AnmEase : u8 {
+    Linear,
+    Decelerate,
+    Accelerate,
+};
+
+// Per instance. `wait` counts the frames until the op at `pc` is due. Interpolations are
+// inactive while their duration is zero. `prev_x` and `prev_y` are where the last step started
+// from, to draw instances between steps
+#define ANM_VM_FIELDS(X) \
+    X(u16,      file) \
+    X(u16,      script) \
+    X(u32,      id) \
+    X(u32,      pc) \
+    X(u32,      wait) \
+    X(u32,      flags) \
+    X(AnmBlend, blend) \
+    X(i32,      sprite) \
+    X(f32,      x) \
+    X(f32,      y) \
+    X(f32,      z) \
+    X(f32,      prev_x) \
+    X(f32,      prev_y) \
+    X(f32,      scale_x) \
+    X(f32,      scale_y) \
+    X(f32,      scale_speed_x) \
+    X(f32,      scale_speed_y) \
+    X(f32,      rotation_x) \
+    X(f32,      rotation_y) \
+    X(f32,      rotation_z) \
+    X(f32,      rotation_speed_x) \
+    X(f32,      rotation_speed_y) \
+    X(f32,      rotation_speed_z) \
+    X(u32,      color) \
+    X(u8,       alpha) \
+    X(f32,      uv_x) \
+    X(f32,      uv_y) \
+    X(f32,      uv_speed_x) \
+    X(f32,      uv_speed_y) \
+    X(u8,       fade_from) \
+    X(u8,       fade_to) \
+    X(i32,      fade_time) \
+    X(i32,      fade_duration) \
+    X(AnmEase,  move_ease) \
+    X(f32,      move_from_x) \
+    X(f32,      move_from_y) \
+    X(f32,      move_from_z) \
+    X(f32,      move_to_x) \
+    X(f32,      move_to_y) \
+    X(f32,      move_to_z) \
+    X(i32,      move_time) \
+    X(i32,      move_duration) \
+    X(f32,      scale_from_x) \
+    X(f32,      scale_from_y) \
+    X(f32,      scale_to_x) \
+    X(f32,      scale_to_y) \
+    X(i32,      scale_time) \
+    X(i32,      scale_duration)
+
+// Files the VM runs scripts from. Kept out of AnmVm so the VM holds no pointers: it can be
+// copied and kept across reloads, with each instance naming its file by index. Every call
+// for a VM must be given the same set
+struct AnmFileSet {
+    const AnmFile*  files[MAX_ANM_FILES];
+    u32             num_files;
+};
+
+// Textures a file set is drawn with: each file's own, and the atlas pages its sprites were
+// moved to. Sprites on one that's 0 are drawn in their colour
+struct AnmTextureSet {
+    GfxTexture      files[MAX_ANM_FILES];
+    GfxTexture      pages[MAX_ANM_ATLAS_PAGES];
+};
+
+// Returns the file's index, or -1 if there's no room
+i32 anm_file_set_add( AnmFileSet& set, const AnmFile* anm );
+
+struct AnmVm {
+    // Live instances are [0, count)
+    u32             count;
+    // Instances were added or removed since the last sort
+    bool            dirty;
+    // For SetRandomSprite
+    u32             rng;
+    // Instance ID -> index, IDs stay valid while instances move around
+    u32             slots[MAX_ANM_INSTANCES];
+    u32             free_ids[MAX_ANM_INSTANCES];
+    u32             num_free_ids;
+    // Scratch space for sorting
+    u32             order[2][MAX_ANM_INSTANCES];
+    u32             scratch[MAX_ANM_INSTANCES];
+    // Every array is a multiple of 4 KiB long, so without the padding field i of every array
+    // would map to the same L1 set and the kernels would miss on every stream at once
+#define X(type, name) alignas(HK_CACHE_LINE) type name[MAX_ANM_INSTANCES]; u8 name##_padding[HK_CACHE_LINE];
+    ANM_VM_FIELDS(X)
+#undef X
+};
+
+void anm_vm_init( AnmVm& vm, u32 seed );
+
+// Start a script at a position. Returns the instance ID, or INVALID_ANM_INSTANCE if there's no room
+u32 anm_vm_spawn( AnmVm& vm, const AnmFileSet& files, u32 file, u32 script, f32 x, f32 y );
+
+// Index of a live instance in the arrays, until the next step. -1 once it's deleted
+i32 anm_vm_find( const AnmVm& vm, u32 id );
+
+// Jump to the script's InterruptLabel for `label` and stop waiting, if it has one
+void anm_vm_interrupt( AnmVm& vm, const AnmFileSet& files, u32 id, i32 label );
+
+// Instruction sets the integration pass has kernels for, see game_anm_simd.hh
+enum class AnmSimd : u8 {
+    Scalar,
+    Sse2,
+    Avx2,
+    Neon,
+
+    Count,
+};
+
+const char* anm_simd_name( AnmSimd simd );
+bool anm_simd_supported( AnmSimd simd );
+
+// The widest kernels the CPU runs, what anm_vm_step() uses
+AnmSimd anm_simd_best();
+
+// Apply speeds and interpolation to every running instance, the second pass of a step. Every
+// kernel gives bit-identical results
+void anm_vm_integrate( AnmVm& vm, AnmSimd simd );
+
+// Advance every instance by one frame
+void anm_vm_step( AnmVm& vm, const AnmFileSet& files );
+
+// Hash of everything a step reads or writes
+u64 anm_vm_checksum( const AnmVm& vm );
+
+// Sprites of the visible instances in [begin, end), in instance order. Positions are `alpha`
+// of the way from where the last step started to where it ended. `out` has room for
+// end - begin, returns how many were written
+u32 anm_vm_sprites( const AnmVm& vm, const AnmFileSet& files, const AnmTextureSet& textures, f32 alpha, u32 begin, u32 end, GfxSprite* out );
+
+//
+// Game state
+// Lives in the context's state block and is kept across reloads when the layout matches, so it
+// must not point into the library (string literals, functions, vtables). Pointers into the block
+// itself are fine, it never moves. Everything a simulation changes goes here, never in globals:
+// other contexts may be running on other threads
+//
+
+// Bump when the meaning of the state changes without its layout changing
+constexpr u32 GAME_STATE_VERSION = 3;
+
+// Room the resident assets need after the GameState
+constexpr usize MIN_RESIDENT_CAPACITY = 4 * 1024 * 1024;
+
+// Looping demo instances alive at once, each is interrupted to end when its slot is reused
+constexpr u32 DEMO_ORBITS = 8;
+
+struct GameState {
+    // Simulation steps since the state was created
+    u64             tick;
+    // Every animated sprite
+    AnmVm           anm;
+    // IDs of the looping demo instances
+    u32             orbits[DEMO_ORBITS];
+    // Resident assets, allocated from the rest of the state block. They're parsed once when
+    // the state is created, a reload only makes their textures again
+    mem::Arena      resident;
+    AnmFileSet      anm_files;
+    // Where the files' sprites were packed, no pages if they didn't fit
+    u32             num_anm_pages;
+    u32             num_anm_blits;
+    AnmAtlasBlit*   anm_blits;
+};
+
+// The block is cache line aligned and so is the state's offset in it
+static_assert(alignof(GameState) <= HK_CACHE_LINE);
+
+static inline GameState* get_state(GameContext* ctx) {
+    return (GameState*)((u8*)ctx->state + GAME_STATE_OFFSET);
+}
+
+static inline const GameState* get_state(const GameContext* ctx) {
+    return (const GameState*)((const u8*)ctx->state + GAME_STATE_OFFSET);
+}
+
+//
+// Self-tests, see game_test.cc
+//
+
+void game_test();
+
 #endif // _GAME_PRIVATE_HH_
@@ -0,0 +1,420 @@
+#include "game_private.hh"
+
+#define dbgmsg(...) ei->log(hk::logging::encode("GAME | " __VA_ARGS__))
+
+// Two sprites and two scripts, see docs/patterns/anm.hexpat
+static void build_test_anm( Array<u8>& out, u32* jump_offset, u32* move_offset ) {
+    constexpr usize NUM_SPRITES = 2, NUM_SCRIPTS = 2;
+    out.resize( 0 );
+    for ( usize i = 0; i < 16; ++i ) {
+        put<u32>( out, 0 );
+    }
+    patch<u32>( out, 0, NUM_SPRITES );
+    patch<u32>( out, 4, NUM_SCRIPTS );
+    patch<u32>( out, 12, 256 );
+    patch<u32>( out, 16, 128 );
+    const usize sprite_table = out.length();
+    for ( usize i = 0; i < NUM_SPRITES; ++i ) {
+        put<u32>( out, 0 );
+    }
+    const usize script_table = out.length();
+    for ( usize i = 0; i < NUM_SCRIPTS; ++i ) {
+        put<u32>( out, 0 );
+        put<u32>( out, 0 );
+    }
+
+    patch<u32>( out, 28, (u32)out.length() );
+    for ( const char c : "data/etama3.png" ) {
+        put( out, c );
+    }
+
+    for ( u32 i = 0; i < NUM_SPRITES; ++i ) {
+        patch<u32>( out, sprite_table + i * 4, (u32)out.length() );
+        put<u32>( out, 0x100 + i );
+        put<f32>( out, 16.0f * i );
+        put<f32>( out, 32.0f );
+        put<f32>( out, 16.0f );
+        put<f32>( out, 8.0f );
+    }
+
+    // Script 7: set a sprite and colour, then move forever
+    const usize script_a = out.length();
+    patch<u32>( out, script_table, 7 );
+    patch<u32>( out, script_table + 4, (u32)script_a );
+    put_op( out, 0, AnmOpcode::SetSprite, 4 );
+    put<u32>( out, 0x101 );
+    put_op( out, 0, AnmOpcode::SetColor, 4 );
+    put<u8>( out, 10 ); put<u8>( out, 20 ); put<u8>( out, 30 ); put<u8>( out, 0 );
+    *move_offset = (u32)( put_op( out, 5, AnmOpcode::MoveToLinear, 16 ) - script_a );
+    put<f32>( out, 1.0f ); put<f32>( out, 2.0f ); put<f32>( out, 0.0f ); put<i32>( out, 30 );
+    *jump_offset = (u32)( put_op( out, 35, AnmOpcode::Jump, 4 ) - script_a );
+    put<u32>( out, *move_offset );
+    put_op( out, 35, AnmOpcode::Delete, 0 );
+
+    // Script 9: an interrupt label and an op shorter than its operands
+    const usize script_b = out.length();
+    patch<u32>( out, script_table + 8, 9 );
+    patch<u32>( out, script_table + 12, (u32)script_b );
+    put_op( out, 0, AnmOpcode::InterruptLabel, 4 );
+    put<i32>( out, 1 );
+    put_op( out, 2, AnmOpcode::SetVisible, 1 );
+    put<u8>( out, 1 );
+    put_op( out, 3, AnmOpcode::Delete, 0 );
+}
+
+static void test_anm() {
+    Array<u8> file = Array<u8>();
+    u32 jump_offset = 0, move_offset = 0;
+    build_test_anm( file, &jump_offset, &move_offset );
+
+    const char* error = nullptr;
+    AnmFile* anm = anm_load( file.const_bytes(), &error );
+    HK_ASSERT( anm && !error );
+    HK_ASSERT( str::equal( anm->texture_path, "data/etama3.png" ) && anm->texture_alpha_path[0] == '\0' );
+    HK_ASSERT( anm->width == 256 && anm->height == 128 );
+    HK_ASSERT( anm->num_sprites == 2 && anm->sprite_ids[1] == 0x101 );
+    HK_ASSERT( anm->sprite_x[1] == 16.0f && anm->sprite_y[1] == 32.0f && anm->sprite_w[1] == 16.0f && anm->sprite_h[1] == 8.0f );
+    HK_ASSERT( anm->num_scripts == 2 && anm->num_ops == 8 );
+    HK_ASSERT( anm->script_begin[0] == 0 && anm->script_begin[1] == 5 );
+    HK_ASSERT( anm_find_script( anm, 9 ) == 1 && anm_find_script( anm, 8 ) == -1 );
+
+    const AnmOp* ops = anm->ops;
+    HK_ASSERT( ops[0].opcode == AnmOpcode::SetSprite && ops[0].u[0] == 1 );
+    HK_ASSERT( ops[1].opcode == AnmOpcode::SetColor && ops[1].u[0] == 10 && ops[1].u[1] == 20 && ops[1].u[2] == 30 );
+    HK_ASSERT( ops[2].time == 5 && ops[2].f[0] == 1.0f && ops[2].f[1] == 2.0f && ops[2].i[3] == 30 );
+    HK_ASSERT( ops[3].opcode == AnmOpcode::Jump && ops[3].u[0] == 2 );
+    HK_ASSERT( ops[4].opcode == AnmOpcode::Delete && ops[4].time == 35 );
+    HK_ASSERT( ops[5].opcode == AnmOpcode::InterruptLabel && ops[5].i[0] == 1 );
+    HK_ASSERT( ops[6].opcode == AnmOpcode::SetVisible && ops[6].i[0] == 0 );
+    HK_ASSERT( ops[7].opcode == AnmOpcode::Delete );
+    HK_ASSERT( ops[0].delay == 0 && ops[1].delay == 5 && ops[2].delay == 30 && ops[3].delay == 0 );
+    HK_ASSERT( anm->num_interrupts == 1 && anm->interrupt_begin[1] == 0 && anm->interrupt_begin[2] == 1 );
+    HK_ASSERT( anm->interrupt_labels[0] == 1 && anm->interrupt_ops[0] == 5 );
+    anm_free( anm );
+
+    // Truncated
+    error = nullptr;
+    HK_ASSERT( !anm_load( Span<const u8>( file.buffer(), file.length() - 8 ), &error ) && error );
+
+    // Unsupported version
+    build_test_anm( file, &jump_offset, &move_offset );
+    patch<u32>( file, 40, 2 );
+    error = nullptr;
+    HK_ASSERT( !anm_load( file.const_bytes(), &error ) && error );
+
+    // Jump into the middle of an op
+    build_test_anm( file, &jump_offset, &move_offset );
+    const usize script_a = *(const u32*)&file[64 + 2 * 4 + 4];
+    patch<u32>( file, script_a + jump_offset + 4, move_offset + 2 );
+    error = nullptr;
+    HK_ASSERT( !anm_load( file.const_bytes(), &error ) && error );
+
+    // An op timed before the one ahead of it runs right after it, and the clock doesn't go back
+    build_test_anm( file, &jump_offset, &move_offset );
+    patch<u16>( file, script_a + 8, 10 );
+    anm = anm_load( file.const_bytes(), &error );
+    HK_ASSERT( anm && anm->ops[1].time == 10 && anm->ops[2].time == 5 );
+    HK_ASSERT( anm->ops[0].delay == 10 && anm->ops[1].delay == 0 && anm->ops[2].delay == 25 );
+    anm_free( anm );
+
+    // Unknown opcode
+    build_test_anm( file, &jump_offset, &move_offset );
+    patch<u8>( file, script_a + move_offset + 2, 200 );
+    error = nullptr;
+    HK_ASSERT( !anm_load( file.const_bytes(), &error ) && error );
+
+    // Texture path too long to be a PBG entry
+    build_test_anm( file, &jump_offset, &move_offset );
+    patch<u32>( file, 28, (u32)file.length() );
+    for ( usize i = 0; i < MAX_ANM_NAME; ++i ) {
+        put( file, 'a' );
+    }
+    put( file, '\0' );
+    error = nullptr;
+    HK_ASSERT( !anm_load( file.const_bytes(), &error ) && error );
+
+    // From an arena, which gets back what a failed load took
+    u64 storage[1024];
+    mem::Arena arena = mem::Arena( storage, sizeof( storage ) );
+    error = nullptr;
+    HK_ASSERT( !anm_load( file.const_bytes(), arena, &error ) && error && arena.used() == 0 );
+    build_test_anm( file, &jump_offset, &move_offset );
+    anm = anm_load( file.const_bytes(), arena, &error );
+    HK_ASSERT( anm && (u8*)anm == (u8*)storage && anm->num_ops == 8 && anm->ops[3].u[0] == 2 );
+    mem::Arena small = mem::Arena( storage, 64 );
+    error = nullptr;
+    HK_ASSERT( !anm_load( file.const_bytes(), small, &error ) && error && small.used() == 0 );
+}
+
+static void test_anm_vm() {
+    Array<u8> file = Array<u8>();
+    u32 jump_offset = 0, move_offset = 0;
+    build_test_anm( file, &jump_offset, &move_offset );
+    const char* error = nullptr;
+    AnmFile* anm = anm_load( file.const_bytes(), &error );
+    HK_ASSERT( anm );
+
+    AnmFileSet files = {};
+    HK_ASSERT( anm_file_set_add( files, anm ) == 0 );
+    AnmTextureSet textures = {};
+    textures.files[0] = 3;
+    AnmVm* vm = mem::alloc<AnmVm>();
+    anm_vm_init( *vm, 1 );
+    HK_ASSERT( anm_vm_spawn( *vm, files, 0, 2, 0.0f, 0.0f ) == INVALID_ANM_INSTANCE );
+    const u32 a = anm_vm_spawn( *vm, files, 0, 0, 0.0f, 0.0f );
+    const u32 b = anm_vm_spawn( *vm, files, 0, 1, 0.0f, 0.0f );
+    HK_ASSERT( a != INVALID_ANM_INSTANCE && b != INVALID_ANM_INSTANCE && a != b );
+
+    // Frame 0: sprite and colour
+    anm_vm_step( *vm, files );
+    i32 i = anm_vm_find( *vm, a );
+    HK_ASSERT( i >= 0 && vm->sprite[i] == 1 && vm->color[i] == 0x0A141E && vm->wait[i] == 4 );
+
+    // Drawn with the sprite's rect, colour and file's texture
+    GfxSprite sprites[2];
+    HK_ASSERT( anm_vm_sprites( *vm, files, textures, 1.0f, 0, vm->count, sprites ) == 2 );
+    const GfxSprite& sprite = sprites[i];
+    HK_ASSERT( sprite.width == 16.0f && sprite.height == 8.0f && sprite.blend == GfxBlend::Alpha && sprite.texture == 3 );
+    HK_ASSERT( sprite.u0 == 16.0f / 256.0f && sprite.v0 == 32.0f / 128.0f );
+    HK_ASSERT( sprite.u1 == 32.0f / 256.0f && sprite.v1 == 40.0f / 128.0f );
+    HK_ASSERT( sprite.color == 0xFF0A141E );
+
+    // Frame 3: b hid itself, then deleted itself
+    anm_vm_step( *vm, files );
+    anm_vm_step( *vm, files );
+    HK_ASSERT( !( vm->flags[anm_vm_find( *vm, b )] & ANM_VISIBLE ) );
+    anm_vm_step( *vm, files );
+    HK_ASSERT( anm_vm_find( *vm, b ) == -1 );
+
+    // Frames 5 to 34: a moves to (1, 2) over 30 frames
+    anm_vm_step( *vm, files );
+    anm_vm_step( *vm, files );
+    i = anm_vm_find( *vm, a );
+    HK_ASSERT( vm->count == 1 && vm->x[i] > 0.03f && vm->x[i] < 0.04f );
+    // Drawn halfway through the last step
+    HK_ASSERT( vm->prev_x[i] == 0.0f && anm_vm_sprites( *vm, files, textures, 0.5f, 0, vm->count, sprites ) == 1 );
+    HK_ASSERT( sprites[0].x == vm->x[i] * 0.5f && sprites[0].y == vm->y[i] * 0.5f );
+    for ( u32 f = 6; f < 35; ++f ) {
+        anm_vm_step( *vm, files );
+    }
+    HK_ASSERT( vm->x[i] == 1.0f && vm->y[i] == 2.0f && vm->move_duration[i] == 0 );
+
+    // Frame 35: the jump goes back to the move at frame 5
+    anm_vm_step( *vm, files );
+    HK_ASSERT( vm->pc[i] == 3 && vm->wait[i] == 29 && vm->move_duration[i] == 30 );
+
+    // Interrupts restart from their label
+    const u32 c = anm_vm_spawn( *vm, files, 0, 1, 0.0f, 0.0f );
+    anm_vm_step( *vm, files );
+    anm_vm_step( *vm, files );
+    anm_vm_interrupt( *vm, files, c, 1 );
+    i = anm_vm_find( *vm, c );
+    HK_ASSERT( vm->pc[i] == anm->script_begin[1] && vm->wait[i] == 0 );
+
+    // Instances stay grouped by script and keep their IDs
+    u32 ids[64];
+    for ( u32 k = 0; k < arrlen( ids ); ++k ) {
+        ids[k] = anm_vm_spawn( *vm, files, 0, k % 2, (f32)k, 0.0f );
+    }
+    anm_vm_step( *vm, files );
+    for ( u32 k = 1; k < vm->count; ++k ) {
+        HK_ASSERT( vm->script[k - 1] <= vm->script[k] );
+    }
+    for ( u32 k = 0; k < arrlen( ids ); ++k ) {
+        i = anm_vm_find( *vm, ids[k] );
+        HK_ASSERT( i >= 0 && vm->id[i] == ids[k] && vm->script[i] == k % 2 );
+    }
+
+    // Same inputs, same result
+    AnmVm* other = mem::alloc<AnmVm>();
+    anm_vm_init( *vm, 7 );
+    anm_vm_init( *other, 7 );
+    for ( AnmVm* v : { vm, other } ) {
+        for ( u32 k = 0; k < 100; ++k ) {
+            anm_vm_spawn( *v, files, 0, k % 2, (f32)k, (f32)k );
+            anm_vm_step( *v, files );
+        }
+    }
+    HK_ASSERT( anm_vm_checksum( *vm ) == anm_vm_checksum( *other ) );
+
+    // Every field counts, interpolation state included
+    const u64 same = anm_vm_checksum( *other );
+    other->scale_speed_x[other->count - 1] += 1.0f;
+    HK_ASSERT( anm_vm_checksum( *other ) != same );
+    other->scale_speed_x[other->count - 1] -= 1.0f;
+    other->move_time[0] += 1;
+    HK_ASSERT( anm_vm_checksum( *other ) != same );
+    other->move_time[0] -= 1;
+    HK_ASSERT( anm_vm_checksum( *other ) == same );
+
+    mem::free( other );
+    mem::free( vm );
+    anm_free( anm );
+}
+
+// Every kernel against the scalar one, through the ends of interpolations and a partial last vector
+static void test_anm_kernels() {
+    AnmVm* expected = mem::alloc<AnmVm>();
+    AnmVm* actual = mem::alloc<AnmVm>();
+    anm_vm_init( *expected, 1 );
+    u32 rng = 1;
+    for ( u32 i = 0; i < 203; ++i ) {
+        const auto random = [&]( u32 n ) {
+            rng = rng * 1664525 + 1013904223;
+            return ( rng >> 8 ) % n;
+        };
+        expected->count = i + 1;
+        expected->flags[i] = random( 4 ) ? (u32)ANM_RUNNING : 0u;
+        expected->rotation_speed_z[i] = (f32)random( 100 ) * 0.01f;
+        expected->scale_speed_x[i] = (f32)random( 100 ) * -0.001f;
+        expected->uv_speed_y[i] = (f32)random( 100 ) * 0.5f;
+        expected->alpha[i] = (u8)random( 256 );
+        expected->fade_from[i] = (u8)random( 256 );
+        expected->fade_to[i] = (u8)random( 256 );
+        expected->fade_duration[i] = (i32)random( 40 );
+        expected->move_ease[i] = (AnmEase)random( 3 );
+        expected->move_from_x[i] = (f32)random( 640 );
+        expected->move_to_x[i] = (f32)random( 640 );
+        expected->move_to_y[i] = (f32)random( 480 );
+        expected->move_duration[i] = (i32)random( 40 );
+        expected->scale_to_x[i] = (f32)random( 4 );
+        expected->scale_duration[i] = (i32)random( 40 );
+    }
+    for ( u32 s = 1; s < (u32)AnmSimd::Count; ++s ) {
+        const AnmSimd simd = (AnmSimd)s;
+        if ( !anm_simd_supported( simd ) ) {
+            continue;
+        }
+        mem::copy( actual, expected, 1 );
+        AnmVm* reference = mem::alloc<AnmVm>();
+        mem::copy( reference, expected, 1 );
+        for ( u32 frame = 0; frame < 45; ++frame ) {
+            anm_vm_integrate( *reference, AnmSimd::Scalar );
+            anm_vm_integrate( *actual, simd );
+        }
+#define X( type, name ) HK_ASSERT( std::memcmp( actual->name, reference->name, reference->count * sizeof( type ) ) == 0 );
+        ANM_VM_FIELDS( X )
+#undef X
+        dbgmsg( "ANM kernels match: %s", anm_simd_name( simd ) );
+        mem::free( reference );
+    }
+    mem::free( actual );
+    mem::free( expected );
+}
+
+// No two blits overlap, padding included, and all of them are inside their page
+static void check_atlas( AnmAtlas& atlas ) {
+    const auto bounds = [&]( const AnmAtlasBlit& b, u32* r ) {
+        r[0] = b.dst_x - ANM_ATLAS_PADDING;
+        r[1] = b.dst_y - ANM_ATLAS_PADDING;
+        r[2] = b.dst_x + b.width + ANM_ATLAS_PADDING;
+        r[3] = b.dst_y + b.height + ANM_ATLAS_PADDING;
+    };
+    for ( usize i = 0; i < atlas.blits.length(); ++i ) {
+        u32 a[4], b[4];
+        bounds( atlas.blits[i], a );
+        HK_ASSERT( atlas.blits[i].page < atlas.num_pages && a[0] < a[2] && a[2] <= ANM_ATLAS_SIZE && a[3] <= ANM_ATLAS_SIZE );
+        for ( usize j = 0; j < i; ++j ) {
+            bounds( atlas.blits[j], b );
+            HK_ASSERT( atlas.blits[i].page != atlas.blits[j].page || a[2] <= b[0] || b[2] <= a[0] || a[3] <= b[1] || b[3] <= a[1] );
+        }
+    }
+}
+
+static void test_atlas() {
+    Array<u8> file = Array<u8>();
+    u32 jump_offset = 0, move_offset = 0;
+    build_test_anm( file, &jump_offset, &move_offset );
+    const char* error = nullptr;
+    AnmFile* files[3];
+    for ( AnmFile*& anm : files ) {
+        anm = anm_load( file.const_bytes(), &error );
+        HK_ASSERT( anm && anm->sprite_page[0] == ANM_NO_ATLAS_PAGE );
+    }
+    files[2]->texture_path[5] = 'X';
+    files[2]->sprite_x[1] += 0.5f;
+
+    // The first two files share a texture, so their sprites share regions
+    AnmAtlas atlas = AnmAtlas();
+    HK_ASSERT( anm_atlas_build( atlas, files, arrlen( files ), &error ) );
+    HK_ASSERT( atlas.num_pages == 1 && atlas.blits.length() == 4 );
+    check_atlas( atlas );
+    HK_ASSERT( files[0]->sprite_x[1] == files[1]->sprite_x[1] && files[0]->sprite_y[1] == files[1]->sprite_y[1] );
+    for ( const AnmFile* anm : files ) {
+        for ( u32 i = 0; i < anm->num_sprites; ++i ) {
+            HK_ASSERT( anm->sprite_page[i] == 0 && anm->sprite_w[i] == 16.0f && anm->sprite_h[i] == 8.0f );
+        }
+    }
+    // A sprite off the texel grid keeps its offset into the region, which rounds outwards
+    bool found = false;
+    for ( const AnmAtlasBlit& b : atlas.blits ) {
+        if ( b.file == 2 && b.src_x == 16 ) {
+            HK_ASSERT( b.width == 17 && files[2]->sprite_x[1] == b.dst_x + 0.5f && files[2]->sprite_y[1] == b.dst_y );
+            found = true;
+        }
+    }
+    HK_ASSERT( found );
+    for ( AnmFile* anm : files ) {
+        anm_free( anm );
+    }
+
+    // Lots of odd sizes over several pages
+    constexpr u32 NUM_SPRITES = 2000;
+    Array<f32> rects = Array<f32>( NUM_SPRITES * 4 );
+    Array<u8> sprite_pages = Array<u8>( NUM_SPRITES );
+    u32 rng = 1;
+    for ( u32 i = 0; i < NUM_SPRITES; ++i ) {
+        rng = rng * 1664525 + 1013904223;
+        rects[i] = (f32)( i * 7 % 1024 );
+        rects[NUM_SPRITES + i] = (f32)( i * 13 % 1024 );
+        rects[NUM_SPRITES * 2 + i] = (f32)( 1 + ( rng >> 8 ) % 128 );
+        rects[NUM_SPRITES * 3 + i] = (f32)( 1 + ( rng >> 20 ) % 96 );
+    }
+    AnmFile many = { };
+    many.num_sprites = NUM_SPRITES;
+    many.sprite_x = &rects[0];
+    many.sprite_y = &rects[NUM_SPRITES];
+    many.sprite_w = &rects[NUM_SPRITES * 2];
+    many.sprite_h = &rects[NUM_SPRITES * 3];
+    many.sprite_page = sprite_pages.buffer();
+    AnmFile* many_files[] = { &many };
+    HK_ASSERT( anm_atlas_build( atlas, many_files, 1, &error ) );
+    HK_ASSERT( atlas.num_pages > 1 && atlas.blits.length() == NUM_SPRITES );
+    check_atlas( atlas );
+
+    // Too big for a page, and nothing moves
+    rects[NUM_SPRITES * 2] = (f32)ANM_ATLAS_SIZE;
+    const f32 x = rects[1];
+    error = nullptr;
+    HK_ASSERT( !anm_atlas_build( atlas, many_files, 1, &error ) && error && rects[1] == x );
+
+    // Blits repeat the region's edge into the padding, and the texture's edge past its own
+    u8 src[3 * 2 * 4];
+    for ( u32 i = 0; i < arrlen( src ); ++i ) {
+        src[i] = (u8)( i / 4 + 1 );
+    }
+    Array<u8> page = Array<u8>( (usize)ANM_ATLAS_SIZE * ANM_ATLAS_SIZE * 4 );
+    std::memset( page.buffer(), 0, page.length() );
+    static_assert( ANM_ATLAS_PADDING == 1 );
+    const AnmAtlasBlit blit = { 0, 0, 1, 0, 3, 2, 1, 1 };
+    anm_atlas_blit( blit, src, 3, 2, page.buffer() );
+    static constexpr u8 expected[4][6] = {
+        { 2, 2, 3, 3, 3, 0 },
+        { 2, 2, 3, 3, 3, 0 },
+        { 5, 5, 6, 6, 6, 0 },
+        { 5, 5, 6, 6, 6, 0 },
+    };
+    for ( u32 y = 0; y < 4; ++y ) {
+        for ( u32 x = 0; x < 6; ++x ) {
+            HK_ASSERT( page[( y * ANM_ATLAS_SIZE + x ) * 4 + 3] == expected[y][x] );
+        }
+    }
+}
+
+void game_test() {
+    test_anm();
+    test_anm_vm();
+    test_anm_kernels();
+    test_atlas();
+    dbgmsg( "Game tests passed" );
+}
@@ -1,14 +1,33 @@
 #include "hk.hh"
 
+#include <ctime>
+
 #ifdef HK_WINDOWS
 #   include <Windows.h>
+#   include <intrin.h>
 #endif
 #ifdef HK_MACOS
+#   include <pthread.h>
+#   include <sched.h>
+#   include <sys/stat.h>
 #   include <unistd.h>
 #   include <mach-o/dyld.h>
 #endif
-#ifdef HK_LINUX
+#if defined(HK_X64) && !defined(HK_MSVC)
+#   include <cpuid.h>
 #   include <x86intrin.h>
+#endif
+#ifdef HK_LINUX
+#   include <fcntl.h>
+#   include <linux/perf_event.h>
+#   include <pthread.h>
+#   include <sched.h>
+#   include <sys/inotify.h>
+#   include <sys/ioctl.h>
+#   include <sys/mman.h>
+#   include <sys/sendfile.h>
+#   include <sys/stat.h>
+#   include <sys/syscall.h>
 #   include <unistd.h>
 #endif
 
@@ -24,23 +43,185 @@ bool hk::sys::chdir(const char* path) {
 #endif
 }
 
-bool hk::sys::copy_file(const char* src_path, const char* dst_path) {
-    std::FILE* f_src = std::fopen(src_path, "rb");
-    std::FILE* f_dst = std::fopen(dst_path, "wb");
-    if (!f_src || !f_dst) {
+#ifdef HK_LINUX
+// Copy everything from one descriptor to another without going through user space
+static bool copy_fd(i32 src, i32 dst) {
+    struct stat st = { };
+    if (fstat(src, &st) != 0) {
         return false;
     }
-    u8 buf[512] = { };
-    while (true) {
-        usize len = std::fread(buf, 1, arrlen(buf), f_src);
+    off_t offset = 0;
+    while (offset < st.st_size) {
+        if (sendfile(dst, src, &offset, (usize)(st.st_size - offset)) <= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+bool hk::sys::copy_file(const char* src_path, const char* dst_path) {
+#ifdef HK_LINUX
+    const i32 src = open(src_path, O_RDONLY | O_CLOEXEC);
+    const i32 dst = src >= 0 ? open(dst_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0755) : -1;
+    const bool ok = dst >= 0 && copy_fd(src, dst);
+    if (src >= 0) {
+        ::close(src);
+    }
+    if (dst >= 0) {
+        ::close(dst);
+    }
+    return ok;
+#else
+    std::FILE* f_src = std::fopen(src_path, "rb");
+    std::FILE* f_dst = f_src ? std::fopen(dst_path, "wb") : nullptr;
+    bool ok = f_src && f_dst;
+    static u8 buf[64 * 1024];
+    while (ok) {
+        const usize len = std::fread(buf, 1, arrlen(buf), f_src);
         if (len == 0) {
             break;
         }
-        std::fwrite(buf, 1, len, f_dst);
+        ok = std::fwrite(buf, 1, len, f_dst) == len;
     }
-    std::fclose(f_src);
-    std::fclose(f_dst);
-    return true;
+    if (f_src) {
+        std::fclose(f_src);
+    }
+    if (f_dst) {
+        ok = std::fclose(f_dst) == 0 && ok;
+    }
+    return ok;
+#endif
+}
+
+hk::i32 hk::sys::copy_file_to_memory(const char* src_path, char* path, usize path_len) {
+#ifdef HK_LINUX
+    const i32 src = open(src_path, O_RDONLY | O_CLOEXEC);
+    if (src < 0) {
+        return -1;
+    }
+    i32 fd = memfd_create(str::basename(src_path), MFD_CLOEXEC);
+    if (fd >= 0 && !copy_fd(src, fd)) {
+        ::close(fd);
+        fd = -1;
+    }
+    ::close(src);
+    if (fd >= 0) {
+        std::snprintf(path, path_len, "/proc/self/fd/%d", fd);
+    }
+    return fd;
+#else
+    (void)src_path; (void)path; (void)path_len;
+    return -1;
+#endif
+}
+
+void hk::sys::close_memory_file(i32 fd) {
+#ifdef HK_LINUX
+    if (fd >= 0) {
+        ::close(fd);
+    }
+#else
+    (void)fd;
+#endif
+}
+
+struct hk::sys::FileWatch {
+#ifdef HK_LINUX
+    i32     fd;
+    char    name[256];
+#else
+    char    path[512];
+    u64     mtime;
+#endif
+};
+
+#ifndef HK_LINUX
+static hk::u64 get_file_mtime(const char* path) {
+#ifdef HK_WINDOWS
+    WIN32_FILE_ATTRIBUTE_DATA attr = { };
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &attr)) {
+        return 0;
+    }
+    return ((hk::u64)attr.ftLastWriteTime.dwHighDateTime << 32) | attr.ftLastWriteTime.dwLowDateTime;
+#else
+    struct stat st = { };
+    if (stat(path, &st) != 0) {
+        return 0;
+    }
+    return (hk::u64)st.st_mtimespec.tv_sec * 1000000000 + (hk::u64)st.st_mtimespec.tv_nsec;
+#endif
+}
+#endif
+
+hk::sys::FileWatch* hk::sys::watch_file(const char* path) {
+    FileWatch* watch = mem::alloc<FileWatch>();
+#ifdef HK_LINUX
+    // Watch the directory, linkers usually replace the file rather than rewriting it
+    char dir[512] = { };
+    std::snprintf(dir, sizeof(dir), "%s", path);
+    if (!str::dirname(dir)) {
+        std::snprintf(dir, sizeof(dir), ".");
+    }
+    std::snprintf(watch->name, sizeof(watch->name), "%s", str::basename(path));
+    watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->fd < 0 || inotify_add_watch(watch->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        close_file_watch(watch);
+        return nullptr;
+    }
+#else
+    std::snprintf(watch->path, sizeof(watch->path), "%s", path);
+    watch->mtime = get_file_mtime(path);
+#endif
+    return watch;
+}
+
+void hk::sys::close_file_watch(FileWatch* watch) {
+    if (!watch) {
+        return;
+    }
+#ifdef HK_LINUX
+    if (watch->fd >= 0) {
+        ::close(watch->fd);
+    }
+#endif
+    mem::free(watch);
+}
+
+bool hk::sys::poll_file_watch(FileWatch* watch) {
+    bool changed = false;
+#ifdef HK_LINUX
+    alignas(inotify_event) char buf[4096];
+    isize len = 0;
+    while ((len = ::read(watch->fd, buf, sizeof(buf))) > 0) {
+        for (isize i = 0; i < len; ) {
+            const inotify_event* e = (const inotify_event*)&buf[i];
+            changed |= e->len && str::equal(e->name, watch->name);
+            i += (isize)sizeof(inotify_event) + e->len;
+        }
+    }
+#else
+    const u64 mtime = get_file_mtime(watch->path);
+    changed = mtime != watch->mtime;
+    watch->mtime = mtime;
+#endif
+    return changed;
+}
+
+bool hk::sys::read_file(const char* path, Array<u8>& data) {
+    std::FILE* f = std::fopen(path, "rb");
+    if (!f) {
+        return false;
+    }
+    bool ok = std::fseek(f, 0, SEEK_END) == 0;
+    const long size = ok ? std::ftell(f) : -1;
+    ok = size >= 0 && std::fseek(f, 0, SEEK_SET) == 0;
+    if (ok) {
+        data.resize((usize)size);
+        ok = size == 0 || std::fread(data.buffer(), 1, (usize)size, f) == (usize)size;
+    }
+    std::fclose(f);
+    return ok;
 }
 
 void hk::sys::create_console() {
@@ -66,22 +247,1236 @@ bool hk::sys::get_exe_path(char* path, usize len) {
 }
 
 hk::u64 hk::sys::get_cpu_ticks() {
-    // NOTE(HK): This is probably really bad and wrong
-    // MSVC: Assume ARM64, just use __rdtsc - XXX(HK): wrong on multi-core systems?
-    // CLANG: Use __builtin_readcyclecounter() on AMD64, otherwise read CNTVCT_EL0 on ARM64
-#if defined(HK_MSVC)
+#if defined(HK_X64)
     return (u64)__rdtsc();
-#elif defined(HK_CLANG)
-#ifdef __aarch64__
+#elif defined(HK_ARM64) && defined(HK_MSVC)
+    return (u64)_ReadStatusReg(ARM64_CNTVCT);
+#elif defined(HK_ARM64)
     u64 result = 0;
     asm volatile("mrs %0, cntvct_el0" : "=r" (result));
     return result;
-#else
+#elif defined(HK_CLANG)
     return (u64)__builtin_readcyclecounter();
-#endif
-#elif defined(HK_GCC)
-    return __rdtsc();
 #else
 #   error not implemented
 #endif
 }
+
+//
+// Clock
+//
+
+// OS monotonic clock, the fallback and the reference for calibration
+static hk::u64 get_os_time_ns() {
+#ifdef HK_WINDOWS
+    static LARGE_INTEGER freq = { };
+    if (!freq.QuadPart) {
+        QueryPerformanceFrequency(&freq);
+    }
+    LARGE_INTEGER now = { };
+    QueryPerformanceCounter(&now);
+    return (u64)(now.QuadPart / freq.QuadPart) * 1000000000ull + (u64)(now.QuadPart % freq.QuadPart) * 1000000000ull / (u64)freq.QuadPart;
+#else
+    timespec ts = { };
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + (u64)ts.tv_nsec;
+#endif
+}
+
+// (a * b) >> 32 without overflowing
+static inline hk::u64 mul_shr32(hk::u64 a, hk::u64 b) {
+#if defined(HK_MSVC) && defined(HK_X64)
+    u64 hi = 0;
+    const u64 lo = _umul128(a, b, &hi);
+    return (hi << 32) | (lo >> 32);
+#elif defined(HK_MSVC)
+    return (__umulh(a, b) << 32) | ((a * b) >> 32);
+#else
+    return (u64)(((unsigned __int128)a * b) >> 32);
+#endif
+}
+
+// Get the CPU timestamp counter frequency if it ticks at a constant rate on every core
+static hk::u64 get_invariant_cpu_ticks_freq() {
+#if defined(HK_ARM64) && defined(HK_MSVC)
+    return (u64)_ReadStatusReg(ARM64_CNTFRQ);
+#elif defined(HK_ARM64)
+    // The generic timer is architecturally constant-rate and synchronized
+    u64 freq = 0;
+    asm volatile("mrs %0, cntfrq_el0" : "=r" (freq));
+    return freq;
+#elif defined(HK_X64)
+    u32 regs[4] = { };
+    const auto cpuid = [&regs](u32 leaf) {
+#ifdef HK_MSVC
+        __cpuid((int*)regs, (int)leaf);
+#else
+        __cpuid(leaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+    };
+    // Invariant TSC: CPUID.80000007H:EDX[8]
+    cpuid(0x80000000);
+    if (regs[0] < 0x80000007) {
+        return 0;
+    }
+    cpuid(0x80000007);
+    if (!(regs[3] & (1 << 8))) {
+        return 0;
+    }
+    // Exact frequency from the crystal clock ratio, when the CPU reports it
+    cpuid(0);
+    if (regs[0] >= 0x15) {
+        cpuid(0x15);
+        if (regs[0] && regs[1] && regs[2]) {
+            return (u64)regs[2] * regs[1] / regs[0];
+        }
+    }
+    // Otherwise measure it against the OS clock
+    const u64 ns1 = get_os_time_ns();
+    const u64 t1 = sys::get_cpu_ticks();
+    u64 ns2 = ns1;
+    while ((ns2 = get_os_time_ns()) - ns1 < 5000000) { }
+    const u64 t2 = sys::get_cpu_ticks();
+    return (t2 - t1) * 1000000000ull / (ns2 - ns1);
+#else
+    return 0;
+#endif
+}
+
+static hk::sys::ClockCalibration clock_calibration = { };
+// 0 = uncalibrated, 1 = calibrating, 2 = ready
+static std::atomic<int> clock_state = 0;
+
+static const hk::sys::ClockCalibration& get_clock() {
+    if (clock_state.load(std::memory_order_acquire) != 2) {
+        int expected = 0;
+        if (clock_state.compare_exchange_strong(expected, 1)) {
+            sys::ClockCalibration c = { };
+            if (const u64 freq = get_invariant_cpu_ticks_freq()) {
+                c.cpu_ticks = true;
+                c.base_ns = get_os_time_ns();
+                c.base_ticks = sys::get_cpu_ticks();
+                c.ns_per_tick = (1000000000ull << 32) / freq;
+            } else {
+                c.ns_per_tick = 1ull << 32;
+            }
+            clock_calibration = c;
+            clock_state.store(2, std::memory_order_release);
+        } else {
+            while (clock_state.load(std::memory_order_acquire) != 2) {
+                sys::yield_thread();
+            }
+        }
+    }
+    return clock_calibration;
+}
+
+hk::sys::ClockCalibration hk::sys::get_clock_calibration() {
+    return get_clock();
+}
+
+void hk::sys::set_clock_calibration(const ClockCalibration& calibration) {
+    clock_calibration = calibration;
+    clock_state.store(2, std::memory_order_release);
+}
+
+hk::u64 hk::sys::get_clock_ticks() {
+    return get_clock().cpu_ticks ? get_cpu_ticks() : get_os_time_ns();
+}
+
+hk::u64 hk::sys::clock_ticks_to_ns(u64 ticks) {
+    const ClockCalibration& c = get_clock();
+    if (ticks >= c.base_ticks) {
+        return c.base_ns + mul_shr32(ticks - c.base_ticks, c.ns_per_tick);
+    }
+    return c.base_ns - mul_shr32(c.base_ticks - ticks, c.ns_per_tick);
+}
+
+hk::u64 hk::sys::get_time_ns() {
+    return clock_ticks_to_ns(get_clock_ticks());
+}
+
+void hk::sys::sleep_ms(u32 ms) {
+#ifdef HK_WINDOWS
+    Sleep(ms);
+#else
+    timespec ts = { (time_t)(ms / 1000), (long)(ms % 1000) * 1000000 };
+    while (nanosleep(&ts, &ts) != 0) { }
+#endif
+}
+
+hk::u32 hk::sys::get_cpu_count() {
+#ifdef HK_WINDOWS
+    SYSTEM_INFO si = { };
+    GetSystemInfo(&si);
+    return (u32)si.dwNumberOfProcessors;
+#else
+    const long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (u32)n : 1;
+#endif
+}
+
+hk::u32 hk::sys::get_cpu_features() {
+#if defined(HK_X64)
+    static const u32 features = [] {
+        u32 regs[4] = { };
+        const auto cpuid = [&regs](u32 leaf, u32 subleaf) {
+#ifdef HK_MSVC
+            __cpuidex((int*)regs, (int)leaf, (int)subleaf);
+#else
+            __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+        };
+        // SSE2 is part of x86-64
+        u32 result = CPU_SSE2;
+        cpuid(0, 0);
+        const u32 max_leaf = regs[0];
+        // AVX: CPUID.1:ECX[28], and OSXSAVE[27] for the OS to save the YMM registers
+        cpuid(1, 0);
+        if (max_leaf < 7 || (regs[2] & (3u << 27)) != (3u << 27)) {
+            return result;
+        }
+#ifdef HK_MSVC
+        const u64 xcr0 = _xgetbv(0);
+#else
+        u32 xcr0_lo = 0, xcr0_hi = 0;
+        asm volatile("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+        const u64 xcr0 = ((u64)xcr0_hi << 32) | xcr0_lo;
+#endif
+        // AVX2: CPUID.(7,0):EBX[5], with XMM and YMM state enabled
+        cpuid(7, 0);
+        if ((xcr0 & 6) == 6 && (regs[1] & (1 << 5))) {
+            result |= CPU_AVX2;
+        }
+        return result;
+    }();
+    return features;
+#elif defined(HK_ARM64)
+    // NEON is part of AArch64
+    return CPU_NEON;
+#else
+    return 0;
+#endif
+}
+
+//
+// Hardware performance counters
+//
+
+#ifdef HK_LINUX
+static thread_local struct {
+    bool    opened;
+    i32     group_fd = -1;
+    i32     fds[sys::PERF_COUNTER_COUNT];
+    u64     ids[sys::PERF_COUNTER_COUNT];
+    u32     available;
+} perf;
+
+static void open_perf_counters() {
+    static const struct { u32 type; u64 config; } configs[sys::PERF_COUNTER_COUNT] = {
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    };
+    perf.opened = true;
+    for (usize i = 0; i < sys::PERF_COUNTER_COUNT; ++i) {
+        perf_event_attr attr = { };
+        attr.size = sizeof(attr);
+        attr.type = configs[i].type;
+        attr.config = configs[i].config;
+        attr.disabled = perf.group_fd == -1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        // Counters missing on this CPU (or VM) are left out of the group rather than failing all of them
+        const i32 fd = (i32)syscall(SYS_perf_event_open, &attr, 0, -1, perf.group_fd, 0);
+        perf.fds[i] = -1;
+        if (fd < 0) {
+            continue;
+        }
+        if (ioctl(fd, PERF_EVENT_IOC_ID, &perf.ids[i]) != 0) {
+            // Without its id the counter can't be found in the group's reads, closing it takes it out
+            ::close(fd);
+            continue;
+        }
+        perf.fds[i] = fd;
+        if (perf.group_fd == -1) {
+            perf.group_fd = fd;
+        }
+        perf.available |= 1u << i;
+    }
+    if (perf.group_fd != -1) {
+        ioctl(perf.group_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(perf.group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+#endif
+
+bool hk::sys::read_perf_counters(PerfCounters& counters) {
+    counters = { };
+#ifdef HK_LINUX
+    if (!perf.opened) {
+        open_perf_counters();
+    }
+    if (perf.group_fd == -1) {
+        return false;
+    }
+    // nr, time_enabled, time_running, then { value, id } per counter
+    u64 buf[3 + 2 * PERF_COUNTER_COUNT] = { };
+    if (::read(perf.group_fd, buf, sizeof(buf)) < (isize)(3 * sizeof(u64))) {
+        return false;
+    }
+    const u64 nr = min<u64>(buf[0], PERF_COUNTER_COUNT);
+    const u64 enabled = buf[1], running = buf[2];
+    for (u64 i = 0; i < nr; ++i) {
+        const u64 value = buf[3 + i * 2], id = buf[4 + i * 2];
+        for (usize c = 0; c < PERF_COUNTER_COUNT; ++c) {
+            if ((perf.available & (1u << c)) && perf.ids[c] == id) {
+                // Estimate the full count when the kernel time-sliced the group
+                counters.values[c] = running && running < enabled ? (u64)((f64)value * ((f64)enabled / (f64)running)) : value;
+            }
+        }
+    }
+    counters.available = perf.available;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void hk::sys::close_perf_counters() {
+#ifdef HK_LINUX
+    for (usize i = 0; perf.opened && i < PERF_COUNTER_COUNT; ++i) {
+        if (perf.fds[i] >= 0) {
+            ::close(perf.fds[i]);
+        }
+    }
+    perf = { };
+#endif
+}
+
+const char* hk::sys::get_perf_counter_name(PerfCounter counter) {
+    switch (counter) {
+    case PerfCounter::Cycles:       return "cycles";
+    case PerfCounter::Instructions: return "instructions";
+    case PerfCounter::L1DMisses:    return "L1D misses";
+    case PerfCounter::LLCMisses:    return "LLC misses";
+    case PerfCounter::BranchMisses: return "branch misses";
+    default:                        return "?";
+    }
+}
+
+//
+// Threads
+//
+
+struct hk::sys::Thread {
+#ifdef HK_WINDOWS
+    HANDLE      handle;
+#else
+    pthread_t   handle;
+#endif
+    ThreadFn    fn;
+    void*       user;
+};
+
+#ifdef HK_WINDOWS
+static DWORD WINAPI thread_entry(LPVOID param) {
+#else
+static void* thread_entry(void* param) {
+#endif
+    hk::sys::Thread* t = (hk::sys::Thread*)param;
+    t->fn(t->user);
+    return 0;
+}
+
+hk::sys::Thread* hk::sys::create_thread(ThreadFn fn, void* user) {
+    Thread* t = mem::alloc<Thread>();
+    t->fn = fn;
+    t->user = user;
+#ifdef HK_WINDOWS
+    if (!(t->handle = CreateThread(NULL, 0, thread_entry, t, 0, NULL))) {
+#else
+    if (pthread_create(&t->handle, NULL, thread_entry, t) != 0) {
+#endif
+        mem::free(t);
+        return nullptr;
+    }
+    return t;
+}
+
+void hk::sys::join_thread(Thread* thread) {
+#ifdef HK_WINDOWS
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+#else
+    pthread_join(thread->handle, NULL);
+#endif
+    mem::free(thread);
+}
+
+void hk::sys::yield_thread() {
+#ifdef HK_WINDOWS
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+//
+// Job system
+//
+
+// Must be a power of two. Jobs that don't fit are executed immediately by the pushing thread
+constexpr hk::usize JOB_DEQUE_SIZE = 1024;
+constexpr hk::u32   MAX_JOB_THREADS = 32;
+
+// Continuation list of a counter whose jobs have all finished, and of a new one
+static hk::sys::Job* const DONE_LIST = (hk::sys::Job*)(uintptr_t)1;
+
+// Chase-Lev deque, with the memory orderings from "Correct and Efficient Work-Stealing for
+// Weak Memory Models" (Le et al. 2013). Only the owner pushes and pops at the bottom, any
+// thread may steal from the top.
+struct JobDeque {
+    alignas(HK_CACHE_LINE) std::atomic<i64>         top;
+    alignas(HK_CACHE_LINE) std::atomic<i64>         bottom;
+    alignas(HK_CACHE_LINE) std::atomic<sys::Job*>   jobs[JOB_DEQUE_SIZE];
+
+    bool push(sys::Job* job) {
+        const i64 b = bottom.load(std::memory_order_relaxed);
+        const i64 t = top.load(std::memory_order_acquire);
+        if (b - t >= (i64)JOB_DEQUE_SIZE) {
+            return false;
+        }
+        // Release on the slot as well as the fence publishes the job's fields in a way
+        // ThreadSanitizer understands, and is free on x86
+        jobs[b & (JOB_DEQUE_SIZE - 1)].store(job, std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    sys::Job* pop() {
+        const i64 b = bottom.load(std::memory_order_relaxed) - 1;
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        i64 t = top.load(std::memory_order_relaxed);
+        if (t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        sys::Job* job = jobs[b & (JOB_DEQUE_SIZE - 1)].load(std::memory_order_acquire);
+        if (t == b) {
+            // Last job, race the stealers for it
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                job = nullptr;
+            }
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return job;
+    }
+
+    sys::Job* steal() {
+        i64 t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const i64 b = bottom.load(std::memory_order_acquire);
+        if (t >= b) {
+            return nullptr;
+        }
+        sys::Job* job = jobs[t & (JOB_DEQUE_SIZE - 1)].load(std::memory_order_acquire);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return job;
+    }
+};
+
+struct JobThread {
+    JobDeque        deque;
+    sys::Thread*    thread;
+    u32             rng;
+};
+
+static struct {
+    JobThread           threads[MAX_JOB_THREADS];
+    u32                 num_threads;
+    std::atomic<bool>   quit;
+    // Bumped whenever jobs are queued, sleeping workers wait on it
+    std::atomic<u32>    epoch;
+    std::atomic<u32>    sleepers;
+} jobs = { };
+
+static thread_local i32 job_thread_index = -1;
+
+static sys::Job* find_job(i32 self_idx) {
+    if (self_idx >= 0) {
+        if (sys::Job* job = jobs.threads[self_idx].deque.pop()) {
+            return job;
+        }
+    }
+    // Steal, starting at a random victim
+    u32 victim = 0;
+    if (self_idx >= 0) {
+        u32& rng = jobs.threads[self_idx].rng;
+        rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+        victim = rng;
+    }
+    for (u32 i = 0; i < jobs.num_threads; ++i) {
+        const u32 idx = (victim + i) % jobs.num_threads;
+        if ((i32)idx == self_idx) {
+            continue;
+        }
+        if (sys::Job* job = jobs.threads[idx].deque.steal()) {
+            return job;
+        }
+    }
+    return nullptr;
+}
+
+static void wake_workers() {
+    jobs.epoch.fetch_add(1);
+    if (jobs.sleepers.load()) {
+        jobs.epoch.notify_all();
+    }
+}
+
+static void execute_job(sys::Job* job);
+
+// Push jobs that have already been counted
+static void queue_jobs(sys::Job** list, usize count) {
+    const i32 idx = job_thread_index;
+    for (usize i = 0; i < count; ++i) {
+        if (idx < 0 || !jobs.threads[idx].deque.push(list[i])) {
+            execute_job(list[i]);
+        }
+    }
+    wake_workers();
+}
+
+static void release_continuations(sys::JobCounter* counter) {
+    // This is the last time this thread may touch the counter, wait_jobs() returns
+    // as soon as it sees DONE_LIST
+    sys::Job* job = counter->continuations.exchange(DONE_LIST, std::memory_order_acq_rel);
+    while (job) {
+        // Read the link first, the job may finish (and be freed) as soon as it's queued
+        sys::Job* next = job->next;
+        queue_jobs(&job, 1);
+        job = next;
+    }
+}
+
+static void execute_job(sys::Job* job) {
+    sys::JobCounter* counter = job->counter;
+    job->fn(job->user);
+    if (counter && counter->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        release_continuations(counter);
+    }
+}
+
+static void job_worker(void* user) {
+    job_thread_index = (i32)(uintptr_t)user;
+    char name[32];
+    std::snprintf(name, sizeof(name), "Job worker %d", job_thread_index);
+    prof::set_thread_name(name);
+    while (!jobs.quit.load(std::memory_order_acquire)) {
+        const u32 epoch = jobs.epoch.load();
+        sys::Job* job = nullptr;
+        for (u32 spin = 0; spin < 64 && !job; ++spin) {
+            if (!(job = find_job(job_thread_index))) {
+                sys::yield_thread();
+            }
+        }
+        if (job) {
+            execute_job(job);
+            continue;
+        }
+        jobs.sleepers.fetch_add(1);
+        if (!jobs.quit.load()) {
+            jobs.epoch.wait(epoch);
+        }
+        jobs.sleepers.fetch_sub(1);
+    }
+}
+
+void hk::sys::init_jobs(u32 num_workers) {
+    HK_ASSERT(jobs.num_threads == 0 && "Job system already initialized");
+    if (num_workers == 0) {
+        num_workers = get_cpu_count() - 1;
+    }
+    num_workers = min(num_workers, MAX_JOB_THREADS - 1);
+    jobs.quit = false;
+    jobs.num_threads = 1 + num_workers;
+    job_thread_index = 0;
+    for (u32 i = 0; i < jobs.num_threads; ++i) {
+        jobs.threads[i].rng = 0x9E3779B9u * (i + 1);
+    }
+    for (u32 i = 1; i < jobs.num_threads; ++i) {
+        if (!(jobs.threads[i].thread = create_thread(job_worker, (void*)(uintptr_t)i))) {
+            HK_ASSERT(0 && "Failed to start job thread");
+        }
+    }
+}
+
+void hk::sys::shutdown_jobs() {
+    HK_ASSERT(job_thread_index == 0);
+    jobs.quit = true;
+    wake_workers();
+    jobs.epoch.notify_all();
+    for (u32 i = 1; i < jobs.num_threads; ++i) {
+        join_thread(jobs.threads[i].thread);
+        jobs.threads[i].thread = nullptr;
+    }
+    jobs.num_threads = 0;
+    job_thread_index = -1;
+}
+
+hk::u32 hk::sys::get_job_thread_count() {
+    return max(jobs.num_threads, 1u);
+}
+
+hk::i32 hk::sys::get_job_thread_index() {
+    return job_thread_index;
+}
+
+// Re-arm a counter that had no jobs left. The last one must have been fully released, otherwise
+// that release could mark the new jobs done
+static void arm_counter(sys::JobCounter* counter) {
+    sys::Job* const previous = counter->continuations.exchange(nullptr, std::memory_order_acq_rel);
+    HK_ASSERT(previous == DONE_LIST && "Job counter reused before it was done");
+    (void)previous;
+}
+
+void hk::sys::run_jobs(Job* list, usize count, JobCounter* counter) {
+    if (!count) {
+        return;
+    }
+    if (counter->pending.fetch_add((u32)count, std::memory_order_acq_rel) == 0) {
+        arm_counter(counter);
+    }
+    Job* queue[64];
+    while (count) {
+        const usize n = min(count, arrlen(queue));
+        for (usize i = 0; i < n; ++i) {
+            list[i].counter = counter;
+            list[i].next = nullptr;
+            queue[i] = &list[i];
+        }
+        queue_jobs(queue, n);
+        list += n; count -= n;
+    }
+}
+
+void hk::sys::run_jobs_after(JobCounter* dependency, Job* list, usize count, JobCounter* counter) {
+    if (!count) {
+        return;
+    }
+    if (counter->pending.fetch_add((u32)count, std::memory_order_acq_rel) == 0) {
+        arm_counter(counter);
+    }
+    for (usize i = 0; i < count; ++i) {
+        list[i].counter = counter;
+        list[i].next = i + 1 < count ? &list[i + 1] : nullptr;
+    }
+    Job* head = dependency->continuations.load(std::memory_order_acquire);
+    do {
+        if (head == DONE_LIST) {
+            // Dependency already finished
+            Job* queue[64];
+            while (count) {
+                const usize n = min(count, arrlen(queue));
+                for (usize i = 0; i < n; ++i) {
+                    queue[i] = &list[i];
+                }
+                queue_jobs(queue, n);
+                list += n; count -= n;
+            }
+            return;
+        }
+        list[count - 1].next = head;
+    } while (!dependency->continuations.compare_exchange_weak(head, list, std::memory_order_acq_rel, std::memory_order_acquire));
+}
+
+void hk::sys::wait_jobs(JobCounter* counter) {
+    while (counter->continuations.load(std::memory_order_acquire) != DONE_LIST) {
+        if (Job* job = find_job(job_thread_index)) {
+            execute_job(job);
+        } else {
+            yield_thread();
+        }
+    }
+}
+
+struct ParallelForBatch {
+    sys::ParallelForFn  fn;
+    void*               user;
+    usize               begin;
+    usize               end;
+};
+
+static void parallel_for_job(void* user) {
+    HK_PROFILE_ZONE("parallel_for batch");
+    const ParallelForBatch* batch = (const ParallelForBatch*)user;
+    batch->fn(batch->user, batch->begin, batch->end);
+}
+
+void hk::sys::parallel_for(usize count, usize batch, ParallelForFn fn, void* user) {
+    constexpr usize MAX_BATCHES = 256;
+    if (!count) {
+        return;
+    }
+    const u32 num_threads = get_job_thread_count();
+    if (!batch) {
+        batch = max<usize>(count / (num_threads * 4), 1);
+    }
+    // Batches live on the stack, never allocate
+    batch = max(batch, (count + MAX_BATCHES - 1) / MAX_BATCHES);
+    const usize num_batches = (count + batch - 1) / batch;
+    if (num_threads == 1 || num_batches == 1) {
+        fn(user, 0, count);
+        return;
+    }
+    Job list[MAX_BATCHES];
+    ParallelForBatch batches[MAX_BATCHES];
+    for (usize i = 0; i < num_batches; ++i) {
+        batches[i] = { fn, user, i * batch, min(count, (i + 1) * batch) };
+        list[i].fn = parallel_for_job;
+        list[i].user = &batches[i];
+    }
+    JobCounter counter;
+    run_jobs(list, num_batches, &counter);
+    wait_jobs(&counter);
+}
+
+//
+// Asynchronous logging
+//
+
+// Must be a power of two
+constexpr hk::usize LOG_RING_SIZE = 1024;
+constexpr hk::u32   MAX_LOG_THREADS = 64;
+constexpr hk::usize MAX_LOG_MESSAGE = 1024;
+
+typedef hk::SpscRing<hk::logging::Record, LOG_RING_SIZE> LogRing;
+
+static struct {
+    std::atomic<LogRing*>       rings[MAX_LOG_THREADS];
+    std::atomic<u32>            num_rings;
+    // Bumped when shutdown() frees the rings, so threads know theirs is gone
+    std::atomic<u32>            generation;
+    std::atomic<std::FILE*>     out;
+    std::atomic<bool>           running;
+    std::atomic<bool>           stopped;
+    std::atomic<bool>           quit;
+    std::atomic<u64>            dropped;
+    // flush() bumps flush_requested, the writer publishes the last request it fully drained
+    std::atomic<u64>            flush_requested;
+    std::atomic<u64>            flush_done;
+    std::atomic<u64>            start_ns;
+    sys::Thread*                writer;
+} logger = { };
+
+static thread_local LogRing* log_ring = nullptr;
+static thread_local u32 log_ring_generation = 0;
+
+static bool log_arg_matches(char conv, logging::ArgType type) {
+    switch (conv) {
+    case 's':
+        return type == logging::ArgType::String;
+    case 'p':
+        return type == logging::ArgType::Pointer;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+        return type == logging::ArgType::Double;
+    default:
+        return type != logging::ArgType::String && type != logging::ArgType::Double && type != logging::ArgType::Pointer;
+    }
+}
+
+hk::usize hk::logging::format(const Record& r, char* buf, usize len) {
+    usize n = 0;
+    usize arg = 0;
+    const char* f = r.fmt;
+    while (*f) {
+        if (*f != '%' || f[1] == '%') {
+            if (n + 1 < len) {
+                buf[n] = *f;
+            }
+            ++n;
+            f += *f == '%' ? 2 : 1;
+            continue;
+        }
+        // Copy the conversion specification
+        char spec[32] = { };
+        usize spec_len = 0;
+        spec[spec_len++] = *f++;
+        usize num_stars = 0;
+        while (*f && !std::strchr("diouxXeEfFgGaAcspn", *f) && spec_len + 2 < sizeof(spec)) {
+            num_stars += *f == '*';
+            spec[spec_len++] = *f++;
+        }
+        if (!*f) {
+            break;
+        }
+        const char conv = spec[spec_len++] = *f++;
+        char* dst = n < len ? buf + n : nullptr;
+        const usize room = n < len ? len - n : 0;
+        // A '*' width and precision are int arguments ahead of the value
+        int stars[2] = { };
+        bool valid = conv != 'n' && num_stars <= 2;
+        for (usize i = 0; valid && i < num_stars; ++i, ++arg) {
+            valid = arg < r.num_args && r.types[arg] == ArgType::Int;
+            stars[i] = valid ? (int)r.args[arg] : 0;
+        }
+        const auto print = [&](auto value) {
+            switch (num_stars) {
+            case 0:  return std::snprintf(dst, room, spec, value);
+            case 1:  return std::snprintf(dst, room, spec, stars[0], value);
+            default: return std::snprintf(dst, room, spec, stars[0], stars[1], value);
+            }
+        };
+        int written = 0;
+        if (!valid || arg >= r.num_args || !log_arg_matches(conv, r.types[arg])) {
+            written = std::snprintf(dst, room, "<?>");
+        } else {
+            const u64 a = r.args[arg];
+            switch (r.types[arg]) {
+            case ArgType::Int:       written = print((int)a); break;
+            case ArgType::UInt:      written = print((unsigned int)a); break;
+            case ArgType::Long:      written = print((long)a); break;
+            case ArgType::ULong:     written = print((unsigned long)a); break;
+            case ArgType::LongLong:  written = print((long long)a); break;
+            case ArgType::ULongLong: written = print((unsigned long long)a); break;
+            case ArgType::Pointer:   written = print((void*)(uintptr_t)a); break;
+            case ArgType::String:    written = print((const char*)&r.strings[a]); break;
+            case ArgType::Double: {
+                f64 d = 0.0;
+                std::memcpy(&d, &a, sizeof(d));
+                written = print(d);
+            } break;
+            }
+        }
+        ++arg;
+        n += written > 0 ? (usize)written : 0;
+    }
+    if (len) {
+        buf[min(n, len - 1)] = '\0';
+    }
+    return n;
+}
+
+// Format and write records with a single write call, where possible
+static void log_write_records(const logging::Record* records, usize count, char* text, usize text_size) {
+    std::FILE* out = logger.out.load(std::memory_order_acquire);
+    if (!out) {
+        return;
+    }
+    u64 start_ns = logger.start_ns.load(std::memory_order_relaxed);
+    if (!start_ns) {
+        logger.start_ns.compare_exchange_strong(start_ns, sys::clock_ticks_to_ns(records[0].time));
+        start_ns = logger.start_ns.load(std::memory_order_relaxed);
+    }
+    usize len = 0;
+    for (usize i = 0; i < count; ++i) {
+        if (len + MAX_LOG_MESSAGE + 32 > text_size) {
+            std::fwrite(text, 1, len, out);
+            len = 0;
+        }
+        const logging::Record& r = records[i];
+        const u64 time_ns = sys::clock_ticks_to_ns(r.time);
+        const f64 t = time_ns > start_ns ? (f64)(time_ns - start_ns) / 1e9 : 0.0;
+        len += (usize)std::snprintf(&text[len], 32, "+%.3f | ", t);
+        len += min(logging::format(r, &text[len], MAX_LOG_MESSAGE), MAX_LOG_MESSAGE - 1);
+        text[len++] = '\n';
+    }
+    std::fwrite(text, 1, len, out);
+    std::fflush(out);
+}
+
+// Write until quit is set and everything queued before it has been written
+static void log_drain() {
+    static logging::Record batch[256];
+    static char text[64 * 1024];
+    while (true) {
+        const u64 flush_requested = logger.flush_requested.load(std::memory_order_acquire);
+        const bool quit = logger.quit.load(std::memory_order_acquire);
+
+        usize count = 0;
+        const u32 num_rings = min(logger.num_rings.load(std::memory_order_acquire), MAX_LOG_THREADS);
+        for (u32 i = 0; i < num_rings && count < arrlen(batch); ++i) {
+            if (LogRing* ring = logger.rings[i].load(std::memory_order_acquire)) {
+                count += ring->pop_n(&batch[count], arrlen(batch) - count);
+            }
+        }
+        // Interleave threads by time. Batches are mostly sorted already
+        for (usize i = 1; i < count; ++i) {
+            for (usize j = i; j > 0 && batch[j].time < batch[j - 1].time; --j) {
+                const logging::Record tmp = batch[j];
+                batch[j] = batch[j - 1];
+                batch[j - 1] = tmp;
+            }
+        }
+        if (const u64 dropped = logger.dropped.exchange(0)) {
+            static const char* DROPPED_FMT = "LOG  | Dropped %" PRIu64 " messages, ring full";
+            const logging::Record r = logging::encode(DROPPED_FMT, dropped);
+            log_write_records(&r, 1, text, sizeof(text));
+        }
+        if (count) {
+            HK_PROFILE_ZONE("Log write");
+            log_write_records(batch, count, text, sizeof(text));
+            continue;
+        }
+
+        // Everything submitted before these requests has been written
+        logger.flush_done.store(flush_requested, std::memory_order_release);
+        if (quit) {
+            break;
+        }
+        sys::sleep_ms(1);
+    }
+}
+
+static void log_writer(void*) {
+    prof::set_thread_name("Log writer");
+    log_drain();
+}
+
+void hk::logging::init(std::FILE* out) {
+    HK_ASSERT(!logger.running);
+    logger.out = out;
+    u64 expected = 0;
+    logger.start_ns.compare_exchange_strong(expected, sys::get_time_ns());
+    logger.quit = false;
+    logger.stopped = false;
+    if ((logger.writer = sys::create_thread(log_writer, nullptr))) {
+        logger.running = true;
+    } else {
+        // Nothing will drain the rings, write what's queued and carry on synchronously
+        logger.stopped = true;
+        logger.quit = true;
+        log_drain();
+    }
+}
+
+void hk::logging::shutdown() {
+    if (!logger.running) {
+        return;
+    }
+    logger.stopped = true;
+    logger.running = false;
+    logger.quit = true;
+    sys::join_thread(logger.writer);
+    logger.writer = nullptr;
+    // The writer drained everything on its way out
+    const u32 num_rings = min(logger.num_rings.load(), MAX_LOG_THREADS);
+    for (u32 i = 0; i < num_rings; ++i) {
+        if (LogRing* ring = logger.rings[i].exchange(nullptr)) {
+            ring->~LogRing();
+            mem::free(ring);
+        }
+    }
+    logger.num_rings = 0;
+    logger.generation.fetch_add(1);
+}
+
+void hk::logging::set_output(std::FILE* out) {
+    flush();
+    logger.out = out;
+}
+
+static LogRing* get_log_ring() {
+    const u32 generation = logger.generation.load(std::memory_order_acquire);
+    if (!log_ring || log_ring_generation != generation) {
+        log_ring = nullptr;
+        log_ring_generation = generation;
+        const u32 idx = logger.num_rings.fetch_add(1);
+        if (idx >= MAX_LOG_THREADS) {
+            return nullptr;
+        }
+        // Rings live until shutdown(), a thread that exits may still have messages queued
+        log_ring = new (mem::alloc<LogRing>()) LogRing();
+        logger.rings[idx].store(log_ring, std::memory_order_release);
+    }
+    return log_ring;
+}
+
+// Messages are written synchronously once the writer thread has stopped
+static thread_local hk::logging::Record sync_record;
+
+void hk::logging::submit(const Record& record) {
+    if (Record* r = begin_record()) {
+        *r = record;
+        end_record(r);
+    }
+}
+
+hk::logging::Record* hk::logging::begin_record() {
+    if (!logger.running.load(std::memory_order_relaxed) && logger.stopped.load(std::memory_order_relaxed)) {
+        return &sync_record;
+    }
+    LogRing* ring = get_log_ring();
+    Record* r = ring ? ring->claim() : nullptr;
+    if (!r) {
+        logger.dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    return r;
+}
+
+void hk::logging::end_record(Record* record) {
+    if (record == &sync_record) {
+        char text[MAX_LOG_MESSAGE + 64];
+        log_write_records(record, 1, text, sizeof(text));
+        return;
+    }
+    log_ring->publish();
+}
+
+void hk::logging::flush() {
+    if (!logger.running) {
+        return;
+    }
+    const u64 request = logger.flush_requested.fetch_add(1) + 1;
+    while (logger.flush_done.load(std::memory_order_acquire) < request) {
+        sys::yield_thread();
+    }
+}
+
+//
+// Profiling
+//
+
+static struct {
+    std::atomic<prof::ThreadBuffer*>    buffers[prof::MAX_THREADS];
+    std::atomic<u32>                    num_buffers;
+    prof::ThreadBuffer*                 (*source)();
+} profiler = { };
+
+static thread_local prof::ThreadBuffer* prof_buffer = nullptr;
+
+static prof::ThreadBuffer* register_thread_buffer() {
+    const u32 idx = profiler.num_buffers.fetch_add(1);
+    // Buffers are never freed, profiles may be read after a thread exits
+    prof::ThreadBuffer* buf = new prof::ThreadBuffer;
+    buf->depth = 0;
+    buf->index = idx;
+    std::snprintf(buf->name, sizeof(buf->name), "Thread %u", idx);
+    // Threads past MAX_THREADS still record into a buffer of their own, profiles just leave it out
+    if (idx < prof::MAX_THREADS) {
+        profiler.buffers[idx].store(buf, std::memory_order_release);
+    }
+    return buf;
+}
+
+hk::prof::ThreadBuffer* hk::prof::thread_buffer() {
+    if (!prof_buffer) {
+        prof_buffer = profiler.source ? profiler.source() : register_thread_buffer();
+    }
+    return prof_buffer;
+}
+
+void hk::prof::count_alloc(usize size) {
+    // Only the owning thread writes these, no need for an atomic add
+    ThreadBuffer* buf = thread_buffer();
+    buf->allocs.store(buf->allocs.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    buf->alloc_bytes.store(buf->alloc_bytes.load(std::memory_order_relaxed) + size, std::memory_order_relaxed);
+}
+
+void hk::prof::count_alloc_site(usize size, const std::source_location& site) {
+    ThreadBuffer* buf = thread_buffer();
+    const char* file = site.file_name();
+    const u32 line = site.line();
+    usize idx = ((usize)file >> 3) ^ ((usize)line * 0x9E3779B1u);
+    for (usize probe = 0; probe < MAX_ALLOC_SITES; ++probe, ++idx) {
+        AllocSite& s = buf->alloc_sites[idx & (MAX_ALLOC_SITES - 1)];
+        const char* s_file = s.file.load(std::memory_order_relaxed);
+        if (!s_file) {
+            s.function = site.function_name();
+            s.line = line;
+            s.file.store(file, std::memory_order_release);
+        } else if (s_file != file || s.line != line) {
+            continue;
+        }
+        s.count.store(s.count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        s.bytes.store(s.bytes.load(std::memory_order_relaxed) + size, std::memory_order_relaxed);
+        return;
+    }
+}
+
+void hk::prof::set_thread_name(const char* name) {
+    ThreadBuffer* buf = thread_buffer();
+    std::snprintf(buf->name, sizeof(buf->name), "%s", name);
+}
+
+void hk::prof::set_thread_buffer_source(ThreadBuffer* (*source)()) {
+    profiler.source = source;
+}
+
+hk::u32 hk::prof::get_thread_count() {
+    return min(profiler.num_buffers.load(std::memory_order_acquire), MAX_THREADS);
+}
+
+hk::prof::ThreadBuffer* hk::prof::get_thread_buffer(u32 idx) {
+    return idx < get_thread_count() ? profiler.buffers[idx].load(std::memory_order_acquire) : nullptr;
+}
+
+hk::usize hk::prof::read_events(const ThreadBuffer* buf, u64 since, ZoneEvent* events, usize max_events) {
+    const u64 head = buf->head.load(std::memory_order_acquire);
+    // Leave some slack, the owner may be overwriting the oldest events while we copy
+    const u64 first = head > MAX_ZONE_EVENTS / 2 ? head - MAX_ZONE_EVENTS / 2 : 0;
+    // Events are recorded in end order, find the first one that ended at or after `since`
+    u64 lo = first, hi = head;
+    while (lo < hi) {
+        const u64 mid = lo + (hi - lo) / 2;
+        if (buf->events[mid & (MAX_ZONE_EVENTS - 1)].end < since) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    const u64 count = min<u64>(head - lo, max_events);
+    for (u64 i = 0; i < count; ++i) {
+        events[i] = buf->events[(head - count + i) & (MAX_ZONE_EVENTS - 1)];
+    }
+    return (usize)count;
+}
+
+static void write_json_string(std::FILE* f, const char* str) {
+    std::fputc('"', f);
+    for (; *str; ++str) {
+        if (*str == '"' || *str == '\\') {
+            std::fputc('\\', f);
+        }
+        if ((u8)*str >= 0x20) {
+            std::fputc(*str, f);
+        }
+    }
+    std::fputc('"', f);
+}
+
+hk::usize hk::prof::write_chrome_trace(std::FILE* f, u64 since) {
+    ZoneEvent* events = mem::alloc<ZoneEvent>(MAX_ZONE_EVENTS);
+    const u64 base_ns = sys::clock_ticks_to_ns(since);
+    usize total = 0;
+    std::fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    std::fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"moth06\"}}");
+    for (u32 t = 0; t < get_thread_count(); ++t) {
+        const ThreadBuffer* buf = get_thread_buffer(t);
+        if (!buf) {
+            continue;
+        }
+        std::fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":", buf->index);
+        write_json_string(f, buf->name);
+        std::fprintf(f, "}}");
+        std::fprintf(f, ",\n{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"sort_index\":%u}}", buf->index, buf->index);
+
+        const usize count = read_events(buf, since, events, MAX_ZONE_EVENTS);
+        for (usize i = 0; i < count; ++i) {
+            const ZoneEvent& e = events[i];
+            const u64 begin_ns = sys::clock_ticks_to_ns(e.begin);
+            const u64 end_ns = sys::clock_ticks_to_ns(e.end);
+            // Complete events, timestamps in microseconds
+            std::fprintf(f, ",\n{\"name\":");
+            write_json_string(f, e.name);
+            std::fprintf(f, ",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                buf->index,
+                (f64)((i64)begin_ns - (i64)base_ns) / 1e3,
+                (f64)(end_ns - min(begin_ns, end_ns)) / 1e3);
+        }
+        total += count;
+    }
+    std::fprintf(f, "\n]}\n");
+    mem::free(events);
+    return total;
+}
+
+static bool alloc_site_less(const prof::AllocSiteTotals& lhs, const char* file, u32 line) {
+    return lhs.file < file || (lhs.file == file && lhs.line < line);
+}
+
+hk::usize hk::prof::read_alloc_sites(AllocSiteTotals* sites, usize max_sites) {
+    usize count = 0;
+    for (u32 t = 0; t < get_thread_count(); ++t) {
+        const ThreadBuffer* buf = get_thread_buffer(t);
+        if (!buf) {
+            continue;
+        }
+        for (const AllocSite& s : buf->alloc_sites) {
+            const char* file = s.file.load(std::memory_order_acquire);
+            if (!file) {
+                continue;
+            }
+            // Keep the output sorted so sites from different threads merge
+            usize lo = 0, hi = count;
+            while (lo < hi) {
+                const usize mid = lo + (hi - lo) / 2;
+                if (alloc_site_less(sites[mid], file, s.line)) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            if (lo == count || sites[lo].file != file || sites[lo].line != s.line) {
+                if (count == max_sites) {
+                    continue;
+                }
+                std::memmove(&sites[lo + 1], &sites[lo], sizeof(*sites) * (count - lo));
+                sites[lo] = { file, s.function, s.line, 0, 0 };
+                ++count;
+            }
+            sites[lo].count += s.count.load(std::memory_order_relaxed);
+            sites[lo].bytes += s.bytes.load(std::memory_order_relaxed);
+        }
+    }
+    return count;
+}
+
+void hk::prof::add_counter_zone(const char* name, const sys::PerfCounters& begin, const sys::PerfCounters& end) {
+    ThreadBuffer* buf = thread_buffer();
+    for (CounterZoneStats& z : buf->counter_zones) {
+        const char* z_name = z.name.load(std::memory_order_relaxed);
+        if (!z_name) {
+            z.name.store(name, std::memory_order_release);
+        } else if (z_name != name) {
+            continue;
+        }
+        // Only the owning thread writes these
+        z.available.store(z.available.load(std::memory_order_relaxed) | end.available, std::memory_order_relaxed);
+        z.calls.store(z.calls.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        for (usize i = 0; i < sys::PERF_COUNTER_COUNT; ++i) {
+            z.values[i].store(z.values[i].load(std::memory_order_relaxed) + (end.values[i] - begin.values[i]), std::memory_order_relaxed);
+        }
+        return;
+    }
+}
+
+hk::usize hk::prof::read_counter_zones(CounterZoneTotals* zones, usize max_zones) {
+    usize count = 0;
+    for (u32 t = 0; t < get_thread_count(); ++t) {
+        const ThreadBuffer* buf = get_thread_buffer(t);
+        if (!buf) {
+            continue;
+        }
+        for (const CounterZoneStats& z : buf->counter_zones) {
+            const char* name = z.name.load(std::memory_order_acquire);
+            if (!name) {
+                break;
+            }
+            usize i = 0;
+            while (i < count && !str::equal(zones[i].name, name)) {
+                ++i;
+            }
+            if (i == count) {
+                if (count == max_zones) {
+                    continue;
+                }
+                zones[count++] = { name, 0, 0, { } };
+            }
+            zones[i].available |= z.available.load(std::memory_order_relaxed);
+            zones[i].calls += z.calls.load(std::memory_order_relaxed);
+            for (usize c = 0; c < sys::PERF_COUNTER_COUNT; ++c) {
+                zones[i].values[c] += z.values[c].load(std::memory_order_relaxed);
+            }
+        }
+    }
+    return count;
+}
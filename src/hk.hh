@@ -1,6 +1,7 @@
 #ifndef _HK_HH_
 #define _HK_HH_
 
+#include <atomic>
 #include <cassert>
 #include <cstdarg>
 #include <cstddef>
@@ -10,6 +11,8 @@
 #include <cstring>
 #include <inttypes.h>
 #include <new>
+#include <source_location>
+#include <type_traits>
 
 //
 // Platform detection
@@ -30,6 +33,14 @@
 #   define HK_PLATFORM_NAME "Linux"
 #endif
 
+#if defined(__x86_64__) || defined(_M_X64)
+#   define HK_X64
+#endif
+
+#if defined(__aarch64__) || defined(_M_ARM64)
+#   define HK_ARM64
+#endif
+
 #ifdef _MSC_VER
 #   define HK_MSVC
 #   define HK_COMPILER_NAME "MSVC"
@@ -62,8 +73,23 @@
 #define HK_STRINGIFY_(x) #x
 #define HK_STRINGIFY(x) HK_STRINGIFY_(x)
 
+#define HK_CONCAT_(x, y) x##y
+#define HK_CONCAT(x, y) HK_CONCAT_(x, y)
+
 #define HK_DLLAPI
 
+// Allocating functions take their caller's location as a trailing parameter when profiling allocations
+#ifdef HK_ALLOC_PROFILE
+#   define HK_ALLOC_SITE , const std::source_location site = std::source_location::current()
+#   define HK_ALLOC_SITE_ARG , site
+#else
+#   define HK_ALLOC_SITE
+#   define HK_ALLOC_SITE_ARG
+#endif
+
+// Destructive interference size - padding between atomics written by different threads
+#define HK_CACHE_LINE 64
+
 namespace hk {
 
 //
@@ -82,6 +108,7 @@ using f32   = float;
 using f64   = double;
 
 using usize = std::size_t;
+using isize = std::ptrdiff_t;
 
 // Static c-style array length
 template <typename T, usize S>
@@ -99,29 +126,95 @@ constexpr static inline T max(T left, T right) {
     return left > right ? left : right;
 }
 
+// Mix a value into a running 64-bit hash
+constexpr static inline u64 hash_combine(u64 seed, u64 value) {
+    return (seed ^ (value + 0x9E3779B97F4A7C15ull + (seed << 6) + (seed >> 2))) * 0x100000001B3ull;
+}
+
 //
 // Memory utilities
 //
 
+namespace prof {
+// Count an allocation against the calling thread's profile
+void count_alloc(usize size);
+// Count an allocation against its callsite
+void count_alloc_site(usize size, const std::source_location& site);
+}
+
 namespace mem {
 
+// What calloc() guarantees. Types aligned past this need an aligned allocation
+constexpr usize DEFAULT_ALIGNMENT = alignof(std::max_align_t);
+
+// Zeroed like alloc(), aligned to `alignment` (a power of two). Free with free_aligned()
 template <typename T>
-static inline T* alloc(const usize count = 1) {
-    HK_DEBUG_ASSERT(count);
+static inline T* alloc_aligned(const usize count, const usize alignment HK_ALLOC_SITE) {
+    HK_DEBUG_ASSERT(count && alignment >= alignof(T) && (alignment & (alignment - 1)) == 0);
 #ifdef HK_ALLOC_TRACKER
     ++HK_ALLOC_TRACKER;
 #endif
-    return (T*)std::calloc(sizeof(T), count);
+#ifdef HK_PROFILE
+    prof::count_alloc(sizeof(T) * count);
+#endif
+#ifdef HK_ALLOC_PROFILE
+    prof::count_alloc_site(sizeof(T) * count, site);
+#endif
+    // Over-allocated from calloc() with the real pointer kept just before the aligned block, so
+    // large blocks still get zero pages that are only touched once used
+    u8* base = (u8*)std::calloc(1, sizeof(T) * count + alignment - 1 + sizeof(void*));
+    if (!base) {
+        return nullptr;
+    }
+    u8* ptr = (u8*)(((uintptr_t)base + sizeof(void*) + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    ((void**)ptr)[-1] = base;
+    return (T*)ptr;
 }
 
 template <typename T>
-static inline void free(T* ptr) {
+static inline void free_aligned(T* ptr) {
 #ifdef HK_ALLOC_TRACKER
     if (ptr) {
         --HK_ALLOC_TRACKER;
     }
 #endif
-    std::free((void*)ptr);
+    if (ptr) {
+        std::free(((void**)ptr)[-1]);
+    }
+}
+
+// Over-aligned types go through alloc_aligned(), everything else through calloc()
+template <typename T>
+static inline T* alloc(const usize count = 1 HK_ALLOC_SITE) {
+    if constexpr (alignof(T) > DEFAULT_ALIGNMENT) {
+        return alloc_aligned<T>(count, alignof(T) HK_ALLOC_SITE_ARG);
+    } else {
+        HK_DEBUG_ASSERT(count);
+#ifdef HK_ALLOC_TRACKER
+        ++HK_ALLOC_TRACKER;
+#endif
+#ifdef HK_PROFILE
+        prof::count_alloc(sizeof(T) * count);
+#endif
+#ifdef HK_ALLOC_PROFILE
+        prof::count_alloc_site(sizeof(T) * count, site);
+#endif
+        return (T*)std::calloc(sizeof(T), count);
+    }
+}
+
+template <typename T>
+static inline void free(T* ptr) {
+    if constexpr (alignof(T) > DEFAULT_ALIGNMENT) {
+        free_aligned(ptr);
+    } else {
+#ifdef HK_ALLOC_TRACKER
+        if (ptr) {
+            --HK_ALLOC_TRACKER;
+        }
+#endif
+        std::free((void*)ptr);
+    }
 }
 
 template <typename T>
@@ -136,6 +229,34 @@ static inline bool equal( const T* mem1, const T* mem2, usize count = 1 ) {
     return !std::memcmp( (const void*)mem1, (const void*)mem2, sizeof( T ) * count );
 }
 
+// Bump allocator over a block of memory it doesn't own. Allocations are zeroed and only freed all at once
+class Arena {
+private:
+    u8*     m_base = nullptr;
+    usize   m_capacity = 0;
+    usize   m_used = 0;
+public:
+    Arena() = default;
+    Arena(void* base, usize capacity) : m_base((u8*)base), m_capacity(capacity) { }
+
+    template <typename T>
+    T* alloc(usize count = 1) {
+        const usize begin = (m_used + alignof(T) - 1) & ~(alignof(T) - 1);
+        if (begin > m_capacity || sizeof(T) * count > m_capacity - begin) {
+            return nullptr;
+        }
+        m_used = begin + sizeof(T) * count;
+        std::memset(m_base + begin, 0, sizeof(T) * count);
+        return (T*)(m_base + begin);
+    }
+
+    void reset() { m_used = 0; }
+    // Free everything allocated since used() returned `used`
+    void rewind(usize used) { m_used = used < m_used ? used : m_used; }
+    usize used() const { return m_used; }
+    usize capacity() const { return m_capacity; }
+};
+
 }
 
 //
@@ -144,6 +265,19 @@ static inline bool equal( const T* mem1, const T* mem2, usize count = 1 ) {
 
 namespace str {
 
+static inline bool equal(const char* a, const char* b) {
+    return std::strcmp(a, b) == 0;
+}
+
+// FNV-1a
+constexpr static inline u64 hash(const char* str) {
+    u64 h = 0xCBF29CE484222325ull;
+    for (; *str; ++str) {
+        h = (h ^ (u8)*str) * 0x100000001B3ull;
+    }
+    return h;
+}
+
 static inline bool dirname(char* path) {
     char* last_delim = nullptr;
     for (usize i = 0; path[i] != '\0'; ++i) {
@@ -164,6 +298,22 @@ static inline bool dirname(char* path) {
     return last_delim != nullptr;
 }
 
+// Get the file name at the end of a path
+static inline const char* basename(const char* path) {
+    const char* name = path;
+    for (const char* c = path; *c; ++c) {
+#ifdef HK_WINDOWS
+        if (*c == '\\') {
+            name = c + 1;
+        }
+#endif
+        if (*c == '/') {
+            name = c + 1;
+        }
+    }
+    return name;
+}
+
 }
 
 //
@@ -222,7 +372,7 @@ private:
 public:
     Array() = default;
     Array(const Array<T>& other) : Array() { copy(other); }
-    Array( usize size ) : Array() { resize( size ); }
+    Array( usize size HK_ALLOC_SITE ) : Array() { resize( size HK_ALLOC_SITE_ARG ); }
     ~Array() { resize(0); mem::free(m_buffer); }
 
     Array<T>& operator=(const Array<T>& other) { copy(other); return *this; }
@@ -248,12 +398,12 @@ public:
         }
     }
 
-    void reserve(usize capacity) {
+    void reserve(usize capacity HK_ALLOC_SITE) {
         if (capacity > m_capacity) {
             // NOTE(HK): After testing on multiple PC platforms, it seems
             // that f(x) = 2x seems to be the optimal allocation strategy
             capacity = max(capacity, m_capacity * 2);
-            T* new_buffer = mem::alloc<T>(capacity); HK_DEBUG_ASSERT(new_buffer);
+            T* new_buffer = mem::alloc<T>(capacity HK_ALLOC_SITE_ARG); HK_DEBUG_ASSERT(new_buffer);
             if (m_length > 0) {
                 mem::copy(new_buffer, m_buffer, m_length);
             }
@@ -263,8 +413,8 @@ public:
         }
     }
 
-    void resize(usize length) {
-        reserve(length);
+    void resize(usize length HK_ALLOC_SITE) {
+        reserve(length HK_ALLOC_SITE_ARG);
         // grow
         if (length > m_length) {
             new(&m_buffer[m_length]) T[length - m_length];
@@ -278,13 +428,186 @@ public:
         m_length = length;
     }
 
-    usize append(const T& val) {
-        resize(m_length + 1);
+    usize append(const T& val HK_ALLOC_SITE) {
+        resize(m_length + 1 HK_ALLOC_SITE_ARG);
         m_buffer[m_length - 1] = val;
         return m_length - 1;
     }
 };
 
+//
+// Lock-free single-producer/single-consumer ring buffer
+// N must be a power of two. push*() may only be called from one thread and pop*() from one other
+//
+template <typename T, usize N>
+class SpscRing {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "SpscRing size must be a power of two");
+private:
+    // Producer side. Keeps a stale copy of the tail so it only touches the consumer's line when full
+    alignas(HK_CACHE_LINE) std::atomic<usize>   m_head = 0;
+    usize                                       m_tail_cache = 0;
+    // Consumer side
+    alignas(HK_CACHE_LINE) std::atomic<usize>   m_tail = 0;
+    usize                                       m_head_cache = 0;
+    alignas(HK_CACHE_LINE) T                    m_buffer[N];
+public:
+    SpscRing() = default;
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    static constexpr usize capacity() { return N; }
+
+    // Approximate when called concurrently
+    usize length() const { return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_acquire); }
+
+    bool push(const T& val) { return push_n(&val, 1) == 1; }
+    bool pop(T& val) { return pop_n(&val, 1) == 1; }
+
+    // Push without a copy: fill in the returned slot, then publish() it. Null when full
+    T* claim() {
+        const usize head = m_head.load(std::memory_order_relaxed);
+        if (head - m_tail_cache >= N) {
+            m_tail_cache = m_tail.load(std::memory_order_acquire);
+            if (head - m_tail_cache >= N) {
+                return nullptr;
+            }
+        }
+        return &m_buffer[head & (N - 1)];
+    }
+    void publish() {
+        m_head.store(m_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Push up to count values, returns the number pushed
+    usize push_n(const T* vals, usize count) {
+        const usize head = m_head.load(std::memory_order_relaxed);
+        if (N - (head - m_tail_cache) < count) {
+            m_tail_cache = m_tail.load(std::memory_order_acquire);
+        }
+        count = min(count, N - (head - m_tail_cache));
+        for (usize i = 0; i < count; ++i) {
+            m_buffer[(head + i) & (N - 1)] = vals[i];
+        }
+        m_head.store(head + count, std::memory_order_release);
+        return count;
+    }
+
+    // Pop up to count values, returns the number popped
+    usize pop_n(T* vals, usize count) {
+        const usize tail = m_tail.load(std::memory_order_relaxed);
+        if (m_head_cache - tail < count) {
+            m_head_cache = m_head.load(std::memory_order_acquire);
+        }
+        count = min(count, m_head_cache - tail);
+        for (usize i = 0; i < count; ++i) {
+            vals[i] = m_buffer[(tail + i) & (N - 1)];
+        }
+        m_tail.store(tail + count, std::memory_order_release);
+        return count;
+    }
+};
+
+//
+// Lock-free bounded multi-producer/single-consumer queue
+// Dmitry Vyukov's bounded queue: every cell carries a sequence number that tells producers
+// and the consumer which lap of the ring it belongs to
+//
+template <typename T>
+class MpscQueue {
+private:
+    struct Cell {
+        std::atomic<usize>  seq;
+        T                   val;
+    };
+    alignas(HK_CACHE_LINE) std::atomic<usize>   m_head = 0;
+    alignas(HK_CACHE_LINE) std::atomic<usize>   m_tail = 0;
+    alignas(HK_CACHE_LINE) Cell*                m_cells = nullptr;
+    usize                                       m_mask = 0;
+public:
+    // Capacity must be a power of two
+    MpscQueue(usize capacity) {
+        HK_ASSERT(capacity > 0 && (capacity & (capacity - 1)) == 0);
+        m_cells = mem::alloc<Cell>(capacity);
+        m_mask = capacity - 1;
+        for (usize i = 0; i < capacity; ++i) {
+            new(&m_cells[i]) Cell();
+            m_cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+    ~MpscQueue() {
+        for (usize i = 0; i <= m_mask; ++i) {
+            m_cells[i].~Cell();
+        }
+        mem::free(m_cells);
+    }
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    usize capacity() const { return m_mask + 1; }
+
+    // Any thread
+    bool push(const T& val) { return push_n(&val, 1) == 1; }
+
+    // Any thread. Claims a contiguous run of cells with a single CAS, returns the number pushed
+    usize push_n(const T* vals, usize count) {
+        if (!count) {
+            return 0;
+        }
+        usize pos = m_head.load(std::memory_order_relaxed);
+        while (true) {
+            // The consumer frees cells in order, so if the last cell of the run is free, all of them are
+            // A stale head can be behind the tail, which makes the difference negative
+            const isize used = (isize)(pos - m_tail.load(std::memory_order_acquire));
+            const usize n = used < 0 ? 0 : min(count, capacity() - min((usize)used, capacity()));
+            if (!n) {
+                // Full, unless the head was stale and has moved on since
+                const usize head = m_head.load(std::memory_order_relaxed);
+                if (head == pos) {
+                    return 0;
+                }
+                pos = head;
+                continue;
+            }
+            const usize seq = m_cells[(pos + n - 1) & m_mask].seq.load(std::memory_order_acquire);
+            const isize dif = (isize)seq - (isize)(pos + n - 1);
+            if (dif == 0) {
+                if (m_head.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed)) {
+                    for (usize i = 0; i < n; ++i) {
+                        Cell& c = m_cells[(pos + i) & m_mask];
+                        c.val = vals[i];
+                        c.seq.store(pos + i + 1, std::memory_order_release);
+                    }
+                    return n;
+                }
+            } else if (dif < 0) {
+                // Consumer hasn't caught up with our view of the tail yet
+                return 0;
+            } else {
+                pos = m_head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Consumer thread only
+    bool pop(T& val) { return pop_n(&val, 1) == 1; }
+
+    // Consumer thread only. Stops at the first cell that hasn't been published yet
+    usize pop_n(T* vals, usize count) {
+        const usize tail = m_tail.load(std::memory_order_relaxed);
+        usize n = 0;
+        for (; n < count; ++n) {
+            Cell& c = m_cells[(tail + n) & m_mask];
+            if (c.seq.load(std::memory_order_acquire) != tail + n + 1) {
+                break;
+            }
+            vals[n] = c.val;
+            c.seq.store(tail + n + m_mask + 1, std::memory_order_release);
+        }
+        m_tail.store(tail + n, std::memory_order_release);
+        return n;
+    }
+};
+
 //
 // Binary reader
 //
@@ -335,6 +658,46 @@ public:
     }
 };
 
+// Little-endian, byte aligned
+class ByteStream {
+private:
+    Span<const u8>  m_bytes = { };
+    usize           m_cur_byte = 0;
+    bool            m_overrun = false;
+public:
+    ByteStream() = default;
+    ByteStream(Span<const u8> bytes) : ByteStream() { m_bytes = bytes; }
+
+    bool overrun() { return m_overrun; }
+
+    void seek(usize offset) { m_cur_byte = offset; }
+    usize tell() { return m_cur_byte; }
+
+    template <typename T>
+    T read() {
+        static_assert(std::is_trivially_copyable_v<T>);
+        T result = T();
+        if ((m_overrun |= (m_cur_byte > m_bytes.length() || sizeof(T) > m_bytes.length() - m_cur_byte))) {
+            return T();
+        }
+        mem::copy((u8*)&result, &m_bytes[m_cur_byte], sizeof(T));
+        m_cur_byte += sizeof(T);
+        return result;
+    }
+
+    // Read up to `len` - 1 characters and terminate. Stops after the first NUL
+    usize read_c_string(char* str, usize len) {
+        usize n = 0;
+        for (; n + 1 < len; ++n) {
+            if ((str[n] = read<char>()) == '\0') {
+                return n;
+            }
+        }
+        str[n] = '\0';
+        return n;
+    }
+};
+
 //
 // System API
 //
@@ -347,19 +710,492 @@ bool chdir(const char* path);
 // Copy a file
 bool copy_file(const char* src_path, const char* dst_path);
 
+// Read a whole file
+bool read_file(const char* path, Array<u8>& data);
+
+// Copy a file into an anonymous in-memory file (memfd on Linux), for loading a library while the
+// original gets rebuilt. `path` receives a name to open it by until close_memory_file(). Keep
+// it open while something loaded from it is, a later copy could get the same fd and so the same path
+// Returns -1 on failure or on other platforms
+i32 copy_file_to_memory(const char* src_path, char* path, usize path_len);
+void close_memory_file(i32 fd);
+
+// Watches one file for being rewritten or replaced. inotify on Linux, polls the modification time elsewhere
+struct FileWatch;
+FileWatch* watch_file(const char* path);
+void close_file_watch(FileWatch* watch);
+
+// True once for every batch of changes since the last call. Never blocks
+bool poll_file_watch(FileWatch* watch);
+
 // Create a developer console for stdout/stderr
 void create_console();
 
 // Get the absolute path of the executable
 bool get_exe_path(char* path, usize len);
 
-// Get the CPU timestamp
+// Get the raw CPU timestamp counter (TSC on x86, CNTVCT on ARM64)
 u64 get_cpu_ticks();
 
+// Conversion from clock ticks to nanoseconds. A game library adopts the engine's so both
+// produce comparable timestamps
+struct ClockCalibration {
+    // Ticks are CPU timestamps, otherwise they are already nanoseconds
+    bool    cpu_ticks;
+    u64     base_ticks;
+    u64     base_ns;
+    // 32.32 fixed point
+    u64     ns_per_tick;
+};
+
+// Calibrates on first use: the CPU timestamp counter if it is invariant, the OS clock otherwise
+ClockCalibration get_clock_calibration();
+void set_clock_calibration(const ClockCalibration& calibration);
+
+// Get a monotonic timestamp in clock ticks, the cheapest way to time something
+u64 get_clock_ticks();
+
+// Convert clock ticks to nanoseconds
+u64 clock_ticks_to_ns(u64 ticks);
+
+// Get a monotonic timestamp in nanoseconds
+u64 get_time_ns();
+
+// Sleep for at least the given number of milliseconds
+void sleep_ms(u32 ms);
+
+// Get the number of logical CPU cores
+u32 get_cpu_count();
+
+// SIMD instruction sets that both the CPU and the OS support
+enum : u32 {
+    CPU_SSE2    = 1 << 0,
+    CPU_AVX2    = 1 << 1,
+    CPU_NEON    = 1 << 2,
+};
+
+// Get the CPU_* flags, detected on first use
+u32 get_cpu_features();
+
+//
+// Hardware performance counters
+// Linux only (perf_event_open), each thread opens its own counters on first use
+//
+
+enum class PerfCounter : u32 {
+    Cycles,
+    Instructions,
+    L1DMisses,
+    LLCMisses,
+    BranchMisses,
+
+    Count,
+};
+
+constexpr usize PERF_COUNTER_COUNT = (usize)PerfCounter::Count;
+
+struct PerfCounters {
+    u64 values[PERF_COUNTER_COUNT];
+    // Bit per PerfCounter that the CPU/kernel let us open
+    u32 available;
+};
+
+// Read the calling thread's counters, scaled if the kernel had to multiplex them.
+// Fails if counters aren't supported or allowed (see /proc/sys/kernel/perf_event_paranoid)
+bool read_perf_counters(PerfCounters& counters);
+
+// Close the calling thread's counters
+void close_perf_counters();
+
+// Name of a counter, for reports
+const char* get_perf_counter_name(PerfCounter counter);
+
+//
+// Threads
+//
+
+struct Thread;
+typedef void (*ThreadFn)(void* user);
+
+// Start a thread running fn(user)
+Thread* create_thread(ThreadFn fn, void* user);
+
+// Wait for a thread to exit and free it
+void join_thread(Thread* thread);
+
+// Give up the rest of the current time slice
+void yield_thread();
+
+// For short, rarely contended critical sections. Yields while waiting
+class SpinLock {
+private:
+    std::atomic<bool> m_locked = false;
+public:
+    void lock() {
+        while (m_locked.exchange(true, std::memory_order_acquire)) {
+            while (m_locked.load(std::memory_order_relaxed)) {
+                yield_thread();
+            }
+        }
+    }
+    void unlock() { m_locked.store(false, std::memory_order_release); }
+};
+
+// Holds a SpinLock for the enclosing scope
+class ScopedLock {
+private:
+    SpinLock& m_lock;
+public:
+    ScopedLock(SpinLock& lock) : m_lock(lock) { m_lock.lock(); }
+    ~ScopedLock() { m_lock.unlock(); }
+    ScopedLock(const ScopedLock&) = delete;
+    ScopedLock& operator=(const ScopedLock&) = delete;
+};
+
+//
+// Job system
+// Every job thread owns a Chase-Lev work-stealing deque. Jobs pushed by a thread
+// go to its own deque, idle threads steal from the others.
+//
+
+typedef void (*JobFn)(void* user);
+
+struct Job;
+
+// Decremented as jobs finish, waitable with wait_jobs(). A counter that hasn't been given any
+// jobs counts as done. It can be reused once done, not while its jobs are still running
+struct JobCounter {
+    std::atomic<u32>            pending = 0;
+    // Continuations queued with run_jobs_after(), DONE_LIST (1) once released
+    std::atomic<Job*>           continuations = (Job*)(uintptr_t)1;
+};
+
+struct Job {
+    JobFn       fn;
+    void*       user;
+    // Internal
+    JobCounter* counter;
+    Job*        next;
+};
+
+// Start the worker threads. By default one per core, minus the calling thread
+// The calling thread becomes job thread 0 and must be the one to call shutdown_jobs()
+void init_jobs(u32 num_workers = 0);
+
+// Stop and join the worker threads
+void shutdown_jobs();
+
+// Get the number of threads executing jobs, including the main thread
+u32 get_job_thread_count();
+
+// Get the job thread index of the calling thread, or -1 if it is not a job thread
+i32 get_job_thread_index();
+
+// Queue jobs. They, and the counter, must stay alive until the counter reaches zero
+void run_jobs(Job* jobs, usize count, JobCounter* counter);
+
+// Queue jobs once all jobs counted by dependency have finished
+void run_jobs_after(JobCounter* dependency, Job* jobs, usize count, JobCounter* counter);
+
+// Execute queued jobs until the counter reaches zero
+void wait_jobs(JobCounter* counter);
+
+// Run fn over [0, count) in batches of `batch` elements across all job threads and wait for it
+// A batch size of 0 picks one that gives every thread a few batches
+typedef void (*ParallelForFn)(void* user, usize begin, usize end);
+void parallel_for(usize count, usize batch, ParallelForFn fn, void* user);
+
 }
 
+//
+// Asynchronous logging
+// Call sites copy the format string pointer and raw arguments into a per-thread ring, a
+// background thread formats them with printf rules and writes them out in batches.
+// The format string must outlive the message (i.e. be a literal), %s arguments are copied
+// Not called log, that would make a bare log() ambiguous with ::log under `using namespace hk`
+//
+
+namespace logging {
+
+constexpr usize RECORD_SIZE = 256;
+constexpr usize MAX_ARGS = 8;
+
+// Argument types after default argument promotion
+enum class ArgType : u8 {
+    Int,
+    UInt,
+    Long,
+    ULong,
+    LongLong,
+    ULongLong,
+    Double,
+    Pointer,
+    String,
+};
+
+struct Record {
+    // Clock ticks, see sys::clock_ticks_to_ns()
+    u64         time;
+    const char* fmt;
+    u8          num_args;
+    u8          strings_len;
+    ArgType     types[MAX_ARGS];
+    u64         args[MAX_ARGS];
+    // Copies of string arguments, args[] holds their offset
+    char        strings[RECORD_SIZE - 96];
+};
+static_assert(sizeof(Record) == RECORD_SIZE);
+
+template <typename T>
+static inline void encode_arg(Record& r, T val) {
+    if (r.num_args >= MAX_ARGS) {
+        return;
+    }
+    ArgType& type = r.types[r.num_args];
+    u64& arg = r.args[r.num_args++];
+    if constexpr (std::is_same_v<T, const char*> || std::is_same_v<T, char*>) {
+        type = ArgType::String;
+        arg = r.strings_len;
+        const char* s = val ? val : "(null)";
+        const usize space = sizeof(r.strings) - r.strings_len;
+        usize n = 0;
+        for (; n + 1 < space && s[n] != '\0'; ++n) {
+            r.strings[r.strings_len + n] = s[n];
+        }
+        if (space) {
+            r.strings[r.strings_len + n] = '\0';
+            r.strings_len += (u8)(n + 1);
+        }
+    } else if constexpr (std::is_floating_point_v<T>) {
+        type = ArgType::Double;
+        const f64 d = (f64)val;
+        std::memcpy(&arg, &d, sizeof(d));
+    } else if constexpr (std::is_pointer_v<T> || std::is_null_pointer_v<T>) {
+        type = ArgType::Pointer;
+        arg = (u64)(uintptr_t)val;
+    } else {
+        static_assert(std::is_integral_v<T> || std::is_enum_v<T>, "Unsupported log argument type");
+        // Default argument promotion, the same thing printf would have received
+        using U = typename std::conditional_t<std::is_enum_v<T>, std::underlying_type<T>, std::type_identity<T>>::type;
+        using P = decltype(+U());
+        if constexpr (std::is_same_v<P, int>)                       { type = ArgType::Int; }
+        else if constexpr (std::is_same_v<P, unsigned int>)         { type = ArgType::UInt; }
+        else if constexpr (std::is_same_v<P, long>)                 { type = ArgType::Long; }
+        else if constexpr (std::is_same_v<P, unsigned long>)        { type = ArgType::ULong; }
+        else if constexpr (std::is_same_v<P, long long>)            { type = ArgType::LongLong; }
+        else                                                        { type = ArgType::ULongLong; }
+        arg = (u64)(P)val;
+    }
+}
+
+// Capture a message without formatting it
+template <typename... Args>
+static inline void encode_into(Record& r, const char* fmt, Args... args) {
+    r.time = sys::get_clock_ticks();
+    r.fmt = fmt;
+    r.num_args = 0;
+    r.strings_len = 0;
+    (encode_arg(r, args), ...);
 }
 
+template <typename... Args>
+static inline Record encode(const char* fmt, Args... args) {
+    Record r;
+    encode_into(r, fmt, args...);
+    return r;
+}
+
+// Start the writer thread. Messages from before are queued and written once it runs
+void init(std::FILE* out);
+
+// Write everything that's queued and stop the writer thread. Later messages are written
+// synchronously. Other threads must be done logging, their rings are freed
+void shutdown();
+
+// Redirect output, null discards messages
+void set_output(std::FILE* out);
+
+// Queue a message from the calling thread. Never blocks, drops the message if the ring is full
+void submit(const Record& record);
+
+// Queue a message in place: encode into the record, then end_record() it
+// Null if the message has to be dropped
+Record* begin_record();
+void end_record(Record* record);
+
+// Block until every message submitted before the call has been written
+void flush();
+
+// Format a message with printf rules, returns the length it would have had
+usize format(const Record& record, char* buf, usize len);
+
+template <typename... Args>
+static inline void write(const char* fmt, Args... args) {
+    if (Record* r = begin_record()) {
+        encode_into(*r, fmt, args...);
+        end_record(r);
+    }
+}
+
+}
+
+//
+// Profiling
+// HK_PROFILE_ZONE("name") records the enclosing scope into a per-thread ring of zone events.
+// Compiled out entirely unless HK_PROFILE is defined
+//
+
+namespace prof {
+
+// Per thread, must be a power of two
+constexpr usize MAX_ZONE_EVENTS = 1 << 14;
+constexpr usize MAX_ALLOC_SITES = 1 << 10;
+constexpr usize MAX_COUNTER_ZONES = 32;
+constexpr u32   MAX_THREADS = 64;
+
+struct ZoneEvent {
+    // Must be a literal
+    const char* name;
+    // Clock ticks, see sys::clock_ticks_to_ns()
+    u64         begin;
+    u64         end;
+    u32         depth;
+};
+
+// Running totals for one allocation callsite, see HK_ALLOC_PROFILE
+struct AllocSite {
+    // Null while the slot is unused. Published last
+    std::atomic<const char*>    file;
+    const char*                 function;
+    u32                         line;
+    std::atomic<u64>            count;
+    std::atomic<u64>            bytes;
+};
+
+// Hardware counter totals for one HK_COUNTER_ZONE name
+struct CounterZoneStats {
+    // Null while the slot is unused. Published last
+    std::atomic<const char*>    name;
+    std::atomic<u32>            available;
+    std::atomic<u64>            calls;
+    std::atomic<u64>            values[sys::PERF_COUNTER_COUNT];
+};
+
+// Only written by the thread that owns it
+struct ThreadBuffer {
+    // Number of events ever written
+    alignas(HK_CACHE_LINE) std::atomic<u64> head;
+    u32                                     depth;
+    u32                                     index;
+    char                                    name[32];
+    // Allocations made through hk::mem, for reading from other threads
+    std::atomic<u64>                        allocs;
+    std::atomic<u64>                        alloc_bytes;
+    // Open-addressed by file and line, allocations past the limit are only counted above
+    AllocSite                               alloc_sites[MAX_ALLOC_SITES];
+    CounterZoneStats                        counter_zones[MAX_COUNTER_ZONES];
+    ZoneEvent                               events[MAX_ZONE_EVENTS];
+};
+
+// Get the calling thread's buffer, registering one on first use
+ThreadBuffer* thread_buffer();
+
+// Name the calling thread in profiles
+void set_thread_name(const char* name);
+
+// Make thread_buffer() ask somebody else, i.e. the engine, for buffers
+void set_thread_buffer_source(ThreadBuffer* (*source)());
+
+// Registered thread buffers
+u32 get_thread_count();
+ThreadBuffer* get_thread_buffer(u32 idx);
+
+// Copy the events a thread finished at or after `since` ticks, oldest first. Returns the count
+usize read_events(const ThreadBuffer* buf, u64 since, ZoneEvent* events, usize max_events);
+
+// Write every thread's events since `since` ticks as Chrome Trace Event JSON
+// (chrome://tracing, ui.perfetto.dev). Returns the number of events written
+usize write_chrome_trace(std::FILE* f, u64 since);
+
+// Allocation callsite totals summed over every thread
+struct AllocSiteTotals {
+    const char* file;
+    const char* function;
+    u32         line;
+    u64         count;
+    u64         bytes;
+};
+
+// Copy every thread's allocation sites, merged and sorted by file and line. Returns the count
+// Site strings point into the module that allocated, so callers keep those modules loaded
+usize read_alloc_sites(AllocSiteTotals* sites, usize max_sites);
+
+// Counter zone totals summed over every thread
+struct CounterZoneTotals {
+    const char* name;
+    u32         available;
+    u64         calls;
+    u64         values[sys::PERF_COUNTER_COUNT];
+};
+
+// Copy every thread's counter zones, merged by name. Returns the count
+usize read_counter_zones(CounterZoneTotals* zones, usize max_zones);
+
+// Add a counter delta to the calling thread's totals for `name`
+void add_counter_zone(const char* name, const sys::PerfCounters& begin, const sys::PerfCounters& end);
+
+class Zone {
+private:
+    ThreadBuffer*   m_buf;
+    const char*     m_name;
+    u64             m_begin;
+public:
+    Zone(const char* name) : m_buf(thread_buffer()), m_name(name) {
+        ++m_buf->depth;
+        m_begin = sys::get_clock_ticks();
+    }
+    ~Zone() {
+        const u64 end = sys::get_clock_ticks();
+        const u64 head = m_buf->head.load(std::memory_order_relaxed);
+        m_buf->events[head & (MAX_ZONE_EVENTS - 1)] = { m_name, m_begin, end, --m_buf->depth };
+        m_buf->head.store(head + 1, std::memory_order_release);
+    }
+    Zone(const Zone&) = delete;
+    Zone& operator=(const Zone&) = delete;
+};
+
+// Reads hardware counters at both ends, costs a couple of syscalls
+class CounterZone {
+private:
+    const char*         m_name;
+    sys::PerfCounters   m_begin;
+public:
+    CounterZone(const char* name) : m_name(name) {
+        sys::read_perf_counters(m_begin);
+    }
+    ~CounterZone() {
+        sys::PerfCounters end;
+        if (m_begin.available && sys::read_perf_counters(end)) {
+            add_counter_zone(m_name, m_begin, end);
+        }
+    }
+    CounterZone(const CounterZone&) = delete;
+    CounterZone& operator=(const CounterZone&) = delete;
+};
+
+}
+
+}
+
+#ifdef HK_PROFILE
+#   define HK_PROFILE_ZONE(name) const hk::prof::Zone HK_CONCAT(hk_zone_, __LINE__)(name)
+// A profiling zone that also counts cycles, instructions, cache and branch misses
+#   define HK_COUNTER_ZONE(name) HK_PROFILE_ZONE(name); const hk::prof::CounterZone HK_CONCAT(hk_counter_zone_, __LINE__)(name)
+#else
+#   define HK_PROFILE_ZONE(name) (void)0
+#   define HK_COUNTER_ZONE(name) (void)0
+#endif
+
 #ifndef HK_KEEP_NAMESPACE
 using namespace hk;
 #endif
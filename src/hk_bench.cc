@@ -0,0 +1,213 @@
+#include "hk_bench.hh"
+
+//
+// Micro-benchmarks
+//
+
+void hk::bench::State::pause() {
+    sys::read_perf_counters(m_pause_counters);
+    m_pause_begin = sys::get_clock_ticks();
+}
+
+void hk::bench::State::resume() {
+    m_paused_ticks += sys::get_clock_ticks() - m_pause_begin;
+    sys::PerfCounters now;
+    if (sys::read_perf_counters(now)) {
+        for (usize i = 0; i < sys::PERF_COUNTER_COUNT; ++i) {
+            m_paused_counters.values[i] += now.values[i] - m_pause_counters.values[i];
+        }
+    }
+}
+
+// Time one sample. Returns nanoseconds, counter deltas go to `counters` if given
+static hk::f64 run_sample(const hk::bench::Benchmark& benchmark, hk::u64 iterations, hk::sys::PerfCounters* counters) {
+    using namespace hk;
+    bench::State state = bench::State();
+    state.iterations = iterations;
+    sys::PerfCounters c1, c2;
+    const bool have_counters = counters && sys::read_perf_counters(c1);
+    const u64 t1 = sys::get_clock_ticks();
+    benchmark.fn(state, benchmark.user);
+    const u64 t2 = sys::get_clock_ticks();
+    if (have_counters && sys::read_perf_counters(c2)) {
+        counters->available = c1.available & c2.available;
+        for (usize i = 0; i < sys::PERF_COUNTER_COUNT; ++i) {
+            counters->values[i] = c2.values[i] - c1.values[i] - state.paused_counters().values[i];
+        }
+    } else if (counters) {
+        *counters = { };
+    }
+    const u64 ns = sys::clock_ticks_to_ns(t2) - sys::clock_ticks_to_ns(t1);
+    const u64 paused_ns = sys::clock_ticks_to_ns(t1 + state.paused_ticks()) - sys::clock_ticks_to_ns(t1);
+    return (f64)(ns - min(ns, paused_ns));
+}
+
+static void sort_samples(hk::f64* samples, hk::usize count) {
+    for (hk::usize i = 1; i < count; ++i) {
+        const hk::f64 x = samples[i];
+        hk::usize j = i;
+        for (; j > 0 && samples[j - 1] > x; --j) {
+            samples[j] = samples[j - 1];
+        }
+        samples[j] = x;
+    }
+}
+
+// Nearest rank, `samples` must be sorted
+static hk::f64 percentile(const hk::f64* samples, hk::usize count, hk::f64 p) {
+    const hk::usize rank = (hk::usize)(p * (hk::f64)(count - 1) + 0.5);
+    return samples[hk::min(rank, count - 1)];
+}
+
+hk::bench::Result hk::bench::run(const Benchmark& benchmark, const Options& options) {
+    // Grow the iteration count until a sample takes long enough to time reliably
+    u64 iterations = 1;
+    while (iterations < ((u64)1 << 40)) {
+        const f64 ns = run_sample(benchmark, iterations, nullptr);
+        if (ns >= (f64)options.min_sample_ns) {
+            break;
+        }
+        // Aim a little past the target, but don't trust tiny samples to extrapolate from
+        const f64 scale = ns > 0.0 ? min(10.0, 1.2 * (f64)options.min_sample_ns / ns) : 10.0;
+        iterations = max(iterations + 1, (u64)((f64)iterations * scale));
+    }
+    for (u32 i = 0; i < options.warmup_samples; ++i) {
+        run_sample(benchmark, iterations, nullptr);
+    }
+
+    Result result = { };
+    result.name = benchmark.name;
+    result.iterations = iterations;
+    result.samples = min(max<u32>(options.samples, 1), MAX_SAMPLES);
+    result.elements = max<u64>(benchmark.elements, 1);
+    result.counters_available = ~0u;
+    f64 samples[MAX_SAMPLES];
+    u64 counters[sys::PERF_COUNTER_COUNT] = { };
+    for (u32 i = 0; i < result.samples; ++i) {
+        sys::PerfCounters delta;
+        samples[i] = run_sample(benchmark, iterations, &delta) / (f64)iterations;
+        result.counters_available &= delta.available;
+        for (usize c = 0; c < sys::PERF_COUNTER_COUNT; ++c) {
+            counters[c] += delta.values[c];
+        }
+    }
+    for (usize c = 0; c < sys::PERF_COUNTER_COUNT; ++c) {
+        result.counters[c] = (f64)counters[c] / ((f64)iterations * result.samples);
+    }
+
+    sort_samples(samples, result.samples);
+    result.median_ns = percentile(samples, result.samples, 0.5);
+    result.min_ns = samples[0];
+    result.p5_ns = percentile(samples, result.samples, 0.05);
+    result.p95_ns = percentile(samples, result.samples, 0.95);
+    f64 deviations[MAX_SAMPLES];
+    for (u32 i = 0; i < result.samples; ++i) {
+        deviations[i] = samples[i] > result.median_ns ? samples[i] - result.median_ns : result.median_ns - samples[i];
+    }
+    sort_samples(deviations, result.samples);
+    result.mad_ns = percentile(deviations, result.samples, 0.5);
+    return result;
+}
+
+void hk::bench::print_header(std::FILE* f) {
+    std::fprintf(f, "%-32s %12s %9s %12s %12s %10s %6s %9s %9s %9s\n",
+        "benchmark", "median ns", "MAD", "p5", "p95", "ns/elem", "IPC", "L1D/elem", "LLC/elem", "br/elem");
+}
+
+void hk::bench::print_result(std::FILE* f, const Result& r) {
+    std::fprintf(f, "%-32s %12.1f %8.1f%% %12.1f %12.1f %10.2f", r.name,
+        r.median_ns, r.median_ns > 0.0 ? 100.0 * r.mad_ns / r.median_ns : 0.0,
+        r.p5_ns, r.p95_ns, r.median_ns / (f64)r.elements);
+    const auto has = [&](sys::PerfCounter c) { return (r.counters_available >> (u32)c) & 1; };
+    const auto per_elem = [&](sys::PerfCounter c) { return r.counters[(usize)c] / (f64)r.elements; };
+    if (has(sys::PerfCounter::Cycles) && has(sys::PerfCounter::Instructions)) {
+        std::fprintf(f, " %6.2f", r.counters[(usize)sys::PerfCounter::Instructions] / max(r.counters[(usize)sys::PerfCounter::Cycles], 1.0));
+    } else {
+        std::fprintf(f, " %6s", "-");
+    }
+    for (sys::PerfCounter c : { sys::PerfCounter::L1DMisses, sys::PerfCounter::LLCMisses, sys::PerfCounter::BranchMisses }) {
+        if (has(c)) {
+            std::fprintf(f, " %9.3f", per_elem(c));
+        } else {
+            std::fprintf(f, " %9s", "-");
+        }
+    }
+    std::fprintf(f, "\n");
+}
+
+void hk::bench::write_json(std::FILE* f, const Result* results, usize count) {
+    std::fprintf(f, "{\"benchmarks\":[\n");
+    for (usize i = 0; i < count; ++i) {
+        const Result& r = results[i];
+        std::fprintf(f, "{\"name\":\"%s\",\"iterations\":%llu,\"samples\":%u,\"elements\":%llu,"
+            "\"median_ns\":%.3f,\"mad_ns\":%.3f,\"min_ns\":%.3f,\"p5_ns\":%.3f,\"p95_ns\":%.3f}%s\n",
+            r.name, (unsigned long long)r.iterations, r.samples, (unsigned long long)r.elements,
+            r.median_ns, r.mad_ns, r.min_ns, r.p5_ns, r.p95_ns, i + 1 < count ? "," : "");
+    }
+    std::fprintf(f, "]}\n");
+}
+
+// Find `key` in [str, end) and parse the number after it
+static bool read_json_number(const char* str, const char* end, const char* key, hk::f64& value) {
+    const char* found = std::strstr(str, key);
+    if (!found || found >= end) {
+        return false;
+    }
+    value = std::strtod(found + std::strlen(key), nullptr);
+    return true;
+}
+
+hk::isize hk::bench::read_baseline(const char* path, BaselineEntry* entries, usize max_entries) {
+    Array<u8> data = Array<u8>();
+    if (!sys::read_file(path, data)) {
+        return -1;
+    }
+    data.append(0);
+    // Only understands what write_json() writes, one flat object per benchmark
+    usize count = 0;
+    const char* str = (const char*)data.buffer();
+    const char* key = "{\"name\":\"";
+    while (count < max_entries && (str = std::strstr(str, key))) {
+        str += std::strlen(key);
+        const char* name_end = std::strchr(str, '"');
+        const char* obj_end = name_end ? std::strchr(name_end, '}') : nullptr;
+        if (!obj_end) {
+            break;
+        }
+        BaselineEntry& e = entries[count];
+        std::snprintf(e.name, sizeof(e.name), "%.*s", (int)(name_end - str), str);
+        e.mad_ns = 0.0;
+        read_json_number(name_end, obj_end, "\"mad_ns\":", e.mad_ns);
+        if (read_json_number(name_end, obj_end, "\"median_ns\":", e.median_ns)) {
+            ++count;
+        }
+        str = obj_end;
+    }
+    return (isize)count;
+}
+
+hk::usize hk::bench::compare(std::FILE* f, const Result* results, usize count, const BaselineEntry* baseline, usize baseline_count, f64 threshold) {
+    usize regressions = 0;
+    for (usize i = 0; i < count; ++i) {
+        const Result& r = results[i];
+        const BaselineEntry* base = nullptr;
+        for (usize j = 0; j < baseline_count && !base; ++j) {
+            if (str::equal(baseline[j].name, r.name)) {
+                base = &baseline[j];
+            }
+        }
+        if (!base || base->median_ns <= 0.0) {
+            std::fprintf(f, "%-32s %12.1f ns  (no baseline)\n", r.name, r.median_ns);
+            continue;
+        }
+        const f64 delta = r.median_ns - base->median_ns;
+        // Differences inside a few MADs are noise, whatever the percentage
+        const f64 noise = 3.0 * max(r.mad_ns, base->mad_ns);
+        const bool regressed = delta > threshold * base->median_ns && delta > noise;
+        regressions += regressed;
+        std::fprintf(f, "%-32s %12.1f -> %12.1f ns  %+7.2f%%%s\n", r.name,
+            base->median_ns, r.median_ns, 100.0 * delta / base->median_ns,
+            regressed ? "  REGRESSION" : "");
+    }
+    return regressions;
+}
@@ -0,0 +1,126 @@
+#ifndef _HK_BENCH_HH_
+#define _HK_BENCH_HH_
+
+#include "hk.hh"
+
+#ifdef HK_MSVC
+#   include <intrin.h>
+#endif
+
+//
+// Micro-benchmarks
+// Each benchmark is warmed up, its iteration count calibrated so a sample takes a
+// measurable amount of time, then sampled repeatedly. Results are per iteration and
+// summarized with the median and median absolute deviation, which ignore the odd
+// sample that got preempted.
+//
+
+namespace hk {
+
+namespace bench {
+
+// Make the compiler assume `value` is read, so the computation producing it isn't removed
+template <typename T>
+static inline void do_not_optimize(const T& value) {
+#ifdef HK_MSVC
+    const volatile char* volatile sink = (const volatile char*)&value; (void)sink;
+    _ReadWriteBarrier();
+#else
+    asm volatile("" : : "r,m"(value) : "memory");
+#endif
+}
+
+// Make the compiler assume all memory is read and written, so stores aren't removed
+static inline void clobber_memory() {
+#ifdef HK_MSVC
+    _ReadWriteBarrier();
+#else
+    asm volatile("" : : : "memory");
+#endif
+}
+
+// Passed to the benchmark function, which must run its body `iterations` times
+class State {
+private:
+    u64                 m_paused_ticks = 0;
+    u64                 m_pause_begin = 0;
+    sys::PerfCounters   m_paused_counters = { };
+    sys::PerfCounters   m_pause_counters = { };
+public:
+    u64                 iterations = 0;
+
+    // Stop the clock, e.g. for setup between batches
+    void pause();
+    void resume();
+
+    // Internal
+    u64 paused_ticks() const { return m_paused_ticks; }
+    const sys::PerfCounters& paused_counters() const { return m_paused_counters; }
+};
+
+typedef void (*BenchFn)(State& state, void* user);
+
+struct Benchmark {
+    const char* name;
+    BenchFn     fn;
+    void*       user;
+    // Work items per iteration, for per-element figures
+    u64         elements;
+};
+
+struct Options {
+    u32 warmup_samples = 3;
+    u32 samples = 25;
+    // Iterations are calibrated so one sample takes at least this long
+    u64 min_sample_ns = 5000000;
+    // Slowdown over the baseline median that counts as a regression
+    f64 regression_threshold = 0.05;
+};
+
+constexpr u32 MAX_SAMPLES = 1024;
+
+struct Result {
+    const char* name;
+    u64         iterations;
+    u32         samples;
+    u64         elements;
+    // Nanoseconds per iteration
+    f64         median_ns;
+    f64         mad_ns;
+    f64         min_ns;
+    f64         p5_ns;
+    f64         p95_ns;
+    // Hardware counters per iteration, see sys::read_perf_counters()
+    u32         counters_available;
+    f64         counters[sys::PERF_COUNTER_COUNT];
+};
+
+// Warm up, calibrate and sample one benchmark
+Result run(const Benchmark& benchmark, const Options& options);
+
+// One line per result, with IPC and misses per element when counters are available
+void print_header(std::FILE* f);
+void print_result(std::FILE* f, const Result& result);
+
+// Save results for later comparison
+void write_json(std::FILE* f, const Result* results, usize count);
+
+// Baseline entry read back from write_json() output
+struct BaselineEntry {
+    char    name[64];
+    f64     median_ns;
+    f64     mad_ns;
+};
+
+// Read a file written by write_json(). Returns the number of entries, or -1 if it can't be read
+isize read_baseline(const char* path, BaselineEntry* entries, usize max_entries);
+
+// Print each result against its baseline. Returns the number of regressions: results slower
+// than the threshold and by more than the noise in either measurement
+usize compare(std::FILE* f, const Result* results, usize count, const BaselineEntry* baseline, usize baseline_count, f64 threshold);
+
+}
+
+}
+
+#endif // _HK_BENCH_HH_
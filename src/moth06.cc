@@ -6,62 +6,661 @@ App a = { };
 EngineInterface ei = { };
 GameInterface gi = { };
 
-static void e_dbg_log(const char* fmt, ...) {
-    char buf[1024];
-    std::va_list va; va_start(va, fmt);
-    std::vsnprintf(buf, sizeof(buf), fmt, va);
-    va_end(va);
+// Assets are kept in memory once loaded and shared by every game context
+struct CachedAsset {
+    char path[256];
+    Array<u8> data;
+};
+static Array<CachedAsset> asset_cache;
+static hk::sys::SpinLock asset_cache_lock;
 
-    dbgmsg_("GAME | %s", buf);
+static bool e_load_asset( const char* path, Span<const u8>& data ) {
+    HK_PROFILE_ZONE("Load asset");
+    // Files are read under the lock. Loads are rare, and contexts starting together
+    // want the same assets anyway
+    hk::sys::ScopedLock lock = hk::sys::ScopedLock(asset_cache_lock);
+    for (CachedAsset& asset : asset_cache) {
+        if (hk::str::equal(asset.path, path)) {
+            ++a.asset_hits;
+            data = asset.data.const_bytes();
+            return true;
+        }
+    }
+    ++a.asset_misses;
+    if (std::strlen(path) >= sizeof(CachedAsset::path)) {
+        return false;
+    }
+    // Growing the cache moves the entries but not their data, so handed out spans stay valid
+    asset_cache.resize(asset_cache.length() + 1);
+    CachedAsset& asset = asset_cache[asset_cache.length() - 1];
+    if (!hk::sys::read_file(path, asset.data)) {
+        asset_cache.resize(asset_cache.length() - 1);
+        return false;
+    }
+    std::snprintf(asset.path, sizeof(asset.path), "%s", path);
+    a.asset_resident_bytes += asset.data.length();
+    data = asset.data.const_bytes();
+    return true;
 }
 
-static bool e_load_asset( const char* path, Array<u8>& data ) {
-    return true;
+#ifdef HK_WINDOWS
+static const char* game_dll_src = "moth06_game.dll";
+#endif
+#ifdef HK_MACOS
+static const char* game_dll_src = "libmoth06_game.dylib";
+#endif
+#ifdef HK_LINUX
+static const char* game_dll_src = "./libmoth06_game.so";
+#endif
+
+// Every live game context, so a reload can carry their state over. Main thread only
+static Array<GameContext*> game_contexts;
+
+// Keep a context's state if the game build understands it, otherwise convert it or start over
+static void adopt_game_state(const GameInterface& game, GameContext* ctx) {
+    GameStateHeader* header = (GameStateHeader*)ctx->state;
+    if (!header->layout_hash) {
+        game.state.init(ctx);
+    } else if (header->version == game.state.version && header->layout_hash == game.state.layout_hash) {
+        dbgmsg("Kept game state (version %u)", header->version);
+    } else if (game.state.migrate && game.state.migrate(ctx, header->version, header->layout_hash)) {
+        dbgmsg("Migrated game state from version %u to %u", header->version, game.state.version);
+    } else {
+        dbgmsg("Game state layout changed, starting over");
+        game.state.init(ctx);
+    }
+    header->version = game.state.version;
+    header->layout_hash = game.state.layout_hash;
+}
+
+// Create a simulation with fresh state. Needs a connected game
+static GameContext* create_game_context() {
+    GameContext* ctx = hk::mem::alloc<GameContext>();
+    ctx->state_capacity = GAME_STATE_CAPACITY;
+    ctx->state = hk::mem::alloc_aligned<u8>(ctx->state_capacity, HK_CACHE_LINE);
+    adopt_game_state(gi, ctx);
+    game_contexts.append(ctx);
+    return ctx;
 }
 
-static void load_game() {
+static void destroy_game_context(GameContext* ctx) {
+    for (usize i = 0; i < game_contexts.length(); ++i) {
+        if (game_contexts[i] == ctx) {
+            game_contexts[i] = game_contexts[game_contexts.length() - 1];
+            game_contexts.resize(game_contexts.length() - 1);
+            break;
+        }
+    }
+    hk::mem::free_aligned((u8*)ctx->state);
+    hk::mem::free(ctx);
+}
+
+// Load a snapshot of the game library and connect to it. If that fails the current one keeps running
+static bool load_game() {
+    // The library is loaded from a copy so the original can be rebuilt while the game runs
+    char game_dll_dst[64] = { };
+    const i32 memfd = hk::sys::copy_file_to_memory(game_dll_src, game_dll_dst, sizeof(game_dll_dst));
+    if (memfd < 0) {
+        // Every copy needs its own name, the loader won't load the same path twice
 #ifdef HK_WINDOWS
-    const char* game_dll_src = "moth06_game.dll";
-    const char* game_dll_dst = "moth06_game_loaded.dll";
+        std::snprintf(game_dll_dst, sizeof(game_dll_dst), "moth06_game_loaded_%u.dll", a.game_loads);
 #endif
 #ifdef HK_MACOS
-    const char* game_dll_src = "libmoth06_game.dylib";
-    const char* game_dll_dst = "libmoth06_game_loaded.dylib";
+        std::snprintf(game_dll_dst, sizeof(game_dll_dst), "libmoth06_game_loaded_%u.dylib", a.game_loads);
 #endif
 #ifdef HK_LINUX
-    const char* game_dll_src = "./libmoth06_game.so";
-    const char* game_dll_dst = "./libmoth06_game_loaded.so";
+        std::snprintf(game_dll_dst, sizeof(game_dll_dst), "./libmoth06_game_loaded_%u.so", a.game_loads);
 #endif
-    if (a.game_lib) {
-        SDL_UnloadObject(a.game_lib);
+        if (!hk::sys::copy_file(game_dll_src, game_dll_dst)) {
+            dbgmsg("Failed to copy %s to %s", game_dll_src, game_dll_dst);
+            return false;
+        }
+    }
+    // The memory file stays open as long as its library is loaded. Closing it would free the fd
+    // number for the next copy, and dlopen() hands back the already loaded library for a path it
+    // has seen, so the reload would silently keep the old code
+    void* lib = SDL_LoadObject(game_dll_dst);
+    if (!lib) {
+        dbgmsg("Failed to load %s: %s", game_dll_src, SDL_GetError());
+        hk::sys::close_memory_file(memfd);
+        return false;
+    }
+    ConnectGameFn connect_game = (ConnectGameFn)SDL_LoadFunction(lib, "connect_game");
+    GameInterface new_gi = { };
+    new_gi.size = sizeof(new_gi);
+    if (!connect_game) {
+        dbgmsg("%s has no connect_game", game_dll_src);
+        SDL_UnloadObject(lib);
+        hk::sys::close_memory_file(memfd);
+        return false;
+    }
+
+    // Once its code has run the library stays loaded, even if connecting fails. Allocation
+    // sites, zone names and queued log messages may point into it, like into replaced ones.
+    // It keeps its copy's name too, so the next copy gets a new one
+    ++a.game_loads;
+    if (!connect_game(&ei, &new_gi)) {
+        dbgmsg("Failed to connect game");
+        return false;
+    }
+    if (new_gi.state.min_capacity > GAME_STATE_CAPACITY) {
+        dbgmsg("Game state needs %zu bytes, only %zu available", new_gi.state.min_capacity, GAME_STATE_CAPACITY);
+        new_gi.disconnect();
+        return false;
+    }
+    for (GameContext* ctx : game_contexts) {
+        adopt_game_state(new_gi, ctx);
+    }
+
+    // Old libraries stay loaded, and so do their memory files. Zone names, allocation
+    // sites and queued log messages point into them, and a reload only leaks a few hundred KB
+    if (gi.disconnect) {
+        gi.disconnect();
+    }
+    a.game_lib = lib;
+    gi = new_gi;
+    return true;
+}
+
+// Swap in a rebuilt game library between frames
+static void reload_game() {
+    HK_PROFILE_ZONE("Reload game");
+    const u64 t1 = hk::sys::get_time_ns();
+    if (load_game()) {
+        dbgmsg("Reloaded game in %.2f ms", (f64)(hk::sys::get_time_ns() - t1) / 1e6);
+    }
+}
+
+struct Simulation {
+    GameContext* ctx;
+    u64 ticks;
+};
+
+static void run_simulation_batch(void* user, usize begin, usize end) {
+    Simulation* sims = (Simulation*)user;
+    for (usize i = begin; i < end; ++i) {
+        HK_PROFILE_ZONE("Simulate");
+        for (u64 tick = 0; tick < sims[i].ticks; ++tick) {
+            gi.update(sims[i].ctx);
+        }
+    }
+}
+
+// Step `count` independent contexts `ticks` times across the job threads, e.g. to verify replays.
+// They all start from fresh state with the same inputs, so they must end with the same checksum
+static bool run_simulations(u32 count, u64 ticks) {
+    Array<Simulation> sims = Array<Simulation>(count);
+    for (Simulation& sim : sims) {
+        sim.ctx = create_game_context();
+        sim.ticks = ticks;
+    }
+    const u64 t1 = hk::sys::get_time_ns();
+    hk::sys::parallel_for(count, 1, run_simulation_batch, sims.buffer());
+    const f64 ms = (f64)(hk::sys::get_time_ns() - t1) / 1e6;
+    dbgmsg("Ran %u simulations for %llu ticks in %.2f ms (%.0f ticks/s)", count, (unsigned long long)ticks,
+        ms, (f64)(count * ticks) / hk::max(ms / 1000.0, 1e-9));
+
+    bool ok = true;
+    const u64 expected = gi.state.checksum(sims[0].ctx);
+    for (usize i = 0; i < sims.length(); ++i) {
+        const u64 checksum = gi.state.checksum(sims[i].ctx);
+        if (checksum != expected) {
+            dbgmsg("Simulation %zu diverged: checksum %016llx, expected %016llx", i,
+                (unsigned long long)checksum, (unsigned long long)expected);
+            ok = false;
+        }
+        destroy_game_context(sims[i].ctx);
+    }
+    return ok;
+}
+
+// Run the game ticks that came due since the last frame
+static void step_game() {
+    HK_PROFILE_ZONE("Game update");
+    constexpr u64 TICK = 1000000000;
+    const u64 now = hk::sys::get_time_ns();
+    u32 ticks = 1;
+    // Uncapped, each frame draws the tick it just ran
+    a.sim.alpha = 1.0f;
+    if (!(a.state & APP_STATE_UNCAPPED)) {
+        a.sim.accumulator += (now - a.sim.last_ns) * SIM_HZ;
+        ticks = (u32)hk::min<u64>(a.sim.accumulator / TICK, MAX_SIM_TICKS_PER_FRAME + 1);
+        if (ticks > MAX_SIM_TICKS_PER_FRAME) {
+            // Too far behind, let the game slow down
+            a.sim.dropped_ticks += a.sim.accumulator / TICK - MAX_SIM_TICKS_PER_FRAME;
+            a.sim.accumulator %= TICK;
+            ticks = MAX_SIM_TICKS_PER_FRAME;
+        } else {
+            a.sim.accumulator -= ticks * TICK;
+        }
+        a.sim.alpha = (f32)((f64)a.sim.accumulator / (f64)TICK);
     }
-    if (!hk::sys::copy_file(game_dll_src, game_dll_dst)) {
-        die("Failed to copy %s to %s", game_dll_src, game_dll_dst);
+    a.sim.last_ns = now;
+    for (u32 i = 0; i < ticks; ++i) {
+        gi.update(a.game);
     }
-    if (!(a.game_lib = SDL_LoadObject(game_dll_dst))) {
-        die("Failed to load %s", game_dll_dst);
+    a.sim.ticks += ticks;
+    a.sim.frame_ticks = ticks;
+}
+
+// Write the zones recorded since `since` ticks as a Chrome trace
+static void write_trace(const char* path, u64 since) {
+    std::FILE* f = std::fopen(path, "w");
+    if (!f) {
+        dbgmsg("Failed to open %s for writing", path);
+        return;
+    }
+    const usize num_events = hk::prof::write_chrome_trace(f, since);
+    std::fclose(f);
+    dbgmsg("Wrote %zu zone events to %s", num_events, path);
+}
+
+// Write the zones recorded during the last `frames` frames
+static void dump_trace(const char* path, usize frames) {
+    frames = hk::min<u64>(hk::max<usize>(frames, 1), hk::min<u64>(a.frame_count, MAX_FRAME_HISTORY));
+    if (frames) {
+        write_trace(path, a.frame_begin[(a.frame_count - frames) % MAX_FRAME_HISTORY]);
     }
-    ConnectGameFn connect_game = (ConnectGameFn)SDL_LoadFunction(a.game_lib, "connect_game");
-    HK_ASSERT(connect_game);
-    if (!connect_game(&ei, &gi)) {
-        die("Failed to connect game");
+}
+
+static void report_startup() {
+    const u64 main_ns = hk::sys::clock_ticks_to_ns(a.startup.main);
+    const auto ms = [&](u64 ticks) { return (f64)(hk::sys::clock_ticks_to_ns(ticks) - main_ns) / 1e6; };
+    dbgmsg("Startup: window after %.2f ms, game connected after %.2f ms, first frame after %.2f ms",
+        ms(a.startup.window), ms(a.startup.game_connected), ms(a.startup.first_frame));
+}
+
+#ifdef HK_ALLOC_PROFILE
+constexpr usize MAX_ALLOC_SITE_TOTALS = 4096;
+
+// Callsite totals at the start of this frame and the one before
+static struct {
+    hk::prof::AllocSiteTotals totals[2][MAX_ALLOC_SITE_TOTALS];
+    usize num_totals[2];
+    u32 cur;
+} alloc_sites;
+
+// Sites that allocated during the last frame, with count and bytes for that frame only
+static usize get_frame_alloc_sites(hk::prof::AllocSiteTotals* sites) {
+    const hk::prof::AllocSiteTotals* cur = alloc_sites.totals[alloc_sites.cur];
+    const hk::prof::AllocSiteTotals* prev = alloc_sites.totals[alloc_sites.cur ^ 1];
+    const usize num_cur = alloc_sites.num_totals[alloc_sites.cur];
+    const usize num_prev = alloc_sites.num_totals[alloc_sites.cur ^ 1];
+    usize count = 0;
+    // Both lists are sorted by file and line
+    for (usize i = 0, j = 0; i < num_cur; ++i) {
+        while (j < num_prev && (prev[j].file < cur[i].file || (prev[j].file == cur[i].file && prev[j].line < cur[i].line))) {
+            ++j;
+        }
+        hk::prof::AllocSiteTotals site = cur[i];
+        if (j < num_prev && prev[j].file == site.file && prev[j].line == site.line) {
+            site.count -= prev[j].count;
+            site.bytes -= prev[j].bytes;
+        }
+        if (site.count) {
+            sites[count++] = site;
+        }
     }
+    return count;
+}
+
+// Most bytes first
+static void sort_alloc_sites(hk::prof::AllocSiteTotals* sites, usize count) {
+    for (usize i = 1; i < count; ++i) {
+        const hk::prof::AllocSiteTotals site = sites[i];
+        usize j = i;
+        for (; j > 0 && sites[j - 1].bytes < site.bytes; --j) {
+            sites[j] = sites[j - 1];
+        }
+        sites[j] = site;
+    }
+}
+
+static void dump_alloc_sites(const char* path) {
+    static hk::prof::AllocSiteTotals frame[MAX_ALLOC_SITE_TOTALS];
+    static hk::prof::AllocSiteTotals total[MAX_ALLOC_SITE_TOTALS];
+    const usize num_frame = get_frame_alloc_sites(frame);
+    const usize num_total = alloc_sites.num_totals[alloc_sites.cur];
+    hk::mem::copy(total, alloc_sites.totals[alloc_sites.cur], hk::max<usize>(num_total, 1));
+    sort_alloc_sites(frame, num_frame);
+    sort_alloc_sites(total, num_total);
+    std::FILE* f = std::fopen(path, "w");
+    if (!f) {
+        dbgmsg("Failed to open %s for writing", path);
+        return;
+    }
+    std::fprintf(f, "# Last frame (frame %llu)\n# bytes count site function\n", (unsigned long long)a.frame_count - 1);
+    for (usize i = 0; i < num_frame; ++i) {
+        const hk::prof::AllocSiteTotals& s = frame[i];
+        std::fprintf(f, "%llu %llu %s:%u %s\n", (unsigned long long)s.bytes, (unsigned long long)s.count, s.file, s.line, s.function);
+    }
+    std::fprintf(f, "\n# Since startup\n# bytes count site function\n");
+    for (usize i = 0; i < num_total; ++i) {
+        const hk::prof::AllocSiteTotals& s = total[i];
+        std::fprintf(f, "%llu %llu %s:%u %s\n", (unsigned long long)s.bytes, (unsigned long long)s.count, s.file, s.line, s.function);
+    }
+    std::fclose(f);
+    dbgmsg("Wrote %zu allocation sites to %s", num_total, path);
+}
+#endif
+
+// Stamp the start of a frame and sample the allocation counters
+static void begin_frame_stats() {
+    u64 allocs = 0, alloc_bytes = 0;
+    for (u32 t = 0; t < hk::prof::get_thread_count(); ++t) {
+        if (const hk::prof::ThreadBuffer* buf = hk::prof::get_thread_buffer(t)) {
+            allocs += buf->allocs.load(std::memory_order_relaxed);
+            alloc_bytes += buf->alloc_bytes.load(std::memory_order_relaxed);
+        }
+    }
+    const usize idx = a.frame_count++ % MAX_FRAME_HISTORY;
+    a.frame_begin[idx] = hk::sys::get_clock_ticks();
+    a.frame_allocs[idx] = allocs;
+    a.frame_alloc_bytes[idx] = alloc_bytes;
+#ifdef HK_ALLOC_PROFILE
+    alloc_sites.cur ^= 1;
+    alloc_sites.num_totals[alloc_sites.cur] = hk::prof::read_alloc_sites(alloc_sites.totals[alloc_sites.cur], MAX_ALLOC_SITE_TOTALS);
+#endif
+}
+
+constexpr f64 FRAME_BUDGET_MS = 1000.0 / (f64)SIM_HZ;
+
+struct ZoneStats {
+    const char* name;
+    u32 thread;
+    u32 depth;
+    u32 calls;
+    u64 ns;
+};
+
+static void draw_perf_panel() {
+    // Finished frames, the newest one being the frame before this one
+    const usize frames = hk::min<u64>(a.frame_count - 1, MAX_FRAME_HISTORY - 1);
+    if (!frames) {
+        return;
+    }
+    const u64 last = a.frame_count - 2;
+    const u64 since = a.frame_begin[last % MAX_FRAME_HISTORY];
+    const u64 until = a.frame_begin[(last + 1) % MAX_FRAME_HISTORY];
+
+    bool open = true;
+    ImGui::SetNextWindowSize(ImVec2(460, 420), ImGuiCond_FirstUseEver);
+    if (!ImGui::Begin("Performance", &open)) {
+        ImGui::End();
+        return;
+    }
+    if (!open) {
+        a.state &= ~APP_STATE_PERF_PANEL;
+    }
+
+    // Frame times, with the 60 Hz budget halfway up and 30 Hz at the top
+    static f32 frame_ms[MAX_FRAME_HISTORY];
+    f32 worst_ms = 0.0f;
+    f64 total_ms = 0.0;
+    u64 peak_allocs = 0;
+    for (usize i = 0; i < frames; ++i) {
+        const u64 f = a.frame_count - 1 - frames + i;
+        const usize idx = f % MAX_FRAME_HISTORY, next = (f + 1) % MAX_FRAME_HISTORY;
+        frame_ms[i] = (f32)(hk::sys::clock_ticks_to_ns(a.frame_begin[next]) - hk::sys::clock_ticks_to_ns(a.frame_begin[idx])) / 1e6f;
+        worst_ms = hk::max(worst_ms, frame_ms[i]);
+        total_ms += frame_ms[i];
+        peak_allocs = hk::max(peak_allocs, a.frame_allocs[next] - a.frame_allocs[idx]);
+    }
+    char overlay[64] = { };
+    std::snprintf(overlay, sizeof(overlay), "%.2f ms (avg %.2f, worst %.2f)",
+        frame_ms[frames - 1], total_ms / frames, worst_ms);
+    ImGui::PlotLines("##Frame times", frame_ms, (int)frames, 0, overlay, 0.0f, (f32)(FRAME_BUDGET_MS * 2.0), ImVec2(-1.0f, 80.0f));
+    const ImVec2 plot_min = ImGui::GetItemRectMin(), plot_max = ImGui::GetItemRectMax();
+    const f32 budget_y = (plot_min.y + plot_max.y) * 0.5f;
+    ImDrawList* draw = ImGui::GetWindowDrawList();
+    draw->AddLine(ImVec2(plot_min.x, budget_y), ImVec2(plot_max.x, budget_y), IM_COL32(255, 200, 0, 160));
+    draw->AddLine(ImVec2(plot_min.x, plot_min.y + 1.0f), ImVec2(plot_max.x, plot_min.y + 1.0f), IM_COL32(255, 64, 64, 160));
+
+    // Allocations and assets
+    const usize last_idx = last % MAX_FRAME_HISTORY, next_idx = (last + 1) % MAX_FRAME_HISTORY;
+    ImGui::Text("Allocations: %llu (%.1f KiB) last frame, %llu peak",
+        (unsigned long long)(a.frame_allocs[next_idx] - a.frame_allocs[last_idx]),
+        (f64)(a.frame_alloc_bytes[next_idx] - a.frame_alloc_bytes[last_idx]) / 1024.0,
+        (unsigned long long)peak_allocs);
+    ImGui::Text("Simulation: tick %llu, %u this frame, alpha %.2f, %llu dropped%s",
+        (unsigned long long)a.sim.ticks, a.sim.frame_ticks, a.sim.alpha,
+        (unsigned long long)a.sim.dropped_ticks, (a.state & APP_STATE_UNCAPPED) ? " (uncapped)" : "");
+    const GfxStats& gfx_stats = get_gfx_stats();
+    ImGui::Text("Sprites: %u in %u batches, %u vertices", gfx_stats.sprites, gfx_stats.batches, gfx_stats.vertices);
+    ImGui::Text("Render: %u frames in flight, %.2f ms waiting", gfx_stats.frames_in_flight, (f64)gfx_stats.wait_ns / 1e6);
+    if (is_capturing()) {
+        const CaptureStats capture = get_capture_stats();
+        ImGui::Text("Capture: %llu frames, %llu dropped, %.1f MiB written", (unsigned long long)capture.frames_captured,
+            (unsigned long long)capture.frames_dropped, (f64)capture.bytes_written / (1024.0 * 1024.0));
+    }
+    const u64 lookups = a.asset_hits + a.asset_misses;
+    ImGui::Text("Asset cache: %.1f%% hits (%llu/%llu), %zu assets, %.2f MiB resident",
+        lookups ? 100.0 * (f64)a.asset_hits / (f64)lookups : 0.0,
+        (unsigned long long)a.asset_hits, (unsigned long long)lookups,
+        asset_cache.length(), (f64)a.asset_resident_bytes / (1024.0 * 1024.0));
+
+    // Hardware counters, totals since startup
+    if (ImGui::CollapsingHeader("Hardware counters")) {
+        hk::sys::PerfCounters counters;
+        static hk::prof::CounterZoneTotals zones[64];
+        const usize num_zones = hk::prof::read_counter_zones(zones, hk::arrlen(zones));
+        if (!hk::sys::read_perf_counters(counters)) {
+            ImGui::TextDisabled("Unavailable, needs Linux perf_event_open (see perf_event_paranoid)");
+        } else if (!num_zones) {
+            ImGui::TextUnformatted("No HK_COUNTER_ZONE has run yet");
+        } else if (ImGui::BeginTable("Counter zones", 6, ImGuiTableFlags_RowBg | ImGuiTableFlags_BordersInnerV)) {
+            ImGui::TableSetupColumn("Zone");
+            ImGui::TableSetupColumn("Calls");
+            ImGui::TableSetupColumn("IPC");
+            ImGui::TableSetupColumn("L1D/call");
+            ImGui::TableSetupColumn("LLC/call");
+            ImGui::TableSetupColumn("Branch/call");
+            ImGui::TableHeadersRow();
+            for (usize i = 0; i < num_zones; ++i) {
+                const hk::prof::CounterZoneTotals& z = zones[i];
+                auto value = [&](hk::sys::PerfCounter c) { return (f64)z.values[(usize)c]; };
+                auto column = [&](hk::sys::PerfCounter c) {
+                    ImGui::TableNextColumn();
+                    if (z.available & (1u << (u32)c)) {
+                        ImGui::Text("%.1f", value(c) / (f64)z.calls);
+                    } else {
+                        ImGui::TextDisabled("-");
+                    }
+                };
+                ImGui::TableNextRow();
+                ImGui::TableNextColumn(); ImGui::TextUnformatted(z.name);
+                ImGui::TableNextColumn(); ImGui::Text("%llu", (unsigned long long)z.calls);
+                ImGui::TableNextColumn(); ImGui::Text("%.2f", value(hk::sys::PerfCounter::Instructions) / hk::max(value(hk::sys::PerfCounter::Cycles), 1.0));
+                column(hk::sys::PerfCounter::L1DMisses);
+                column(hk::sys::PerfCounter::LLCMisses);
+                column(hk::sys::PerfCounter::BranchMisses);
+            }
+            ImGui::EndTable();
+        }
+    }
+
+    // Where last frame's allocations came from
+#ifdef HK_ALLOC_PROFILE
+    if (ImGui::CollapsingHeader("Allocation sites")) {
+        static hk::prof::AllocSiteTotals sites[MAX_ALLOC_SITE_TOTALS];
+        const usize num_sites = get_frame_alloc_sites(sites);
+        sort_alloc_sites(sites, num_sites);
+        if (ImGui::Button("Dump to moth06_allocs.txt")) {
+            a.state |= APP_STATE_WANTS_ALLOC_DUMP;
+        }
+        if (!num_sites) {
+            ImGui::TextUnformatted("No allocations last frame");
+        } else if (ImGui::BeginTable("Allocation sites", 3, ImGuiTableFlags_RowBg | ImGuiTableFlags_BordersInnerV)) {
+            ImGui::TableSetupColumn("Site");
+            ImGui::TableSetupColumn("Bytes");
+            ImGui::TableSetupColumn("Count");
+            ImGui::TableHeadersRow();
+            for (usize i = 0; i < hk::min<usize>(num_sites, 16); ++i) {
+                const hk::prof::AllocSiteTotals& s = sites[i];
+                ImGui::TableNextRow();
+                ImGui::TableNextColumn(); ImGui::Text("%s:%u", s.file, s.line);
+                if (ImGui::IsItemHovered()) {
+                    ImGui::SetTooltip("%s", s.function);
+                }
+                ImGui::TableNextColumn(); ImGui::Text("%llu", (unsigned long long)s.bytes);
+                ImGui::TableNextColumn(); ImGui::Text("%llu", (unsigned long long)s.count);
+            }
+            ImGui::EndTable();
+        }
+    }
+#else
+    ImGui::TextDisabled("Configure with MOTH06_ALLOC_PROFILE for allocation sites");
+#endif
+
+    // Time spent in each zone during the last frame
+    static hk::prof::ZoneEvent events[hk::prof::MAX_ZONE_EVENTS];
+    ZoneStats zones[128];
+    usize num_zones = 0;
+    for (u32 t = 0; t < hk::prof::get_thread_count(); ++t) {
+        const hk::prof::ThreadBuffer* buf = hk::prof::get_thread_buffer(t);
+        if (!buf) {
+            continue;
+        }
+        const usize count = hk::prof::read_events(buf, since, events, hk::arrlen(events));
+        for (usize i = 0; i < count && events[i].end < until; ++i) {
+            const hk::prof::ZoneEvent& e = events[i];
+            usize z = 0;
+            while (z < num_zones && !(zones[z].thread == t && hk::str::equal(zones[z].name, e.name))) {
+                ++z;
+            }
+            if (z == num_zones) {
+                if (num_zones == hk::arrlen(zones)) {
+                    continue;
+                }
+                zones[num_zones++] = { e.name, t, e.depth, 0, 0 };
+            }
+            zones[z].depth = hk::min(zones[z].depth, e.depth);
+            zones[z].calls += 1;
+            zones[z].ns += hk::sys::clock_ticks_to_ns(e.end) - hk::sys::clock_ticks_to_ns(e.begin);
+        }
+    }
+    // By thread, then most expensive first
+    for (usize i = 1; i < num_zones; ++i) {
+        const ZoneStats z = zones[i];
+        usize j = i;
+        for (; j > 0 && (zones[j - 1].thread > z.thread || (zones[j - 1].thread == z.thread && zones[j - 1].ns < z.ns)); --j) {
+            zones[j] = zones[j - 1];
+        }
+        zones[j] = z;
+    }
+    if (ImGui::BeginTable("Zones", 5, ImGuiTableFlags_RowBg | ImGuiTableFlags_BordersInnerV | ImGuiTableFlags_ScrollY)) {
+        ImGui::TableSetupScrollFreeze(0, 1);
+        ImGui::TableSetupColumn("Thread");
+        ImGui::TableSetupColumn("Zone");
+        ImGui::TableSetupColumn("ms");
+        ImGui::TableSetupColumn("Budget");
+        ImGui::TableSetupColumn("Calls");
+        ImGui::TableHeadersRow();
+        for (usize i = 0; i < num_zones; ++i) {
+            const ZoneStats& z = zones[i];
+            const f64 ms = (f64)z.ns / 1e6;
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn(); ImGui::TextUnformatted(hk::prof::get_thread_buffer(z.thread)->name);
+            ImGui::TableNextColumn(); ImGui::Text("%*s%s", (int)z.depth * 2, "", z.name);
+            ImGui::TableNextColumn(); ImGui::Text("%.3f", ms);
+            ImGui::TableNextColumn(); ImGui::Text("%.1f%%", 100.0 * ms / FRAME_BUDGET_MS);
+            ImGui::TableNextColumn(); ImGui::Text("%u", z.calls);
+        }
+        ImGui::EndTable();
+    }
+    ImGui::End();
 }
 
 static void draw_debug_menu() {
     if ( ImGui::BeginMainMenuBar() ) {
+        if ( ImGui::BeginMenu("File") ) {
+            if ( ImGui::MenuItem("Reload game code", "F6") ) {
+                a.state |= APP_STATE_WANTS_RELOAD;
+            }
+            ImGui::Separator();
+            if ( ImGui::MenuItem("Quit") ) {
+                a.state |= APP_STATE_WANTS_QUIT;
+            }
+            ImGui::EndMenu();
+        }
+        if ( ImGui::BeginMenu("View") ) {
+            if ( ImGui::MenuItem("Performance", "", a.state & APP_STATE_PERF_PANEL) ) {
+                a.state ^= APP_STATE_PERF_PANEL;
+            }
+            ImGui::EndMenu();
+        }
         ImGui::EndMainMenuBar();
     }
+    if ( a.state & APP_STATE_PERF_PANEL ) {
+        draw_perf_panel();
+    }
 }
 
 int main(int argc, char** argv) {
+    a.startup.main = hk::sys::get_clock_ticks();
     hk::sys::create_console();
-
-#if 1
-    moth06_test();
-#endif
+    hk::prof::set_thread_name("Main");
+    hk::logging::init(stderr);
 
     a.argc = argc; a.argv = (const char**)argv;
+    a.state = APP_STATE_PERF_PANEL;
+    a.trace_path = "moth06_trace.json";
+    a.trace_frames = 300;
+    bool trace_on_exit = false;
+    bool profile_startup = false;
+    bool run_tests = false;
+    u64 max_frames = 0;
+    u32 simulations = 0;
+    u64 simulation_ticks = 3600;
+    u32 frames_in_flight = 0;
+    bool software = false;
+    const char* capture_path = nullptr;
+    for (usize i = 1; i < a.argc; ++i) {
+        const char* f = a.argv[i];
+        if (hk::str::equal(f, "--test")) {
+            run_tests = true;
+        } else if (hk::str::equal(f, "--profile-startup")) {
+            profile_startup = true;
+        } else if (hk::str::equal(f, "--trace") && i + 1 < a.argc) {
+            a.trace_path = a.argv[++i];
+            trace_on_exit = true;
+        } else if (hk::str::equal(f, "--trace-frames") && i + 1 < a.argc) {
+            a.trace_frames = std::strtoul(a.argv[++i], nullptr, 10);
+        } else if (hk::str::equal(f, "--headless")) {
+            a.state |= APP_STATE_HEADLESS | APP_STATE_UNCAPPED;
+        } else if (hk::str::equal(f, "--software")) {
+            // Headless, drawing real frames on the CPU
+            a.state |= APP_STATE_HEADLESS | APP_STATE_UNCAPPED;
+            software = true;
+        } else if (hk::str::equal(f, "--capture") && i + 1 < a.argc) {
+            // Raw RGBA frames, or a YUV4MPEG2 video if the name ends in .y4m
+            capture_path = a.argv[++i];
+        } else if (hk::str::equal(f, "--uncapped")) {
+            a.state |= APP_STATE_UNCAPPED;
+        } else if (hk::str::equal(f, "--frames") && i + 1 < a.argc) {
+            max_frames = std::strtoull(a.argv[++i], nullptr, 10);
+        } else if (hk::str::equal(f, "--frames-in-flight") && i + 1 < a.argc) {
+            frames_in_flight = (u32)std::strtoul(a.argv[++i], nullptr, 10);
+        } else if (hk::str::equal(f, "--simulate") && i + 1 < a.argc) {
+            // Headless, no window or rendering
+            simulations = hk::max<u32>((u32)std::strtoul(a.argv[++i], nullptr, 10), 1);
+        } else if (hk::str::equal(f, "--ticks") && i + 1 < a.argc) {
+            simulation_ticks = std::strtoull(a.argv[++i], nullptr, 10);
+        } else {
+            die("Unknown command-line argument: %s", f);
+        }
+    }
+
+    if (run_tests) {
+        // Self-tests only, benchmarks are in moth06_bench. Tests that need the job system start and stop it themselves
+        moth06_test();
+    }
+
+    {
+        HK_PROFILE_ZONE("init_jobs");
+        hk::sys::init_jobs();
+    }
+    dbgmsg("Started job system with %u threads", hk::sys::get_job_thread_count());
 
     char exe_dir[512] = { };
     if (!hk::sys::get_exe_path(exe_dir, sizeof(exe_dir))) {
@@ -72,61 +671,216 @@ int main(int argc, char** argv) {
         die("Failed to change working directory to %s", exe_dir);
     }
 
+    ei.size = sizeof(ei);
+    ei.log = hk::logging::submit;
+    ei.clock = hk::sys::get_clock_calibration();
+    ei.prof_thread_buffer = hk::prof::thread_buffer;
+    ei.load_asset = e_load_asset;
+    ei.jobs.thread_count = hk::sys::get_job_thread_count;
+    ei.jobs.run = hk::sys::run_jobs;
+    ei.jobs.run_after = hk::sys::run_jobs_after;
+    ei.jobs.wait = hk::sys::wait_jobs;
+    ei.jobs.parallel_for = hk::sys::parallel_for;
+    ei.gfx.draw_sprites = draw_sprites;
+    ei.gfx.create_texture = create_texture;
+    ei.gfx.destroy_texture = destroy_texture;
+
+    // Nothing is drawn without a window, the game still gets texture handles
+    if (run_tests || simulations) {
+        GfxInitParams par = { };
+        par.requested_backend = GfxBackend::Null;
+        init_gfx(par);
+    }
+
+    if (run_tests) {
+        if (!load_game()) {
+            die("Failed to load the game library");
+        }
+        gi.test();
+        gi.disconnect();
+        dbgmsg("All tests passed");
+        hk::sys::shutdown_jobs();
+        hk::logging::shutdown();
+        return 0;
+    }
+
+    if (simulations) {
+        const bool ok = load_game() && run_simulations(simulations, simulation_ticks);
+        if (gi.disconnect) {
+            gi.disconnect();
+        }
+        hk::sys::shutdown_jobs();
+        hk::logging::shutdown();
+        return ok ? 0 : 1;
+    }
+
     SDL_version sdlv_c = { }; SDL_VERSION(&sdlv_c);
     SDL_version sdlv_l = { }; SDL_GetVersion(&sdlv_l);
     dbgmsg("SDL v%d.%d.%d (compiled against v%d.%d.%d)",
         sdlv_l.major, sdlv_l.minor, sdlv_l.patch,
         sdlv_c.major, sdlv_c.minor, sdlv_c.patch);
-    if (SDL_Init(SDL_INIT_EVERYTHING) < 0) {
-        die("Failed to initialize SDL: %s", SDL_GetError());
+    {
+        // Only what we use. Audio, joystick and haptic init cost tens of milliseconds on some systems
+        HK_PROFILE_ZONE("SDL_Init");
+        if (SDL_Init((a.state & APP_STATE_HEADLESS) ? 0 : SDL_INIT_VIDEO) < 0) {
+            die("Failed to initialize SDL: %s", SDL_GetError());
+        }
     }
 
-    if (!(a.wnd = SDL_CreateWindow("Moth06", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 640, 480, SDL_WINDOW_HIDDEN))) {
-        die("Failed to create game window: %s", SDL_GetError());
+    if (!(a.state & APP_STATE_HEADLESS)) {
+        HK_PROFILE_ZONE("Create window");
+        if (!(a.wnd = SDL_CreateWindow("Moth06", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 640, 480, SDL_WINDOW_HIDDEN))) {
+            die("Failed to create game window: %s", SDL_GetError());
+        }
     }
+    a.startup.window = hk::sys::get_clock_ticks();
 
-    GfxInitParams par = { };
-    par.requested_backend = GfxBackend::Default;
-    init_gfx(par);
+    {
+        HK_PROFILE_ZONE("init_gfx");
+        GfxInitParams par = { };
+        par.requested_backend = software ? GfxBackend::Software : (a.state & APP_STATE_HEADLESS) ? GfxBackend::Null : GfxBackend::Default;
+        par.frames_in_flight = frames_in_flight;
+        init_gfx(par);
+    }
+    if (capture_path) {
+        CaptureParams par = { };
+        par.path = capture_path;
+        const usize len = std::strlen(capture_path);
+        par.format = (len >= 4 && hk::str::equal(capture_path + len - 4, ".y4m")) ? CaptureFormat::Y4m : CaptureFormat::Rgba;
+        // Frames run as fast as they can, so each one is a frame of the video however long it takes
+        par.wait_for_buffer = (a.state & APP_STATE_UNCAPPED) != 0;
+        if (software) {
+            par.width = SOFT_WIDTH;
+            par.height = SOFT_HEIGHT;
+        } else if (a.wnd) {
+            int w = 0, h = 0;
+            SDL_GetWindowSizeInPixels(a.wnd, &w, &h);
+            par.width = (u32)w;
+            par.height = (u32)h;
+        }
+        if (!par.width) {
+            dbgmsg("Nothing to capture without a window, see --software");
+        } else if (!start_capture(par)) {
+            die("Failed to start capturing to %s", capture_path);
+        }
+    }
 
-    gi.size = sizeof(gi);
+    {
+        HK_PROFILE_ZONE("load_game");
+        if (!load_game()) {
+            die("Failed to load the game library");
+        }
+        a.game = create_game_context();
+    }
+    a.startup.game_connected = hk::sys::get_clock_ticks();
+    if (!(a.game_watch = hk::sys::watch_file(game_dll_src))) {
+        dbgmsg("Can't watch %s, game code won't reload when rebuilt", game_dll_src);
+    }
 
-    ei.size = sizeof(ei);
-    ei.dbg_log = e_dbg_log;
-    ei.load_asset = e_load_asset;
+    if (a.wnd) {
+        SDL_ShowWindow(a.wnd);
+    }
+    a.sim.last_ns = hk::sys::get_time_ns();
+    do {
+        HK_PROFILE_ZONE("Frame");
+        begin_frame_stats();
 
-    load_game();
+        if ((a.game_watch && hk::sys::poll_file_watch(a.game_watch)) || (a.state & APP_STATE_WANTS_RELOAD)) {
+            reload_game();
+            a.state &= ~APP_STATE_WANTS_RELOAD;
+        }
 
-    SDL_ShowWindow(a.wnd);
-    do {
-        SDL_Event evt = { };
-        while (SDL_PollEvent(&evt)) {
-            switch (evt.type) {
-            case SDL_QUIT: {
-                a.state |= APP_STATE_WANTS_QUIT;
-            } break;
-            case SDL_KEYDOWN: {
-                switch ( evt.key.keysym.sym ) {
-                case SDLK_F3: {
-                    a.state ^= APP_STATE_DEBUG_UI;
+        wait_for_render();
+        if (!(a.state & APP_STATE_HEADLESS)) {
+            HK_PROFILE_ZONE("Poll events");
+            SDL_Event evt = { };
+            while (SDL_PollEvent(&evt)) {
+                switch (evt.type) {
+                case SDL_QUIT: {
+                    a.state |= APP_STATE_WANTS_QUIT;
+                } break;
+                case SDL_KEYDOWN: {
+                    switch ( evt.key.keysym.sym ) {
+                    case SDLK_F3: {
+                        a.state ^= APP_STATE_DEBUG_UI;
+                    } break;
+                    case SDLK_F4: {
+                        a.state |= APP_STATE_WANTS_TRACE;
+                    } break;
+                    case SDLK_F5: {
+                        a.state |= APP_STATE_WANTS_ALLOC_DUMP;
+                    } break;
+                    case SDLK_F6: {
+                        a.state |= APP_STATE_WANTS_RELOAD;
+                    } break;
+                    }
                 } break;
                 }
-            } break;
+                handle_ui_event(&evt);
             }
-            handle_ui_event(&evt);
         }
 
+        step_game();
+
         begin_frame();
+        {
+            HK_PROFILE_ZONE("Game draw");
+            gi.draw(a.game, a.sim.alpha);
+        }
         // Debug UI
         if ( a.state & APP_STATE_DEBUG_UI ) {
+            HK_PROFILE_ZONE("Debug UI");
             draw_debug_menu();
         }
         end_frame();
+
+        if (a.frame_count == 1) {
+            a.startup.first_frame = hk::sys::get_clock_ticks();
+            report_startup();
+            if (profile_startup) {
+                write_trace("moth06_startup.json", a.startup.main);
+                a.state |= APP_STATE_WANTS_QUIT;
+            }
+        }
+        if (a.state & APP_STATE_WANTS_TRACE) {
+            dump_trace(a.trace_path, a.trace_frames);
+            a.state &= ~APP_STATE_WANTS_TRACE;
+        }
+        if (a.state & APP_STATE_WANTS_ALLOC_DUMP) {
+#ifdef HK_ALLOC_PROFILE
+            dump_alloc_sites("moth06_allocs.txt");
+#else
+            dbgmsg("Allocation sites aren't recorded, configure with MOTH06_ALLOC_PROFILE");
+#endif
+            a.state &= ~APP_STATE_WANTS_ALLOC_DUMP;
+        }
+        if (max_frames && a.frame_count >= max_frames) {
+            a.state |= APP_STATE_WANTS_QUIT;
+        }
     } while (!(a.state & APP_STATE_WANTS_QUIT));
 
+    {
+        const f64 ms = (f64)(hk::sys::clock_ticks_to_ns(hk::sys::get_clock_ticks()) - hk::sys::clock_ticks_to_ns(a.startup.game_connected)) / 1e6;
+        dbgmsg("Ran %llu frames and %llu ticks (%llu dropped) in %.2f ms (%.0f frames/s)", (unsigned long long)a.frame_count,
+            (unsigned long long)a.sim.ticks, (unsigned long long)a.sim.dropped_ticks, ms, (f64)a.frame_count / hk::max(ms / 1000.0, 1e-9));
+    }
+
+    if (trace_on_exit) {
+        dump_trace(a.trace_path, a.trace_frames);
+    }
+
     // NOTE(HK): Normally I just let the OS clean everything up, but some Linux WMs don't restore the display
     // resolution when a fullscreen window dies with a non-native resolution
-    SDL_DestroyWindow(a.wnd);
+    gi.disconnect();
+    shutdown_gfx();
+    // After the render thread, the last thread to capture
+    stop_capture();
+    if (a.wnd) {
+        SDL_DestroyWindow(a.wnd);
+    }
+
+    hk::sys::shutdown_jobs();
+    hk::logging::shutdown();
 
     return 0;
 }
@@ -18,19 +18,15 @@ static inline void die(const char* fmt, ...) {
     va_end(va);
 
     // XXX
+    hk::logging::flush();
     std::fprintf(stderr, "%s\n", buf);
     HK_ASSERT(0);
 }
 
-static inline void dbgmsg_(const char* fmt, ...) {
-    char buf[1024];
-    std::va_list va; va_start(va, fmt);
-    std::vsnprintf(buf, sizeof(buf), fmt, va);
-    va_end(va);
-
-    // XXX
-    std::fprintf(stderr, "+%.3f | %s\n", (f32)SDL_GetTicks() / 1e3f, buf);
-    std::fflush(stderr);
+// Queued on the async logger, see hk::logging
+template <typename... Args>
+static inline void dbgmsg_(const char* fmt, Args... args) {
+    hk::logging::write(fmt, args...);
 }
 
 //
@@ -40,13 +36,66 @@ static inline void dbgmsg_(const char* fmt, ...) {
 enum {
     APP_STATE_WANTS_QUIT = 1 << 0,
     APP_STATE_DEBUG_UI = 1 << 1,
+    APP_STATE_WANTS_TRACE = 1 << 2,
+    APP_STATE_PERF_PANEL = 1 << 3,
+    APP_STATE_WANTS_ALLOC_DUMP = 1 << 4,
+    APP_STATE_WANTS_RELOAD = 1 << 5,
+    // No window, input or UI, see --headless
+    APP_STATE_HEADLESS = 1 << 6,
+    // One simulation tick per frame however long frames take, see --uncapped
+    APP_STATE_UNCAPPED = 1 << 7,
 };
 
+// Game state block of each GameContext, see GameStateHeader. Pages are only touched once used
+constexpr usize GAME_STATE_CAPACITY = 64 * 1024 * 1024;
+
+// The game simulates at a fixed rate, rendering runs at whatever rate the display allows
+constexpr u64 SIM_HZ = 60;
+// Ticks run before a frame is drawn at most. A slower machine runs the game slower instead of
+// spending every frame catching up
+constexpr u32 MAX_SIM_TICKS_PER_FRAME = 4;
+
+// Frames kept for trace dumps and the performance panel
+constexpr usize MAX_FRAME_HISTORY = 1024;
+
 struct App {
     usize argc; const char** argv;
     void* game_lib;
+    u32 game_loads;
+    hk::sys::FileWatch* game_watch;
+    GameContext* game;
+    // Fixed timestep scheduler
+    struct {
+        u64 last_ns;
+        // Unsimulated time, in nanoseconds times SIM_HZ so ticks add up to exactly one second
+        u64 accumulator;
+        u64 ticks;
+        u32 frame_ticks;
+        u64 dropped_ticks;
+        // Time since the last tick, in ticks. Drawing is this far from the second to last tick's
+        // state to the last's, so it trails the simulation by under a tick but moves smoothly
+        f32 alpha;
+    } sim;
     SDL_Window* wnd;
     u8 state;
+    // Profiling, sampled at the start of each frame
+    const char* trace_path;
+    usize trace_frames;
+    u64 frame_count;
+    u64 frame_begin[MAX_FRAME_HISTORY];
+    u64 frame_allocs[MAX_FRAME_HISTORY];
+    u64 frame_alloc_bytes[MAX_FRAME_HISTORY];
+    // Startup milestones, in clock ticks
+    struct {
+        u64 main;
+        u64 window;
+        u64 game_connected;
+        u64 first_frame;
+    } startup;
+    // Asset cache statistics
+    u64 asset_hits;
+    u64 asset_misses;
+    u64 asset_resident_bytes;
 };
 
 extern App a;
@@ -60,18 +109,209 @@ void moth06_test();
 
 enum class GfxBackend {
     SDLRenderer,
+    // Draws on the CPU into an offscreen frame, for headless runs. No UI
+    Software,
+    // Draws nothing, for headless runs
+    Null,
 
     Default,
 };
 
+// Frames that can be waiting for or being drawn by the render thread
+constexpr u32 MAX_GFX_FRAMES_IN_FLIGHT = 3;
+
 struct GfxInitParams {
     GfxBackend requested_backend;
+    // How far ahead of the screen the main thread may get, 1 to MAX_GFX_FRAMES_IN_FLIGHT. Each
+    // frame is a frame of input latency, fewer make the main thread wait on vsync. 0 for 2
+    u32 frames_in_flight;
 };
 
+// Rendering happens on its own thread, which draws and presents the frames end_frame() hands it
 void init_gfx(const GfxInitParams& params);
+// Stop the render thread and free every texture, before the window goes
+void shutdown_gfx();
+// Block until there's room for another frame in flight. Called before reading input, so a full
+// queue holds the frame back instead of the input it's built from getting older
+void wait_for_render();
 void begin_frame();
 void end_frame();
 void handle_ui_event( const SDL_Event* evt );
 
+// Pixels are RGBA bytes, rows top to bottom. Returns 0 if there's no room for another
+GfxTexture create_texture(u32 width, u32 height, const u8* pixels);
+void destroy_texture(GfxTexture texture);
+
+// Queue sprites to draw in end_frame(), under the UI. Any job thread, see EngineInterface::gfx
+void draw_sprites(const GfxSprite* sprites, usize count, u32 order);
+
+// Sprites queued by one thread, expanded into quads as they come in so the vertex work is
+// spread over whichever threads draw. Sprite i has keys[i] and vertices [4 * i, 4 * i + 4)
+struct alignas(HK_CACHE_LINE) GfxCommandBuffer {
+    // Layer, blend mode and texture in bits 32-47, the queue order below them
+    hk::Array<u64> keys;
+    hk::Array<SDL_Vertex> vertices;
+};
+
+void push_sprites(GfxCommandBuffer& buffer, const GfxSprite* sprites, usize count, u32 order);
+
+// Sprites sharing a texture and blend mode, drawn with one SDL_RenderGeometry call. Vertices
+// are [first_vertex, first_vertex + 4 * sprites), and every batch uses the start of the
+// shared index list: indices count from the batch's first vertex
+struct GfxBatch {
+    GfxTexture texture;
+    GfxBlend blend;
+    u32 first_vertex;
+    u32 sprites;
+};
+
+struct GfxSpriteBatches {
+    hk::Array<SDL_Vertex> vertices;
+    hk::Array<int> indices;
+    hk::Array<GfxBatch> batches;
+    // Merge scratch: every sprite's key and quad, and the sort order
+    hk::Array<u64> keys;
+    hk::Array<const SDL_Vertex*> quads;
+    hk::Array<u32> order[2];
+};
+
+// Radix sort the sprites of every buffer together into batches and gather their vertices, over
+// the job threads. Equal keys keep the order of the buffers, then of the sprites in each.
+// Empties the buffers. Indices are only ever added to
+void merge_sprite_batches(GfxCommandBuffer* buffers, u32 count, GfxSpriteBatches& out);
+
+//
+// Software rasteriser, see moth06_gfx_soft.cc
+// The frame is cut into tiles, and every quad is binned into the tiles its bounds touch, in
+// drawing order. Tiles are then drawn independently over the job threads, a row of a quad at a
+// time: texels are sampled and tinted into a row of source pixels, which is blended into the
+// frame with SIMD. Coverage goes into the source alpha, so both blend modes skip uncovered pixels
+//
+
+constexpr u32 SOFT_WIDTH = 640;
+constexpr u32 SOFT_HEIGHT = 480;
+constexpr u32 SOFT_TILE_SIZE = 32;
+constexpr u32 SOFT_TILES_X = SOFT_WIDTH / SOFT_TILE_SIZE;
+constexpr u32 SOFT_TILES_Y = SOFT_HEIGHT / SOFT_TILE_SIZE;
+static_assert(SOFT_WIDTH % SOFT_TILE_SIZE == 0 && SOFT_HEIGHT % SOFT_TILE_SIZE == 0);
+
+// Pixels are RGBA bytes, rows top to bottom, like create_texture()
+struct SoftTexture {
+    u32 width;
+    u32 height;
+    u32* pixels;
+};
+
+// A sprite's quad ready to draw. Sprites are parallelograms, so a pixel's position along the
+// top and left edges, (s, t), is affine in x and y: it's inside while both are in [0, 1)
+struct SoftQuad {
+    // s and t at the centre of pixel (0, 0), and their steps in x and y
+    f32 s0, t0;
+    f32 ds_dx, dt_dx, ds_dy, dt_dy;
+    // Texture coordinates at s, t = 0 and along s and t
+    f32 u0, v0, du_ds, dv_ds, du_dt, dv_dt;
+    // Pixel bounds, inclusive, clamped to the frame
+    u16 x0, y0, x1, y1;
+    u32 color;
+    GfxTexture texture;
+    GfxBlend blend;
+};
+
+struct SoftRasterizer {
+    // SOFT_WIDTH * SOFT_HEIGHT pixels, RGBA bytes
+    hk::Array<u32> frame;
+    hk::Array<SoftQuad> quads;
+    // Quads binned into tile `i` are tile_quads[tile_offsets[i], tile_offsets[i + 1])
+    hk::Array<u32> tile_quads;
+    u32 tile_offsets[SOFT_TILES_X * SOFT_TILES_Y + 1];
+    // Textures by handle, 0 unused. Set while drawing
+    const SoftTexture* textures;
+    u32 clear_color;
+};
+
+// Clear the frame and draw the batches into it, over the job threads
+void soft_draw(SoftRasterizer& r, GfxSpriteBatches& batches, const SoftTexture* textures);
+
+// Blend a row of source pixels into the frame, as SDL's blend modes do. Uses SSE2 where there is
+// one, the scalar version gives the same result and is there to check it against
+void soft_blend_row(u32* dst, const u32* src, u32 count, GfxBlend blend);
+void soft_blend_row_scalar(u32* dst, const u32* src, u32 count, GfxBlend blend);
+
+// The frame the software backend drew last, SOFT_WIDTH x SOFT_HEIGHT. Null for other backends
+const u32* get_software_frame();
+
+//
+// Frame capture, see moth06_capture.cc
+// Frames are copied into a fixed pool of buffers and handed to a writer thread, which converts
+// and writes them while the next ones are drawn. When the writer falls behind and no buffer is
+// free the frame is dropped and counted, so a real-time run never waits on the disk. Runs that
+// aren't real time wait for a buffer instead, and keep every frame
+//
+
+enum class CaptureFormat {
+    // Frames of RGBA bytes back to back
+    Rgba,
+    // YUV 4:2:0 in a YUV4MPEG2 stream, which most video tools read
+    Y4m,
+};
+
+// Buffers in the pool, each holds one frame
+constexpr u32 MAX_CAPTURE_BUFFERS = 16;
+
+struct CaptureParams {
+    const char* path;
+    CaptureFormat format;
+    // Y4m needs both even
+    u32 width;
+    u32 height;
+    u32 fps;
+    // 0 for MAX_CAPTURE_BUFFERS
+    u32 buffers;
+    // Wait for a free buffer instead of dropping the frame, when the frame rate isn't real time
+    bool wait_for_buffer;
+};
+
+struct CaptureStats {
+    u64 frames_captured;
+    u64 frames_dropped;
+    u64 frames_written;
+    u64 bytes_written;
+};
+
+// False if the file can't be opened or the size doesn't suit the format
+bool start_capture(const CaptureParams& params);
+// Write out the queued frames and close the file
+void stop_capture();
+bool is_capturing();
+// What start_capture() was given, with defaults filled in
+const CaptureParams& get_capture_params();
+
+// A free buffer to draw a width x height RGBA frame into, then hand over with
+// submit_capture_frame(). Null if none is free, which counts as a dropped frame, unless
+// CaptureParams::wait_for_buffer is set. One thread captures at a time
+u32* acquire_capture_frame();
+void submit_capture_frame(u32* pixels);
+// Copy a frame in. False if it was dropped
+bool capture_frame(const u32* pixels);
+
+CaptureStats get_capture_stats();
+
+// Convert RGBA to the planes of a 4:2:0 frame: luma, then quarter-size U and V. BT.601 studio
+// range, chroma averaged over each 2x2 block
+void rgba_to_yuv420(const u32* pixels, u32 width, u32 height, u8* y, u8* u, u8* v);
+
+// Counters for the last frame drawn
+struct GfxStats {
+    u32 sprites;
+    u32 batches;
+    u32 vertices;
+    // Including the frame just ended
+    u32 frames_in_flight;
+    // Main thread time spent in wait_for_render()
+    u64 wait_ns;
+};
+
+const GfxStats& get_gfx_stats();
+
 
 #endif // _MOTH06_HH_
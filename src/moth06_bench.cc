@@ -0,0 +1,427 @@
+#include "hk_bench.hh"
+#include "game_private.hh"
+
+#include <vector>
+
+//
+// Benchmarks
+//
+
+static void bench_vector_push_back( hk::bench::State& state, void* ) {
+    for ( hk::u64 it = 0; it < state.iterations; ++it ) {
+        std::vector<hk::i32> vec = std::vector<hk::i32>();
+        for ( hk::i32 j = 1; j <= 1000; ++j ) {
+            vec.push_back( (hk::i32)it % j );
+        }
+        hk::bench::do_not_optimize( vec.data() );
+    }
+}
+
+static void bench_array_append( hk::bench::State& state, void* ) {
+    for ( hk::u64 it = 0; it < state.iterations; ++it ) {
+        hk::Array<hk::i32> arr = hk::Array<hk::i32>();
+        for ( hk::i32 j = 1; j <= 1000; ++j ) {
+            arr.append( (hk::i32)it % j );
+        }
+        hk::bench::do_not_optimize( arr.buffer() );
+    }
+}
+
+struct Message {
+    hk::u64 producer;
+    hk::u64 seq;
+};
+
+static hk::SpscRing<Message, 4096> spsc_ring;
+static hk::SpscRing<Message, 4096> spsc_echo;
+
+struct Producer {
+    hk::u64 idx;
+    hk::u64 count;
+    hk::MpscQueue<Message>* mpsc;
+};
+
+static void produce( void* user ) {
+    const Producer& p = *(const Producer*)user;
+    Message batch[16];
+    for ( hk::u64 seq = 0; seq < p.count; ) {
+        const hk::usize n = (hk::usize)hk::min<hk::u64>( hk::arrlen( batch ), p.count - seq );
+        for ( hk::usize i = 0; i < n; ++i ) {
+            batch[i] = { p.idx, seq + i };
+        }
+        hk::usize pushed = 0;
+        while ( pushed < n ) {
+            const hk::usize k = p.mpsc ? p.mpsc->push_n( batch + pushed, n - pushed ) : spsc_ring.push_n( batch + pushed, n - pushed );
+            if ( !k ) {
+                hk::sys::yield_thread();
+            }
+            pushed += k;
+        }
+        seq += n;
+    }
+}
+
+// One message per iteration, from one producer thread
+static void bench_spsc_throughput( hk::bench::State& state, void* ) {
+    Producer producer = { 0, state.iterations, nullptr };
+    hk::sys::Thread* thread = hk::sys::create_thread( produce, &producer );
+    Message batch[64];
+    for ( hk::u64 received = 0; received < state.iterations; ) {
+        const hk::usize n = spsc_ring.pop_n( batch, hk::arrlen( batch ) );
+        if ( !n ) {
+            hk::sys::yield_thread();
+        }
+        received += n;
+    }
+    hk::sys::join_thread( thread );
+}
+
+// One message per iteration, split between three producer threads
+static void bench_mpsc_throughput( hk::bench::State& state, void* user ) {
+    constexpr hk::u64 NUM_PRODUCERS = 3;
+    hk::MpscQueue<Message>* queue = (hk::MpscQueue<Message>*)user;
+    Producer producers[NUM_PRODUCERS] = { };
+    hk::sys::Thread* threads[NUM_PRODUCERS] = { };
+    for ( hk::u64 i = 0; i < NUM_PRODUCERS; ++i ) {
+        producers[i] = { i, state.iterations / NUM_PRODUCERS + ( i < state.iterations % NUM_PRODUCERS ), queue };
+        threads[i] = hk::sys::create_thread( produce, &producers[i] );
+    }
+    Message batch[64];
+    for ( hk::u64 received = 0; received < state.iterations; ) {
+        const hk::usize n = queue->pop_n( batch, hk::arrlen( batch ) );
+        if ( !n ) {
+            hk::sys::yield_thread();
+        }
+        received += n;
+    }
+    for ( hk::u64 i = 0; i < NUM_PRODUCERS; ++i ) {
+        hk::sys::join_thread( threads[i] );
+    }
+}
+
+// Spinning without yielding crawls when both threads share a core
+static void spin() {
+    static const bool single_core = hk::sys::get_cpu_count() == 1;
+    if ( single_core ) {
+        hk::sys::yield_thread();
+    }
+}
+
+static void echo( void* user ) {
+    const hk::u64 count = *(const hk::u64*)user;
+    Message msg;
+    for ( hk::u64 i = 0; i < count; ++i ) {
+        while ( !spsc_ring.pop( msg ) ) {
+            spin();
+        }
+        while ( !spsc_echo.push( msg ) ) {
+            spin();
+        }
+    }
+}
+
+// Latency: one message there and back per iteration
+static void bench_spsc_round_trip( hk::bench::State& state, void* ) {
+    hk::u64 count = state.iterations;
+    hk::sys::Thread* thread = hk::sys::create_thread( echo, &count );
+    Message msg = { };
+    for ( hk::u64 i = 0; i < state.iterations; ++i ) {
+        msg.seq = i;
+        while ( !spsc_ring.push( msg ) ) {
+            spin();
+        }
+        while ( !spsc_echo.pop( msg ) ) {
+            spin();
+        }
+    }
+    hk::sys::join_thread( thread );
+}
+
+static void bench_log_write( hk::bench::State& state, void* ) {
+    // Flush between batches, outside the clock, so the writer thread never falls behind
+    constexpr hk::u64 BATCH = 256;
+    for ( hk::u64 it = 0; it < state.iterations; ++it ) {
+        hk::logging::write( "Benchmark message %u of %u (%.2f%%)", (hk::u32)it, (hk::u32)state.iterations, (hk::f64)it / (hk::f64)state.iterations * 100.0 );
+        if ( ( it + 1 ) % BATCH == 0 ) {
+            state.pause();
+            hk::logging::flush();
+            state.resume();
+        }
+    }
+    state.pause();
+    hk::logging::flush();
+    state.resume();
+}
+
+static void bench_log_format( hk::bench::State& state, void* ) {
+    const hk::logging::Record r = hk::logging::encode( "Loaded %s (%u bytes, %.2f ms)", "th06e_ST.DAT", 123456u, 1.5 );
+    char buf[hk::logging::RECORD_SIZE];
+    for ( hk::u64 it = 0; it < state.iterations; ++it ) {
+        hk::bench::do_not_optimize( hk::logging::format( r, buf, sizeof( buf ) ) );
+        hk::bench::clobber_memory();
+    }
+}
+
+static void bench_parallel_for( hk::bench::State& state, void* ) {
+    static std::atomic<hk::u64> sum = 0;
+    for ( hk::u64 it = 0; it < state.iterations; ++it ) {
+        hk::sys::parallel_for( 1024, 64, []( void*, hk::usize begin, hk::usize end ) {
+            sum.fetch_add( end - begin, std::memory_order_relaxed );
+        }, nullptr );
+    }
+}
+
+// Two looping scripts in the style of bullets and effects, see game_anm.cc
+static AnmFile* make_bench_anm() {
+    static AnmOp ops[16];
+    static hk::u32 sprite_ids[] = { 0, 1 };
+    static hk::f32 sprite_rect[] = { 0.0f, 16.0f };
+    static hk::u32 script_ids[] = { 0, 1 };
+    static hk::u32 script_begin[2];
+    static hk::u32 interrupt_begin[3] = { };
+    static AnmFile anm = { };
+    hk::u32 n = 0;
+    const auto op = [&]( hk::u16 time, AnmOpcode opcode ) -> AnmOp& {
+        ops[n] = { };
+        ops[n].time = time;
+        ops[n].opcode = opcode;
+        return ops[n++];
+    };
+
+    script_begin[0] = n;
+    op( 0, AnmOpcode::SetSprite ).i[0] = 0;
+    op( 0, AnmOpcode::SetBlendModeAdd );
+    AnmOp& fade = op( 0, AnmOpcode::Fade );
+    fade.i[0] = 128; fade.i[1] = 30;
+    op( 0, AnmOpcode::Set3DRotationsSpeed ).f[2] = 0.1f;
+    AnmOp& move = op( 0, AnmOpcode::MoveToDecel );
+    move.f[0] = 320.0f; move.f[1] = 240.0f; move.i[3] = 60;
+    AnmOp& color = op( 60, AnmOpcode::SetColor );
+    color.u[0] = 255; color.u[1] = 128; color.u[2] = 64;
+    AnmOp& scale = op( 60, AnmOpcode::ScaleIn );
+    scale.f[0] = 2.0f; scale.f[1] = 2.0f; scale.i[2] = 30;
+    op( 90, AnmOpcode::Jump ).u[0] = script_begin[0];
+    op( 90, AnmOpcode::Delete );
+
+    script_begin[1] = n;
+    op( 0, AnmOpcode::SetSprite ).i[0] = 1;
+    AnmOp& grow = op( 0, AnmOpcode::SetScaleSpeed );
+    grow.f[0] = 0.01f; grow.f[1] = 0.01f;
+    AnmOp& fall = op( 10, AnmOpcode::MoveToLinear );
+    fall.f[1] = 480.0f; fall.i[3] = 30;
+    op( 20, AnmOpcode::ShiftTextureX ).f[0] = 0.5f;
+    op( 40, AnmOpcode::Jump ).u[0] = script_begin[1];
+    op( 40, AnmOpcode::Delete );
+
+    // What anm_load() precomputes
+    for ( hk::u32 j = 0; j + 1 < n; ++j ) {
+        if ( ops[j].opcode != AnmOpcode::Delete && ops[j + 1].time > ops[j].time ) {
+            ops[j].delay = ops[j + 1].time - ops[j].time;
+        }
+    }
+
+    anm.num_sprites = hk::arrlen( sprite_ids );
+    anm.num_scripts = hk::arrlen( script_ids );
+    anm.num_ops = n;
+    anm.sprite_ids = sprite_ids;
+    anm.sprite_x = anm.sprite_y = anm.sprite_w = anm.sprite_h = sprite_rect;
+    anm.script_ids = script_ids;
+    anm.script_begin = script_begin;
+    anm.ops = ops;
+    anm.interrupt_begin = interrupt_begin;
+    return &anm;
+}
+
+// One step of `elements` instances per iteration, spread over both scripts and every frame of them
+static void bench_anm_vm_step( hk::bench::State& state, void* user ) {
+    static AnmVm* vm = hk::mem::alloc<AnmVm>();
+    const hk::u32 count = (hk::u32)(hk::usize)user;
+    state.pause();
+    AnmFileSet files = {};
+    anm_file_set_add( files, make_bench_anm() );
+    anm_vm_init( *vm, 1 );
+    for ( hk::u32 i = 0; i < count; ++i ) {
+        anm_vm_spawn( *vm, files, 0, i % 2, (hk::f32)( i % 640 ), 0.0f );
+        if ( i % 100 == 99 ) {
+            anm_vm_step( *vm, files );
+        }
+    }
+    anm_vm_step( *vm, files );
+    state.resume();
+    for ( hk::u64 it = 0; it < state.iterations; ++it ) {
+        anm_vm_step( *vm, files );
+    }
+    hk::bench::do_not_optimize( vm->x[0] );
+}
+
+// The integration pass alone, with every interpolation running
+static void bench_anm_vm_integrate( hk::bench::State& state, void* user ) {
+    static AnmVm* vm = hk::mem::alloc<AnmVm>();
+    const AnmSimd simd = *(const AnmSimd*)user;
+    state.pause();
+    AnmFileSet files = {};
+    anm_file_set_add( files, make_bench_anm() );
+    anm_vm_init( *vm, 1 );
+    for ( hk::u32 i = 0; i < 10000; ++i ) {
+        anm_vm_spawn( *vm, files, 0, i % 2, (hk::f32)( i % 640 ), 0.0f );
+    }
+    anm_vm_step( *vm, files );
+    for ( hk::u32 i = 0; i < vm->count; ++i ) {
+        vm->fade_duration[i] = vm->move_duration[i] = vm->scale_duration[i] = 1 << 30;
+        vm->move_ease[i] = (AnmEase)( i % 3 );
+    }
+    state.resume();
+    for ( hk::u64 it = 0; it < state.iterations; ++it ) {
+        anm_vm_integrate( *vm, simd );
+    }
+    hk::bench::do_not_optimize( vm->x[0] );
+}
+
+// Packing a stage's worth of sprites, `elements` of them in assorted sizes
+static void bench_anm_atlas_build( hk::bench::State& state, void* user ) {
+    const hk::u32 count = (hk::u32)(hk::usize)user;
+    hk::Array<hk::f32> rects = hk::Array<hk::f32>( count * 4 );
+    hk::Array<hk::u8> pages = hk::Array<hk::u8>( count );
+    AnmFile anm = { };
+    anm.num_sprites = count;
+    anm.sprite_page = pages.buffer();
+    AnmFile* files[] = { &anm };
+    AnmAtlas atlas = AnmAtlas();
+    const char* error = nullptr;
+    for ( hk::u64 it = 0; it < state.iterations; ++it ) {
+        state.pause();
+        hk::u32 rng = 1;
+        for ( hk::u32 i = 0; i < count; ++i ) {
+            rng = rng * 1664525 + 1013904223;
+            rects[i] = rects[count + i] = (hk::f32)i;
+            rects[count * 2 + i] = (hk::f32)( 1 + ( rng >> 8 ) % 128 );
+            rects[count * 3 + i] = (hk::f32)( 1 + ( rng >> 20 ) % 96 );
+        }
+        anm.sprite_x = &rects[0];
+        anm.sprite_y = &rects[count];
+        anm.sprite_w = &rects[count * 2];
+        anm.sprite_h = &rects[count * 3];
+        state.resume();
+        anm_atlas_build( atlas, files, 1, &error );
+    }
+    hk::bench::do_not_optimize( atlas.num_pages );
+}
+
+//
+// Driver
+//
+
+static void usage() {
+    std::fprintf( stderr,
+        "usage: moth06_bench [options]\n"
+        "  --filter <text>     Only run benchmarks whose name contains <text>\n"
+        "  --samples <n>       Samples per benchmark\n"
+        "  --json <path>       Write results to <path>\n"
+        "  --baseline <path>   Compare against results written with --json\n"
+        "  --threshold <pct>   Slowdown that counts as a regression (default 5)\n"
+        "  --list              List benchmarks and exit\n" );
+}
+
+int main( int argc, char** argv ) {
+    hk::prof::set_thread_name( "Main" );
+    hk::logging::init( stderr );
+    hk::sys::init_jobs();
+
+    hk::MpscQueue<Message> mpsc = hk::MpscQueue<Message>( 4096 );
+    const AnmSimd anm_scalar = AnmSimd::Scalar;
+    const AnmSimd anm_best = anm_simd_best();
+    const hk::bench::Benchmark benchmarks[] = {
+        { "std::vector push_back x1000",    bench_vector_push_back, nullptr, 1000 },
+        { "Array<T> append x1000",          bench_array_append,     nullptr, 1000 },
+        { "SpscRing<T, N> throughput",      bench_spsc_throughput,  nullptr, 1 },
+        { "MpscQueue<T> throughput",        bench_mpsc_throughput,  &mpsc,   1 },
+        { "SpscRing<T, N> round trip",      bench_spsc_round_trip,  nullptr, 1 },
+        { "logging::write",                 bench_log_write,        nullptr, 1 },
+        { "logging::format",                bench_log_format,       nullptr, 1 },
+        { "parallel_for 1024/64",           bench_parallel_for,     nullptr, 1024 },
+        { "AnmVm step x10000",              bench_anm_vm_step,      (void*)10000, 10000 },
+        { "AnmVm integrate scalar x10000",  bench_anm_vm_integrate, (void*)&anm_scalar, 10000 },
+        { "AnmVm integrate SIMD x10000",    bench_anm_vm_integrate, (void*)&anm_best, 10000 },
+        { "ANM atlas build x2000",          bench_anm_atlas_build,  (void*)2000, 2000 },
+    };
+
+    hk::bench::Options options = hk::bench::Options();
+    const char* filter = nullptr;
+    const char* json_path = nullptr;
+    const char* baseline_path = nullptr;
+    for ( int i = 1; i < argc; ++i ) {
+        const char* f = argv[i];
+        const bool has_value = i + 1 < argc;
+        if ( hk::str::equal( f, "--filter" ) && has_value ) {
+            filter = argv[++i];
+        } else if ( hk::str::equal( f, "--samples" ) && has_value ) {
+            options.samples = (hk::u32)std::strtoul( argv[++i], nullptr, 10 );
+        } else if ( hk::str::equal( f, "--json" ) && has_value ) {
+            json_path = argv[++i];
+        } else if ( hk::str::equal( f, "--baseline" ) && has_value ) {
+            baseline_path = argv[++i];
+        } else if ( hk::str::equal( f, "--threshold" ) && has_value ) {
+            options.regression_threshold = std::strtod( argv[++i], nullptr ) / 100.0;
+        } else if ( hk::str::equal( f, "--list" ) ) {
+            for ( const hk::bench::Benchmark& b : benchmarks ) {
+                std::printf( "%s\n", b.name );
+            }
+            return 0;
+        } else {
+            usage();
+            return 2;
+        }
+    }
+
+    // Keep benchmark messages off the console
+    std::FILE* sink = std::tmpfile();
+    hk::logging::set_output( sink ? sink : stderr );
+
+    hk::bench::Result results[hk::arrlen( benchmarks )];
+    hk::usize num_results = 0;
+    hk::bench::print_header( stdout );
+    for ( const hk::bench::Benchmark& b : benchmarks ) {
+        if ( filter && !std::strstr( b.name, filter ) ) {
+            continue;
+        }
+        results[num_results] = hk::bench::run( b, options );
+        hk::bench::print_result( stdout, results[num_results] );
+        std::fflush( stdout );
+        ++num_results;
+    }
+
+    hk::logging::flush();
+    hk::logging::set_output( stderr );
+    if ( sink ) {
+        std::fclose( sink );
+    }
+
+    int status = 0;
+    if ( json_path ) {
+        std::FILE* f = std::fopen( json_path, "w" );
+        if ( !f ) {
+            std::fprintf( stderr, "Failed to open %s for writing\n", json_path );
+            return 1;
+        }
+        hk::bench::write_json( f, results, num_results );
+        std::fclose( f );
+    }
+    if ( baseline_path ) {
+        static hk::bench::BaselineEntry baseline[256];
+        const hk::isize num_baseline = hk::bench::read_baseline( baseline_path, baseline, hk::arrlen( baseline ) );
+        if ( num_baseline < 0 ) {
+            std::fprintf( stderr, "Failed to read baseline %s\n", baseline_path );
+            return 1;
+        }
+        std::printf( "\nAgainst %s:\n", baseline_path );
+        const hk::usize regressions = hk::bench::compare( stdout, results, num_results, baseline, (hk::usize)num_baseline, options.regression_threshold );
+        if ( regressions ) {
+            std::printf( "%zu regression(s) over %.1f%%\n", regressions, options.regression_threshold * 100.0 );
+            status = 1;
+        }
+    }
+
+    hk::sys::shutdown_jobs();
+    hk::logging::shutdown();
+    return status;
+}
@@ -0,0 +1,211 @@
+#include "moth06.hh"
+
+#define dbgmsg(...) dbgmsg_("CAPT | " __VA_ARGS__);
+
+static struct {
+    CaptureParams params;
+    std::FILE* file;
+    hk::sys::Thread* writer;
+    std::atomic<bool> active;
+    std::atomic<bool> quit;
+    // Bumped on every submit and on quit, what the writer waits on
+    std::atomic<u32> wake;
+    u32* buffers[MAX_CAPTURE_BUFFERS];
+    // Buffer indices: frames waiting to be written, and buffers free to draw into. Each buffer
+    // is in exactly one of them, or held by the capturing thread between acquire and submit
+    hk::SpscRing<u32, MAX_CAPTURE_BUFFERS> filled;
+    hk::SpscRing<u32, MAX_CAPTURE_BUFFERS> free;
+    u32 acquired;
+    // Converted frame, writer thread only
+    hk::Array<u8> staging;
+    bool write_failed;
+    std::atomic<u64> frames_captured;
+    std::atomic<u64> frames_dropped;
+    std::atomic<u64> frames_written;
+    std::atomic<u64> bytes_written;
+} capture = { };
+
+void rgba_to_yuv420(const u32* pixels, u32 width, u32 height, u8* y, u8* u, u8* v) {
+    for (u32 i = 0; i < width * height; ++i) {
+        const i32 r = pixels[i] & 0xFF, g = (pixels[i] >> 8) & 0xFF, b = (pixels[i] >> 16) & 0xFF;
+        y[i] = (u8)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+    }
+    for (u32 cy = 0; cy < height / 2; ++cy) {
+        for (u32 cx = 0; cx < width / 2; ++cx) {
+            const u32* p = pixels + cy * 2 * width + cx * 2;
+            const u32 block[4] = { p[0], p[1], p[width], p[width + 1] };
+            i32 r = 2, g = 2, b = 2;
+            for (u32 px : block) {
+                r += px & 0xFF;
+                g += (px >> 8) & 0xFF;
+                b += (px >> 16) & 0xFF;
+            }
+            r >>= 2; g >>= 2; b >>= 2;
+            u[cy * (width / 2) + cx] = (u8)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+            v[cy * (width / 2) + cx] = (u8)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+        }
+    }
+}
+
+static void write_frame(const u32* pixels) {
+    const CaptureParams& p = capture.params;
+    const usize num_pixels = (usize)p.width * p.height;
+    usize written = 0, expected = 0;
+    switch (p.format) {
+    case CaptureFormat::Rgba: {
+        expected = num_pixels * 4;
+        written = std::fwrite(pixels, 1, expected, capture.file);
+    } break;
+    case CaptureFormat::Y4m: {
+        u8* y = capture.staging.buffer();
+        rgba_to_yuv420(pixels, p.width, p.height, y, y + num_pixels, y + num_pixels + num_pixels / 4);
+        static const char frame_header[] = "FRAME\n";
+        expected = sizeof(frame_header) - 1 + capture.staging.length();
+        written = std::fwrite(frame_header, 1, sizeof(frame_header) - 1, capture.file);
+        written += std::fwrite(y, 1, capture.staging.length(), capture.file);
+    } break;
+    }
+    if (written != expected && !capture.write_failed) {
+        // Keeps draining so capturing never stalls, the rest of the frames are lost
+        dbgmsg("Failed to write to %s, later frames are lost", p.path);
+        capture.write_failed = true;
+    }
+    capture.bytes_written.fetch_add(written, std::memory_order_relaxed);
+}
+
+static void capture_writer(void*) {
+    for (;;) {
+        // Read before draining: a frame submitted after this changes `wake`, so the wait below
+        // returns at once. Once `quit` is set, every frame submitted before it is visible
+        const u32 wake = capture.wake.load(std::memory_order_acquire);
+        const bool quit = capture.quit.load(std::memory_order_acquire);
+        u32 index = 0;
+        while (capture.filled.pop(index)) {
+            HK_PROFILE_ZONE("Capture write");
+            write_frame(capture.buffers[index]);
+            capture.free.push(index);
+            // Wakes a capturing thread waiting for the buffer
+            capture.frames_written.fetch_add(1, std::memory_order_release);
+            capture.frames_written.notify_one();
+        }
+        if (quit) {
+            break;
+        }
+        capture.wake.wait(wake, std::memory_order_acquire);
+    }
+}
+
+bool start_capture(const CaptureParams& params) {
+    HK_ASSERT(!capture.active.load());
+    if (!params.width || !params.height || (params.format == CaptureFormat::Y4m && (params.width % 2 || params.height % 2))) {
+        dbgmsg("Can't capture %ux%u frames in that format", params.width, params.height);
+        return false;
+    }
+    if (!(capture.file = std::fopen(params.path, "wb"))) {
+        dbgmsg("Failed to open %s for capture", params.path);
+        return false;
+    }
+    capture.params = params;
+    capture.params.buffers = params.buffers ? hk::min(params.buffers, MAX_CAPTURE_BUFFERS) : MAX_CAPTURE_BUFFERS;
+    capture.params.fps = params.fps ? params.fps : (u32)SIM_HZ;
+    if (params.format == CaptureFormat::Y4m) {
+        std::fprintf(capture.file, "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C420jpeg\n", params.width, params.height, capture.params.fps);
+        capture.staging.resize((usize)params.width * params.height * 3 / 2);
+    }
+    for (u32 i = 0; i < capture.params.buffers; ++i) {
+        capture.buffers[i] = hk::mem::alloc<u32>((usize)params.width * params.height);
+        capture.free.push(i);
+    }
+    capture.write_failed = false;
+    capture.frames_captured = 0;
+    capture.frames_dropped = 0;
+    capture.frames_written = 0;
+    capture.bytes_written = 0;
+    capture.quit = false;
+    capture.wake = 0;
+    if (!(capture.writer = hk::sys::create_thread(capture_writer, nullptr))) {
+        die("Failed to start the capture writer");
+    }
+    capture.active.store(true, std::memory_order_release);
+    dbgmsg("Capturing %ux%u frames to %s", params.width, params.height, params.path);
+    return true;
+}
+
+void stop_capture() {
+    if (!capture.active.load()) {
+        return;
+    }
+    capture.active = false;
+    capture.quit.store(true, std::memory_order_release);
+    capture.wake.fetch_add(1, std::memory_order_release);
+    capture.wake.notify_one();
+    hk::sys::join_thread(capture.writer);
+    capture.writer = nullptr;
+    std::fclose(capture.file);
+    capture.file = nullptr;
+
+    u32 index = 0;
+    while (capture.free.pop(index)) { }
+    for (u32 i = 0; i < capture.params.buffers; ++i) {
+        hk::mem::free(capture.buffers[i]);
+        capture.buffers[i] = nullptr;
+    }
+    dbgmsg("Captured %llu frames to %s, %llu dropped, %.1f MiB", (unsigned long long)capture.frames_written.load(),
+        capture.params.path, (unsigned long long)capture.frames_dropped.load(), (f64)capture.bytes_written.load() / (1024.0 * 1024.0));
+}
+
+bool is_capturing() {
+    return capture.active.load(std::memory_order_acquire);
+}
+
+const CaptureParams& get_capture_params() {
+    return capture.params;
+}
+
+u32* acquire_capture_frame() {
+    for (;;) {
+        // Read before trying: a buffer freed after this changes it, so the wait returns at once
+        const u64 written = capture.frames_written.load(std::memory_order_acquire);
+        if (capture.free.pop(capture.acquired)) {
+            return capture.buffers[capture.acquired];
+        }
+        if (!capture.params.wait_for_buffer) {
+            break;
+        }
+        HK_PROFILE_ZONE("Wait for capture buffer");
+        capture.frames_written.wait(written, std::memory_order_acquire);
+    }
+    if (capture.frames_dropped.fetch_add(1, std::memory_order_relaxed) == 0) {
+        dbgmsg("Writing to %s fell behind, dropping frames", capture.params.path);
+    }
+    return nullptr;
+}
+
+void submit_capture_frame(u32* pixels) {
+    HK_ASSERT(pixels == capture.buffers[capture.acquired]);
+    (void)pixels;
+    // Can't fail, the ring has room for every buffer
+    capture.filled.push(capture.acquired);
+    capture.frames_captured.fetch_add(1, std::memory_order_relaxed);
+    capture.wake.fetch_add(1, std::memory_order_release);
+    capture.wake.notify_one();
+}
+
+bool capture_frame(const u32* pixels) {
+    u32* buffer = acquire_capture_frame();
+    if (!buffer) {
+        return false;
+    }
+    std::memcpy(buffer, pixels, (usize)capture.params.width * capture.params.height * sizeof(u32));
+    submit_capture_frame(buffer);
+    return true;
+}
+
+CaptureStats get_capture_stats() {
+    CaptureStats stats = { };
+    stats.frames_captured = capture.frames_captured.load(std::memory_order_relaxed);
+    stats.frames_dropped = capture.frames_dropped.load(std::memory_order_relaxed);
+    stats.frames_written = capture.frames_written.load(std::memory_order_relaxed);
+    stats.bytes_written = capture.bytes_written.load(std::memory_order_relaxed);
+    return stats;
+}
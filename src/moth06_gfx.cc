@@ -3,61 +3,587 @@
 #include <backends/imgui_impl_sdl2.h>
 #include <backends/imgui_impl_sdlrenderer2.h>
 
+#include <cmath>
+
 #define dbgmsg(...) dbgmsg_( "GFX  | " __VA_ARGS__ );
 
+// Job threads with a command buffer, see hk::sys::init_jobs()
+constexpr u32 MAX_GFX_THREADS = 32;
+
+// Texture uploads and deletes, applied by the render thread before it draws the frame they were
+// queued during
+struct GfxTextureOp {
+	GfxTexture texture;
+	u32 width;
+	u32 height;
+	// Copy of the pixels to upload, null to destroy the texture
+	u8* pixels;
+};
+
+// Everything the render thread needs to draw one frame. Filled by end_frame(), then left alone
+// by the main thread until the frame has been presented
+struct GfxFramePacket {
+	GfxSpriteBatches batches;
+	hk::Array<GfxTextureOp> texture_ops;
+	// The UI's draw lists. Their buffers are swapped with ImGui's instead of copied: ImGui
+	// rebuilds every list from scratch each frame, so it reuses an older packet's buffers
+	ImDrawData ui;
+	ImVector<ImDrawList*> ui_lists;
+};
+
 static struct {
 	GfxBackend backend;
+	// Render thread
 	union {
 		struct {
 			SDL_Renderer* r;
+			SDL_Texture* textures[MAX_GFX_TEXTURES];
 		} sdlr;
+		struct {
+			SoftTexture textures[MAX_GFX_TEXTURES];
+		} soft;
 	};
+	// Software backend, drawn on the job threads in end_frame()
+	SoftRasterizer rasterizer;
+	hk::sys::Thread* render_thread;
+	GfxFramePacket packets[MAX_GFX_FRAMES_IN_FLIGHT];
+	// Frames handed to the render thread, and frames it has presented. Frame f is drawn from
+	// packet f % MAX_GFX_FRAMES_IN_FLIGHT
+	alignas(HK_CACHE_LINE) std::atomic<u64> published;
+	alignas(HK_CACHE_LINE) std::atomic<u64> presented;
+	std::atomic<bool> ready;
+	std::atomic<bool> quit;
+	// Window events held back from the main thread for the render thread to send, see
+	// window_event_filter()
+	hk::sys::SpinLock window_events_lock;
+	hk::Array<SDL_Event> window_events;
+	hk::Array<SDL_Event> window_events_sending;
+	// Main thread
+	alignas(HK_CACHE_LINE) u32 frames_in_flight;
+	u64 wait_ns;
+	bool texture_used[MAX_GFX_TEXTURES];
+	hk::Array<GfxTextureOp> texture_ops;
+	// Drawn this frame, one buffer per job thread
+	GfxCommandBuffer command_buffers[MAX_GFX_THREADS];
+	GfxStats stats;
 } gfx = { };
 
+//
+// Render thread
+// Owns the renderer and everything created with it. The main thread only ever hands it packets,
+// except on macOS where the main thread is the only one allowed to render and draws them itself
+//
+
+static void apply_texture_ops_sdlr( hk::Array<GfxTextureOp>& ops ) {
+	for ( GfxTextureOp& op : ops ) {
+		SDL_Texture*& t = gfx.sdlr.textures[op.texture];
+		if ( t ) {
+			SDL_DestroyTexture( t );
+			t = nullptr;
+		}
+		if ( !op.pixels ) {
+			continue;
+		}
+		t = SDL_CreateTexture( gfx.sdlr.r, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STATIC, (int)op.width, (int)op.height );
+		if ( !t || SDL_UpdateTexture( t, nullptr, op.pixels, (int)op.width * 4 ) != 0 ) {
+			// Sprites using it are drawn untextured
+			dbgmsg( "Failed to create a %ux%u texture: %s", op.width, op.height, SDL_GetError() );
+			if ( t ) {
+				SDL_DestroyTexture( t );
+				t = nullptr;
+			}
+		}
+		hk::mem::free( op.pixels );
+	}
+	ops.resize( 0 );
+}
+
+static void draw_batches_sdlr( GfxSpriteBatches& b ) {
+	HK_PROFILE_ZONE( "Draw sprites" );
+	for ( const GfxBatch& batch : b.batches ) {
+		const SDL_BlendMode mode = batch.blend == GfxBlend::Add ? SDL_BLENDMODE_ADD : SDL_BLENDMODE_BLEND;
+		SDL_Texture* texture = gfx.sdlr.textures[batch.texture];
+		// Untextured geometry blends with the draw blend mode
+		if ( texture ) {
+			SDL_SetTextureBlendMode( texture, mode );
+		} else {
+			SDL_SetRenderDrawBlendMode( gfx.sdlr.r, mode );
+		}
+		SDL_RenderGeometry( gfx.sdlr.r, texture, b.vertices.buffer() + batch.first_vertex, (int)batch.sprites * 4,
+			b.indices.buffer(), (int)batch.sprites * 6 );
+	}
+}
+
+// Read the frame back into a capture buffer, when it's the size being captured
+static void capture_frame_sdlr() {
+	if ( !is_capturing() ) {
+		return;
+	}
+	HK_PROFILE_ZONE( "Capture frame" );
+	const CaptureParams& params = get_capture_params();
+	int w = 0, h = 0;
+	SDL_GetRendererOutputSize( gfx.sdlr.r, &w, &h );
+	if ( (u32)w != params.width || (u32)h != params.height ) {
+		return;
+	}
+	if ( u32* pixels = acquire_capture_frame() ) {
+		SDL_RenderReadPixels( gfx.sdlr.r, nullptr, SDL_PIXELFORMAT_RGBA32, pixels, w * 4 );
+		submit_capture_frame( pixels );
+	}
+}
+
+static void create_renderer_sdlr() {
+	if ( !(gfx.sdlr.r = SDL_CreateRenderer( a.wnd, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC )) ) {
+		die( "Failed to create SDL renderer: %s", SDL_GetError() );
+	}
+	ImGui_ImplSDLRenderer2_Init( gfx.sdlr.r );
+	ImGui_ImplSDLRenderer2_CreateDeviceObjects();
+}
+
+static void destroy_renderer_sdlr() {
+	ImGui_ImplSDLRenderer2_Shutdown();
+	SDL_DestroyRenderer( gfx.sdlr.r );
+	gfx.sdlr.r = nullptr;
+}
+
+static void render_frame_sdlr( GfxFramePacket& p ) {
+	HK_PROFILE_ZONE( "Render frame" );
+	apply_texture_ops_sdlr( p.texture_ops );
+	SDL_SetRenderDrawColor( gfx.sdlr.r, 0x0F, 0x0F, 0x0F, 0xFF );
+	SDL_RenderClear( gfx.sdlr.r );
+	draw_batches_sdlr( p.batches );
+	ImGui_ImplSDLRenderer2_RenderDrawData( &p.ui );
+	capture_frame_sdlr();
+	HK_PROFILE_ZONE( "SDL_RenderPresent" );
+	SDL_RenderPresent( gfx.sdlr.r );
+}
+
+#ifndef HK_MACOS
+static thread_local bool on_render_thread = false;
+
+// SDL_CreateRenderer() adds an event watch that resizes the renderer on window events, and
+// watches run on whichever thread sends the event: the main thread, pumping events. So window
+// events are held back here, and the render thread sends them again before its next frame.
+// The watch then runs beside the renderer, and the main thread gets them a frame late
+static int SDLCALL window_event_filter( void*, SDL_Event* evt ) {
+	if ( evt->type != SDL_WINDOWEVENT || on_render_thread ) {
+		return 1;
+	}
+	hk::sys::ScopedLock lock = hk::sys::ScopedLock( gfx.window_events_lock );
+	gfx.window_events.append( *evt );
+	return 0;
+}
+
+static void send_window_events() {
+	{
+		hk::sys::ScopedLock lock = hk::sys::ScopedLock( gfx.window_events_lock );
+		gfx.window_events_sending.resize( 0 );
+		for ( const SDL_Event& evt : gfx.window_events ) {
+			gfx.window_events_sending.append( evt );
+		}
+		gfx.window_events.resize( 0 );
+	}
+	for ( SDL_Event& evt : gfx.window_events_sending ) {
+		SDL_PushEvent( &evt );
+	}
+}
+
+static void render_thread_sdlr( void* ) {
+	on_render_thread = true;
+	create_renderer_sdlr();
+	gfx.ready.store( true, std::memory_order_release );
+	gfx.ready.notify_one();
+
+	for ( u64 frame = 0;; ++frame ) {
+		gfx.published.wait( frame, std::memory_order_acquire );
+		if ( gfx.quit.load( std::memory_order_acquire ) ) {
+			break;
+		}
+		send_window_events();
+		render_frame_sdlr( gfx.packets[frame % MAX_GFX_FRAMES_IN_FLIGHT] );
+		gfx.presented.store( frame + 1, std::memory_order_release );
+		gfx.presented.notify_one();
+	}
+
+	destroy_renderer_sdlr();
+}
+#endif
+
+//
+// Main thread
+//
+
+static void apply_texture_ops_soft( hk::Array<GfxTextureOp>& ops ) {
+	for ( GfxTextureOp& op : ops ) {
+		SoftTexture& t = gfx.soft.textures[op.texture];
+		if ( t.pixels ) {
+			hk::mem::free( t.pixels );
+		}
+		// Keeps the upload's copy
+		t = { op.width, op.height, (u32*)op.pixels };
+	}
+	ops.resize( 0 );
+}
+
+static void free_texture_ops( hk::Array<GfxTextureOp>& ops ) {
+	for ( GfxTextureOp& op : ops ) {
+		hk::mem::free( op.pixels );
+	}
+	ops.resize( 0 );
+}
+
 void init_gfx( const GfxInitParams& params ) {
 	if ( (gfx.backend = params.requested_backend) == GfxBackend::Default ) {
 		gfx.backend = GfxBackend::SDLRenderer;
 	}
-
-	IMGUI_CHECKVERSION();
-	ImGui::CreateContext();
-	ImGui::StyleColorsDark();
-	ImGui::GetIO().IniFilename = nullptr;
+	gfx.frames_in_flight = params.frames_in_flight ? hk::min( params.frames_in_flight, MAX_GFX_FRAMES_IN_FLIGHT ) : 2;
 	switch ( gfx.backend ) {
 	case GfxBackend::SDLRenderer: {
-		if ( !(gfx.sdlr.r = SDL_CreateRenderer( a.wnd, -1, SDL_RENDERER_ACCELERATED )) ) {
-			die( "Failed to create SDL renderer: %s", SDL_GetError() );
+		IMGUI_CHECKVERSION();
+		ImGui::CreateContext();
+		ImGui::StyleColorsDark();
+		ImGui::GetIO().IniFilename = nullptr;
+#ifdef HK_MACOS
+		// Only the main thread may render on macOS, so end_frame() draws each frame itself
+		create_renderer_sdlr();
+		gfx.frames_in_flight = 1;
+#else
+		SDL_SetEventFilter( window_event_filter, nullptr );
+		if ( !(gfx.render_thread = hk::sys::create_thread( render_thread_sdlr, nullptr )) ) {
+			die( "Failed to start the render thread" );
 		}
-		ImGui_ImplSDL2_InitForSDLRenderer( a.wnd, gfx.sdlr.r );
-		ImGui_ImplSDLRenderer2_Init( gfx.sdlr.r );
-		dbgmsg( "Initialized SDL renderer" );
+		gfx.ready.wait( false, std::memory_order_acquire );
+#endif
+		// Not InitForSDLRenderer(), which would query the renderer from this thread
+		ImGui_ImplSDL2_InitForOther( a.wnd );
+		dbgmsg( "Initialized SDL renderer, %u frames in flight", gfx.frames_in_flight );
+	} break;
+	case GfxBackend::Software: {
+		gfx.rasterizer.frame.resize( SOFT_WIDTH * SOFT_HEIGHT );
+		gfx.rasterizer.clear_color = 0xFF0F0F0F;
+		dbgmsg( "Initialized software renderer, %ux%u", SOFT_WIDTH, SOFT_HEIGHT );
+	} break;
+	case GfxBackend::Null: {
+		// No window and no UI, frames only keep time
+		dbgmsg( "Initialized null renderer" );
+	} break;
+	case GfxBackend::Default: {
+		HK_ASSERT( false && "Default is resolved above" );
 	} break;
 	}
 }
 
-void begin_frame() {
+void shutdown_gfx() {
 	switch ( gfx.backend ) {
 	case GfxBackend::SDLRenderer: {
-		SDL_SetRenderDrawColor( gfx.sdlr.r, 0x0F, 0x0F, 0x0F, 0xFF );
-		SDL_RenderClear( gfx.sdlr.r );
-		ImGui_ImplSDLRenderer2_NewFrame();
+		if ( gfx.render_thread ) {
+			// Wakes the render thread without a frame to draw
+			gfx.quit.store( true, std::memory_order_release );
+			gfx.published.fetch_add( 1, std::memory_order_release );
+			gfx.published.notify_one();
+			hk::sys::join_thread( gfx.render_thread );
+			gfx.render_thread = nullptr;
+			SDL_SetEventFilter( nullptr, nullptr );
+		} else if ( gfx.sdlr.r ) {
+			destroy_renderer_sdlr();
+		}
+		// Uploads the render thread never got to. Its textures went with the renderer
+		for ( GfxFramePacket& p : gfx.packets ) {
+			free_texture_ops( p.texture_ops );
+		}
 	} break;
+	case GfxBackend::Software: {
+		for ( SoftTexture& t : gfx.soft.textures ) {
+			hk::mem::free( t.pixels );
+			t = { };
+		}
+	} break;
+	case GfxBackend::Null:
+	case GfxBackend::Default:
+		break;
+	}
+	free_texture_ops( gfx.texture_ops );
+	for ( bool& used : gfx.texture_used ) {
+		used = false;
+	}
+}
+
+void wait_for_render() {
+	if ( !gfx.render_thread ) {
+		return;
+	}
+	HK_PROFILE_ZONE( "Wait for render" );
+	const u64 t1 = hk::sys::get_time_ns();
+	const u64 frame = gfx.published.load( std::memory_order_relaxed );
+	u64 presented = gfx.presented.load( std::memory_order_acquire );
+	while ( frame - presented >= gfx.frames_in_flight ) {
+		gfx.presented.wait( presented, std::memory_order_acquire );
+		presented = gfx.presented.load( std::memory_order_acquire );
+	}
+	gfx.wait_ns += hk::sys::get_time_ns() - t1;
+}
+
+void begin_frame() {
+	HK_PROFILE_ZONE( "begin_frame" );
+	if ( gfx.backend == GfxBackend::Null || gfx.backend == GfxBackend::Software ) {
+		return;
 	}
 	ImGui_ImplSDL2_NewFrame();
 	ImGui::NewFrame();
 }
 
+// Swap the UI's draw lists into the packet, see GfxFramePacket
+static void capture_ui( GfxFramePacket& p, const ImDrawData* data ) {
+	while ( p.ui_lists.Size < data->CmdListsCount ) {
+		p.ui_lists.push_back( IM_NEW( ImDrawList )( nullptr ) );
+	}
+	p.ui.Valid = data->Valid;
+	p.ui.CmdListsCount = data->CmdListsCount;
+	p.ui.TotalIdxCount = data->TotalIdxCount;
+	p.ui.TotalVtxCount = data->TotalVtxCount;
+	p.ui.DisplayPos = data->DisplayPos;
+	p.ui.DisplaySize = data->DisplaySize;
+	p.ui.FramebufferScale = data->FramebufferScale;
+	p.ui.CmdLists.resize( data->CmdListsCount );
+	for ( int i = 0; i < data->CmdListsCount; ++i ) {
+		ImDrawList* src = data->CmdLists[i];
+		ImDrawList* dst = p.ui_lists[i];
+		dst->CmdBuffer.swap( src->CmdBuffer );
+		dst->IdxBuffer.swap( src->IdxBuffer );
+		dst->VtxBuffer.swap( src->VtxBuffer );
+		dst->Flags = src->Flags;
+		p.ui.CmdLists[i] = dst;
+	}
+}
+
 void end_frame() {
+	HK_PROFILE_ZONE( "end_frame" );
+	const u32 num_buffers = hk::min( hk::sys::get_job_thread_count(), MAX_GFX_THREADS );
+	if ( gfx.backend == GfxBackend::Null ) {
+		gfx.stats = { };
+		for ( u32 i = 0; i < num_buffers; ++i ) {
+			gfx.stats.sprites += (u32)gfx.command_buffers[i].keys.length();
+			gfx.command_buffers[i].keys.resize( 0 );
+			gfx.command_buffers[i].vertices.resize( 0 );
+		}
+		return;
+	}
+	if ( gfx.backend == GfxBackend::Software ) {
+		GfxFramePacket& p = gfx.packets[0];
+		merge_sprite_batches( gfx.command_buffers, num_buffers, p.batches );
+		apply_texture_ops_soft( gfx.texture_ops );
+		soft_draw( gfx.rasterizer, p.batches, gfx.soft.textures );
+		if ( is_capturing() ) {
+			capture_frame( gfx.rasterizer.frame.buffer() );
+		}
+		gfx.stats = { (u32)p.batches.keys.length(), (u32)p.batches.batches.length(), (u32)p.batches.vertices.length(), 0, 0 };
+		return;
+	}
 	// ImGui::ShowDemoWindow();
 	ImGui::Render();
-	switch ( gfx.backend ) {
-	case GfxBackend::SDLRenderer: {
-		ImGui_ImplSDLRenderer2_RenderDrawData( ImGui::GetDrawData() );
-		SDL_RenderPresent( gfx.sdlr.r );
-	} break;
+	// Normally already free, when the caller waited before building the frame
+	wait_for_render();
+	const u64 frame = gfx.published.load( std::memory_order_relaxed );
+	GfxFramePacket& p = gfx.packets[frame % MAX_GFX_FRAMES_IN_FLIGHT];
+	merge_sprite_batches( gfx.command_buffers, num_buffers, p.batches );
+	for ( const GfxTextureOp& op : gfx.texture_ops ) {
+		p.texture_ops.append( op );
+	}
+	gfx.texture_ops.resize( 0 );
+	capture_ui( p, ImGui::GetDrawData() );
+
+	gfx.stats.sprites = (u32)p.batches.keys.length();
+	gfx.stats.batches = (u32)p.batches.batches.length();
+	gfx.stats.vertices = (u32)p.batches.vertices.length();
+	gfx.stats.wait_ns = gfx.wait_ns;
+	gfx.wait_ns = 0;
+	gfx.published.store( frame + 1, std::memory_order_release );
+	gfx.published.notify_one();
+	if ( !gfx.render_thread ) {
+		render_frame_sdlr( p );
+		gfx.presented.store( frame + 1, std::memory_order_release );
 	}
+	gfx.stats.frames_in_flight = (u32)( frame + 1 - gfx.presented.load( std::memory_order_acquire ) );
 }
 
 void handle_ui_event( const SDL_Event* evt ) {
+	if ( gfx.backend == GfxBackend::Null || gfx.backend == GfxBackend::Software ) {
+		return;
+	}
 	ImGui_ImplSDL2_ProcessEvent( evt );
 }
+
+GfxTexture create_texture( u32 width, u32 height, const u8* pixels ) {
+	GfxTexture texture = 1;
+	while ( texture < MAX_GFX_TEXTURES && gfx.texture_used[texture] ) {
+		++texture;
+	}
+	if ( texture == MAX_GFX_TEXTURES ) {
+		return 0;
+	}
+	if ( gfx.backend != GfxBackend::Null ) {
+		GfxTextureOp op = { texture, width, height, hk::mem::alloc<u8>( (usize)width * height * 4 ) };
+		std::memcpy( op.pixels, pixels, (usize)width * height * 4 );
+		gfx.texture_ops.append( op );
+	}
+	gfx.texture_used[texture] = true;
+	return texture;
+}
+
+void destroy_texture( GfxTexture texture ) {
+	if ( !texture || texture >= MAX_GFX_TEXTURES || !gfx.texture_used[texture] ) {
+		return;
+	}
+	if ( gfx.backend != GfxBackend::Null ) {
+		gfx.texture_ops.append( { texture, 0, 0, nullptr } );
+	}
+	gfx.texture_used[texture] = false;
+}
+
+void draw_sprites( const GfxSprite* sprites, usize count, u32 order ) {
+	const i32 thread = hk::sys::get_job_thread_index();
+	HK_ASSERT( thread >= 0 && (u32)thread < MAX_GFX_THREADS && "Sprites must be drawn from a job thread" );
+	push_sprites( gfx.command_buffers[thread], sprites, count, order );
+}
+
+const GfxStats& get_gfx_stats() {
+	return gfx.stats;
+}
+
+const u32* get_software_frame() {
+	return gfx.backend == GfxBackend::Software ? gfx.rasterizer.frame.buffer() : nullptr;
+}
+
+//
+// Sprite batching
+// Every thread that draws expands its sprites into quads in its own command buffer, tagged with
+// a key. At the end of the frame one radix sort over all the keys puts them in drawing order,
+// and the quads are gathered into one vertex list behind it
+//
+
+void push_sprites( GfxCommandBuffer& buffer, const GfxSprite* sprites, usize count, u32 order ) {
+	static_assert( MAX_GFX_TEXTURES <= 0x80 );
+	const usize first = buffer.keys.length();
+	if ( !count ) {
+		return;
+	}
+	buffer.keys.resize( first + count );
+	buffer.vertices.resize( ( first + count ) * 4 );
+	u64* keys = buffer.keys.buffer() + first;
+	SDL_Vertex* quad = buffer.vertices.buffer() + first * 4;
+	for ( usize i = 0; i < count; ++i, quad += 4 ) {
+		const GfxSprite& s = sprites[i];
+		const u32 group = ( (u32)s.layer << 8 ) | ( (u32)s.blend << 7 ) | s.texture;
+		keys[i] = ( (u64)group << 32 ) | order;
+
+		// Corners TL, TR, BL, BR around the centre
+		const f32 c = std::cos( s.rotation ), sn = std::sin( s.rotation );
+		const f32 hx = s.width * 0.5f, hy = s.height * 0.5f;
+		const f32 dx[4] = { -hx, hx, -hx, hx };
+		const f32 dy[4] = { -hy, -hy, hy, hy };
+		const f32 u[4] = { s.u0, s.u1, s.u0, s.u1 };
+		const f32 v[4] = { s.v0, s.v0, s.v1, s.v1 };
+		SDL_Color color;
+		std::memcpy( &color, &s.color, sizeof( color ) );
+		for ( u32 k = 0; k < 4; ++k ) {
+			quad[k].position = { s.x + dx[k] * c - dy[k] * sn, s.y + dx[k] * sn + dy[k] * c };
+			quad[k].color = color;
+			quad[k].tex_coord = { u[k], v[k] };
+		}
+	}
+}
+
+static void gather_quads( void* user, usize begin, usize end ) {
+	GfxSpriteBatches& b = *(GfxSpriteBatches*)user;
+	const u32* order = b.order[0].buffer();
+	SDL_Vertex* vertices = b.vertices.buffer();
+	for ( usize i = begin; i < end; ++i ) {
+		std::memcpy( &vertices[i * 4], b.quads[order[i]], 4 * sizeof( SDL_Vertex ) );
+	}
+}
+
+void merge_sprite_batches( GfxCommandBuffer* buffers, u32 count, GfxSpriteBatches& out ) {
+	HK_PROFILE_ZONE( "Merge sprite batches" );
+	u32 num_sprites = 0;
+	for ( u32 i = 0; i < count; ++i ) {
+		num_sprites += (u32)buffers[i].keys.length();
+	}
+	out.batches.resize( 0 );
+	out.keys.resize( num_sprites );
+	out.quads.resize( num_sprites );
+	out.vertices.resize( (usize)num_sprites * 4 );
+	if ( !num_sprites ) {
+		return;
+	}
+
+	// The same six indices for every quad, so they're only written once
+	const usize num_indices = out.indices.length();
+	if ( num_indices < (usize)num_sprites * 6 ) {
+		out.indices.resize( (usize)num_sprites * 6 );
+		for ( usize i = num_indices / 6; i < num_sprites; ++i ) {
+			const int v = (int)i * 4;
+			int* quad = &out.indices[i * 6];
+			quad[0] = v; quad[1] = v + 1; quad[2] = v + 2;
+			quad[3] = v + 2; quad[4] = v + 1; quad[5] = v + 3;
+		}
+	}
+
+	u64* keys = out.keys.buffer();
+	const SDL_Vertex** quads = out.quads.buffer();
+	for ( u32 i = 0, sprite = 0; i < count; ++i ) {
+		GfxCommandBuffer& buffer = buffers[i];
+		const u32 n = (u32)buffer.keys.length();
+		for ( u32 j = 0; j < n; ++j, ++sprite ) {
+			keys[sprite] = buffer.keys[j];
+			quads[sprite] = buffer.vertices.buffer() + j * 4;
+		}
+	}
+
+	// Stable LSD radix sort, a byte at a time. Orders rarely use more than the low two bytes,
+	// so bytes every key has the same value in are skipped
+	out.order[0].resize( num_sprites );
+	out.order[1].resize( num_sprites );
+	u32* order = out.order[0].buffer();
+	u32* sorted = out.order[1].buffer();
+	for ( u32 i = 0; i < num_sprites; ++i ) {
+		order[i] = i;
+	}
+	for ( u32 shift = 0; shift < 48; shift += 8 ) {
+		u32 offsets[257] = { };
+		for ( u32 i = 0; i < num_sprites; ++i ) {
+			++offsets[( ( keys[i] >> shift ) & 0xFF ) + 1];
+		}
+		if ( offsets[( ( keys[0] >> shift ) & 0xFF ) + 1] == num_sprites ) {
+			continue;
+		}
+		for ( u32 b = 1; b < hk::arrlen( offsets ); ++b ) {
+			offsets[b] += offsets[b - 1];
+		}
+		for ( u32 i = 0; i < num_sprites; ++i ) {
+			sorted[offsets[( keys[order[i]] >> shift ) & 0xFF]++] = order[i];
+		}
+		u32* t = order; order = sorted; sorted = t;
+	}
+	if ( order != out.order[0].buffer() ) {
+		std::memcpy( out.order[0].buffer(), order, num_sprites * sizeof( u32 ) );
+	}
+
+	hk::sys::parallel_for( num_sprites, 1024, gather_quads, &out );
+	for ( u32 i = 0; i < num_sprites; ++i ) {
+		const u32 group = (u32)( keys[order[i]] >> 32 );
+		if ( !i || group != (u32)( keys[order[i - 1]] >> 32 ) ) {
+			const GfxBatch batch = { group & 0x7F, (GfxBlend)( ( group >> 7 ) & 1 ), i * 4, 0 };
+			// Layers only change the order, the same texture and blend mode is still one batch
+			if ( !out.batches.length() || out.batches[out.batches.length() - 1].texture != batch.texture
+				|| out.batches[out.batches.length() - 1].blend != batch.blend ) {
+				out.batches.append( batch );
+			}
+		}
+		++out.batches[out.batches.length() - 1].sprites;
+	}
+
+	for ( u32 i = 0; i < count; ++i ) {
+		buffers[i].keys.resize( 0 );
+		buffers[i].vertices.resize( 0 );
+	}
+}
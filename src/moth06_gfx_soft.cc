@@ -0,0 +1,253 @@
+#include "moth06.hh"
+
+#include <cmath>
+
+#if defined(HK_X64)
+#include <emmintrin.h>
+#endif
+
+//
+// Blending
+// Exact x / 255 rounded, for x up to 255 * 255. The SIMD versions use the same integer steps,
+// so every path gives the same bytes
+//
+
+static inline u32 div255( u32 x ) {
+	x += 128;
+	return ( x + ( x >> 8 ) ) >> 8;
+}
+
+static inline u32 blend_pixel( u32 d, u32 s, GfxBlend blend ) {
+	const u32 a = s >> 24;
+	u32 out = 0;
+	if ( blend == GfxBlend::Add ) {
+		// dst.rgb += src.rgb * src.a, dst.a kept
+		for ( u32 c = 0; c < 24; c += 8 ) {
+			out |= hk::min( 255u, ( ( d >> c ) & 0xFF ) + div255( ( ( s >> c ) & 0xFF ) * a ) ) << c;
+		}
+		return out | ( d & 0xFF000000 );
+	}
+	// dst.rgb = src.rgb * src.a + dst.rgb * (1 - src.a), dst.a = src.a + dst.a * (1 - src.a)
+	for ( u32 c = 0; c < 24; c += 8 ) {
+		out |= div255( ( ( s >> c ) & 0xFF ) * a + ( ( d >> c ) & 0xFF ) * ( 255 - a ) ) << c;
+	}
+	return out | ( div255( 255 * a + ( d >> 24 ) * ( 255 - a ) ) << 24 );
+}
+
+void soft_blend_row_scalar( u32* dst, const u32* src, u32 count, GfxBlend blend ) {
+	for ( u32 i = 0; i < count; ++i ) {
+		dst[i] = blend_pixel( dst[i], src[i], blend );
+	}
+}
+
+#if defined(HK_X64)
+
+static inline __m128i div255_epi16( __m128i x ) {
+	const __m128i t = _mm_add_epi16( x, _mm_set1_epi16( 128 ) );
+	return _mm_srli_epi16( _mm_add_epi16( t, _mm_srli_epi16( t, 8 ) ), 8 );
+}
+
+// Two pixels widened to 16-bit lanes, their alpha in every lane of the pixel
+static inline __m128i splat_alpha( __m128i px ) {
+	return _mm_shufflehi_epi16( _mm_shufflelo_epi16( px, _MM_SHUFFLE( 3, 3, 3, 3 ) ), _MM_SHUFFLE( 3, 3, 3, 3 ) );
+}
+
+void soft_blend_row( u32* dst, const u32* src, u32 count, GfxBlend blend ) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i c255 = _mm_set1_epi16( 255 );
+	// Alpha lanes of 16-bit pixels, and the colour bytes of 8-bit ones
+	const __m128i alpha_lanes = _mm_set_epi16( 255, 0, 0, 0, 255, 0, 0, 0 );
+	const __m128i rgb_bytes = _mm_set1_epi32( 0x00FFFFFF );
+	u32 i = 0;
+	for ( ; i + 4 <= count; i += 4 ) {
+		const __m128i s = _mm_loadu_si128( (const __m128i*)( src + i ) );
+		const __m128i d = _mm_loadu_si128( (const __m128i*)( dst + i ) );
+		const __m128i s_lo = _mm_unpacklo_epi8( s, zero ), s_hi = _mm_unpackhi_epi8( s, zero );
+		const __m128i a_lo = splat_alpha( s_lo ), a_hi = splat_alpha( s_hi );
+		__m128i out;
+		if ( blend == GfxBlend::Add ) {
+			const __m128i m = _mm_packus_epi16( div255_epi16( _mm_mullo_epi16( s_lo, a_lo ) ),
+				div255_epi16( _mm_mullo_epi16( s_hi, a_hi ) ) );
+			out = _mm_adds_epu8( d, _mm_and_si128( m, rgb_bytes ) );
+		} else {
+			// With the source alpha taken as 255, alpha blends like the colours
+			const __m128i d_lo = _mm_unpacklo_epi8( d, zero ), d_hi = _mm_unpackhi_epi8( d, zero );
+			const __m128i x_lo = _mm_add_epi16( _mm_mullo_epi16( _mm_or_si128( s_lo, alpha_lanes ), a_lo ),
+				_mm_mullo_epi16( d_lo, _mm_sub_epi16( c255, a_lo ) ) );
+			const __m128i x_hi = _mm_add_epi16( _mm_mullo_epi16( _mm_or_si128( s_hi, alpha_lanes ), a_hi ),
+				_mm_mullo_epi16( d_hi, _mm_sub_epi16( c255, a_hi ) ) );
+			out = _mm_packus_epi16( div255_epi16( x_lo ), div255_epi16( x_hi ) );
+		}
+		_mm_storeu_si128( (__m128i*)( dst + i ), out );
+	}
+	soft_blend_row_scalar( dst + i, src + i, count - i, blend );
+}
+
+#else
+
+// Other targets, AArch64 included, blend with the scalar path
+void soft_blend_row( u32* dst, const u32* src, u32 count, GfxBlend blend ) {
+	soft_blend_row_scalar( dst, src, count, blend );
+}
+
+#endif
+
+//
+// Setup and binning
+//
+
+static bool setup_quad( SoftQuad& q, const SDL_Vertex* v ) {
+	// Corners TL, TR, BL, BR, see push_sprites()
+	const f32 ex = v[1].position.x - v[0].position.x, ey = v[1].position.y - v[0].position.y;
+	const f32 fx = v[2].position.x - v[0].position.x, fy = v[2].position.y - v[0].position.y;
+	const f32 det = ex * fy - ey * fx;
+	if ( !( std::fabs( det ) > 1e-6f ) ) {
+		return false;
+	}
+	f32 min_x = v[0].position.x, max_x = min_x, min_y = v[0].position.y, max_y = min_y;
+	for ( u32 k = 1; k < 4; ++k ) {
+		min_x = hk::min( min_x, v[k].position.x );
+		max_x = hk::max( max_x, v[k].position.x );
+		min_y = hk::min( min_y, v[k].position.y );
+		max_y = hk::max( max_y, v[k].position.y );
+	}
+	// Also rejects NaNs
+	if ( !( max_x >= 0.0f && max_y >= 0.0f && min_x < (f32)SOFT_WIDTH && min_y < (f32)SOFT_HEIGHT ) ) {
+		return false;
+	}
+	q.x0 = (u16)hk::max( std::floor( min_x ), 0.0f );
+	q.y0 = (u16)hk::max( std::floor( min_y ), 0.0f );
+	q.x1 = (u16)hk::min( std::ceil( max_x ), (f32)( SOFT_WIDTH - 1 ) );
+	q.y1 = (u16)hk::min( std::ceil( max_y ), (f32)( SOFT_HEIGHT - 1 ) );
+
+	// Invert [e f] to get from a pixel's offset from the top left corner to (s, t)
+	q.ds_dx = fy / det;
+	q.ds_dy = -fx / det;
+	q.dt_dx = -ey / det;
+	q.dt_dy = ex / det;
+	const f32 px = 0.5f - v[0].position.x, py = 0.5f - v[0].position.y;
+	q.s0 = px * q.ds_dx + py * q.ds_dy;
+	q.t0 = px * q.dt_dx + py * q.dt_dy;
+	q.u0 = v[0].tex_coord.x;
+	q.v0 = v[0].tex_coord.y;
+	q.du_ds = v[1].tex_coord.x - q.u0;
+	q.dv_ds = v[1].tex_coord.y - q.v0;
+	q.du_dt = v[2].tex_coord.x - q.u0;
+	q.dv_dt = v[2].tex_coord.y - q.v0;
+	std::memcpy( &q.color, &v[0].color, sizeof( q.color ) );
+	return true;
+}
+
+static void bin_quads( SoftRasterizer& r, GfxSpriteBatches& batches ) {
+	HK_PROFILE_ZONE( "Bin quads" );
+	r.quads.resize( 0 );
+	for ( GfxBatch& batch : batches.batches ) {
+		for ( u32 i = 0; i < batch.sprites; ++i ) {
+			SoftQuad q;
+			if ( setup_quad( q, batches.vertices.buffer() + batch.first_vertex + i * 4 ) ) {
+				q.texture = batch.texture;
+				q.blend = batch.blend;
+				r.quads.append( q );
+			}
+		}
+	}
+
+	// Counting sort into tiles, which keeps every tile's quads in drawing order
+	constexpr u32 NUM_TILES = SOFT_TILES_X * SOFT_TILES_Y;
+	u32* offsets = r.tile_offsets;
+	std::memset( offsets, 0, sizeof( r.tile_offsets ) );
+	const u32 num_quads = (u32)r.quads.length();
+	u32 num_binned = 0;
+	for ( u32 i = 0; i < num_quads; ++i ) {
+		const SoftQuad& q = r.quads[i];
+		for ( u32 ty = q.y0 / SOFT_TILE_SIZE; ty <= q.y1 / SOFT_TILE_SIZE; ++ty ) {
+			for ( u32 tx = q.x0 / SOFT_TILE_SIZE; tx <= q.x1 / SOFT_TILE_SIZE; ++tx ) {
+				++offsets[ty * SOFT_TILES_X + tx + 1];
+				++num_binned;
+			}
+		}
+	}
+	for ( u32 t = 1; t <= NUM_TILES; ++t ) {
+		offsets[t] += offsets[t - 1];
+	}
+	r.tile_quads.resize( num_binned );
+	for ( u32 i = 0; i < num_quads; ++i ) {
+		const SoftQuad& q = r.quads[i];
+		for ( u32 ty = q.y0 / SOFT_TILE_SIZE; ty <= q.y1 / SOFT_TILE_SIZE; ++ty ) {
+			for ( u32 tx = q.x0 / SOFT_TILE_SIZE; tx <= q.x1 / SOFT_TILE_SIZE; ++tx ) {
+				r.tile_quads[offsets[ty * SOFT_TILES_X + tx]++] = i;
+			}
+		}
+	}
+	// Filling moved every offset to the start of the next tile
+	for ( u32 t = NUM_TILES; t > 0; --t ) {
+		offsets[t] = offsets[t - 1];
+	}
+	offsets[0] = 0;
+}
+
+//
+// Tiles
+//
+
+static void draw_quad_rows( SoftRasterizer& r, const SoftQuad& q, u32 tx0, u32 ty0 ) {
+	const u32 x0 = hk::max<u32>( q.x0, tx0 ), x1 = hk::min<u32>( q.x1, tx0 + SOFT_TILE_SIZE - 1 );
+	const u32 y0 = hk::max<u32>( q.y0, ty0 ), y1 = hk::min<u32>( q.y1, ty0 + SOFT_TILE_SIZE - 1 );
+	const SoftTexture* tex = q.texture ? &r.textures[q.texture] : nullptr;
+	if ( tex && !tex->pixels ) {
+		tex = nullptr;
+	}
+	const u32 cr = q.color & 0xFF, cg = ( q.color >> 8 ) & 0xFF, cb = ( q.color >> 16 ) & 0xFF, ca = q.color >> 24;
+	u32 row[SOFT_TILE_SIZE];
+	for ( u32 y = y0; y <= y1; ++y ) {
+		const f32 s_row = q.s0 + q.ds_dx * (f32)x0 + q.ds_dy * (f32)y;
+		const f32 t_row = q.t0 + q.dt_dx * (f32)x0 + q.dt_dy * (f32)y;
+		for ( u32 i = 0; i <= x1 - x0; ++i ) {
+			const f32 s = s_row + q.ds_dx * (f32)i;
+			const f32 t = t_row + q.dt_dx * (f32)i;
+			if ( !( s >= 0.0f && s < 1.0f && t >= 0.0f && t < 1.0f ) ) {
+				row[i] = 0;
+				continue;
+			}
+			u32 texel = 0xFFFFFFFF;
+			if ( tex ) {
+				// Nearest texel, wrapping so scrolled coordinates repeat
+				f32 u = q.u0 + q.du_ds * s + q.du_dt * t;
+				f32 v = q.v0 + q.dv_ds * s + q.dv_dt * t;
+				u -= std::floor( u );
+				v -= std::floor( v );
+				const u32 tx = hk::min( (u32)( u * (f32)tex->width ), tex->width - 1 );
+				const u32 ty = hk::min( (u32)( v * (f32)tex->height ), tex->height - 1 );
+				texel = tex->pixels[ty * tex->width + tx];
+			}
+			row[i] = div255( ( texel & 0xFF ) * cr ) | ( div255( ( ( texel >> 8 ) & 0xFF ) * cg ) << 8 )
+				| ( div255( ( ( texel >> 16 ) & 0xFF ) * cb ) << 16 ) | ( div255( ( texel >> 24 ) * ca ) << 24 );
+		}
+		soft_blend_row( r.frame.buffer() + y * SOFT_WIDTH + x0, row, x1 - x0 + 1, q.blend );
+	}
+}
+
+static void draw_tiles( void* user, usize begin, usize end ) {
+	SoftRasterizer& r = *(SoftRasterizer*)user;
+	for ( usize tile = begin; tile < end; ++tile ) {
+		const u32 tx0 = (u32)( tile % SOFT_TILES_X ) * SOFT_TILE_SIZE;
+		const u32 ty0 = (u32)( tile / SOFT_TILES_X ) * SOFT_TILE_SIZE;
+		for ( u32 y = ty0; y < ty0 + SOFT_TILE_SIZE; ++y ) {
+			u32* px = r.frame.buffer() + y * SOFT_WIDTH + tx0;
+			for ( u32 x = 0; x < SOFT_TILE_SIZE; ++x ) {
+				px[x] = r.clear_color;
+			}
+		}
+		for ( u32 i = r.tile_offsets[tile]; i < r.tile_offsets[tile + 1]; ++i ) {
+			draw_quad_rows( r, r.quads[r.tile_quads[i]], tx0, ty0 );
+		}
+	}
+}
+
+void soft_draw( SoftRasterizer& r, GfxSpriteBatches& batches, const SoftTexture* textures ) {
+	HK_PROFILE_ZONE( "Software draw" );
+	r.frame.resize( SOFT_WIDTH * SOFT_HEIGHT );
+	r.textures = textures;
+	bin_quads( r, batches );
+	hk::sys::parallel_for( SOFT_TILES_X * SOFT_TILES_Y, 4, draw_tiles, &r );
+}
@@ -4,8 +4,6 @@ static unsigned long hk_alloc_tracker = 0;
 #include "moth06.hh"
 #define dbgmsg(...) dbgmsg_( "TEST | " __VA_ARGS__ );
 
-#include <vector>
-
 #define CHECK_LEAKS() HK_ASSERT(hk_alloc_tracker == 0 && "Memory leaked!")
 
 class DummyClass {
@@ -36,6 +34,69 @@ void moth06_test() {
         HK_ASSERT( hk::arrlen( test_arr ) == 10 );
     }
 
+    // Clock
+    {
+        const hk::sys::ClockCalibration clock = hk::sys::get_clock_calibration();
+        dbgmsg( "Clock source: %s", clock.cpu_ticks ? "CPU timestamp counter" : "OS clock" );
+        const hk::u64 t1 = hk::sys::get_time_ns();
+        hk::sys::sleep_ms( 20 );
+        const hk::u64 t2 = hk::sys::get_time_ns();
+        HK_ASSERT( t2 - t1 >= 19000000 && t2 - t1 < 1000000000 );
+        hk::u64 last = 0;
+        for ( hk::usize i = 0; i < 1000; ++i ) {
+            const hk::u64 now = hk::sys::get_time_ns();
+            HK_ASSERT( now >= last );
+            last = now;
+        }
+    }
+
+    // Profiling zones
+    {
+        hk::prof::ThreadBuffer* buf = hk::prof::thread_buffer();
+        const hk::u64 since = hk::sys::get_clock_ticks();
+        {
+            const hk::prof::Zone outer = hk::prof::Zone( "Test outer" );
+            for ( hk::usize i = 0; i < 3; ++i ) {
+                const hk::prof::Zone inner = hk::prof::Zone( "Test inner" );
+            }
+        }
+        hk::prof::ZoneEvent events[8] = { };
+        HK_ASSERT( hk::prof::read_events( buf, since, events, hk::arrlen( events ) ) == 4 );
+        HK_ASSERT( std::strcmp( events[0].name, "Test inner" ) == 0 && events[0].depth == 1 );
+        HK_ASSERT( std::strcmp( events[3].name, "Test outer" ) == 0 && events[3].depth == 0 );
+        HK_ASSERT( events[3].begin <= events[0].begin && events[3].end >= events[2].end );
+        HK_ASSERT( buf->depth == 0 );
+
+        // Chrome trace export
+        std::FILE* f = std::tmpfile();
+        HK_ASSERT( f );
+        HK_ASSERT( hk::prof::write_chrome_trace( f, since ) >= 4 );
+        char json[1024] = { };
+        std::rewind( f );
+        std::fread( json, 1, sizeof( json ) - 1, f );
+        std::fclose( f );
+        HK_ASSERT( json[0] == '{' && std::strstr( json, "\"traceEvents\":[" ) );
+        HK_ASSERT( std::strstr( json, "\"name\":\"Test outer\",\"ph\":\"X\"" ) );
+    }
+
+#ifdef HK_ALLOC_PROFILE
+    // Allocation sites
+    {
+        const hk::u32 line = __LINE__ + 1;
+        hk::Array<hk::u32> arr = hk::Array<hk::u32>( 100 );
+        static hk::prof::AllocSiteTotals sites[4096];
+        const hk::usize num_sites = hk::prof::read_alloc_sites( sites, hk::arrlen( sites ) );
+        bool found = false;
+        for ( hk::usize i = 0; i < num_sites; ++i ) {
+            if ( sites[i].line == line && std::strcmp( sites[i].file, __FILE__ ) == 0 ) {
+                HK_ASSERT( sites[i].count == 1 && sites[i].bytes == sizeof( hk::u32 ) * 100 );
+                found = true;
+            }
+        }
+        HK_ASSERT( found );
+    }
+#endif
+
     // Span<T>
     {
         static hk::i32 test_arr[5] = { 1, 2, 3, 4, 5 };
@@ -47,6 +108,20 @@ void moth06_test() {
         }
     }
 
+    // Over-aligned allocations
+    {
+        struct alignas( 128 ) Wide {
+            hk::u8 x;
+        };
+        Wide* wide = hk::mem::alloc<Wide>( 3 );
+        HK_ASSERT( ( (uintptr_t)wide & 127 ) == 0 && wide[2].x == 0 );
+        hk::mem::free( wide );
+        hk::u8* block = hk::mem::alloc_aligned<hk::u8>( 100, HK_CACHE_LINE );
+        HK_ASSERT( ( (uintptr_t)block & ( HK_CACHE_LINE - 1 ) ) == 0 && block[99] == 0 );
+        hk::mem::free_aligned( block );
+    }
+    CHECK_LEAKS();
+
     // Array<T>
     {
         {
@@ -78,36 +153,160 @@ void moth06_test() {
             }
         }
         CHECK_LEAKS();
+    }
+
+    // Job system
+    {
+        hk::sys::init_jobs( 3 );
+        HK_ASSERT( hk::sys::get_job_thread_count() == 4 );
 
-        // Check performance vs. std::vector
+        // parallel_for covers every element exactly once
         {
-            hk::u64 base_time = 0;
-            {
-                const hk::u64 t1 = hk::sys::get_cpu_ticks();
-                for ( hk::i32 i = 1; i <= 10000; ++i ) {
-                    std::vector<hk::i32> test_vec = std::vector<hk::i32>();
-                    for ( hk::i32 j = 1; j <= 1000; ++j ) {
-                        test_vec.push_back( i % j );
-                    }
+            static std::atomic<hk::u32> visited[10000];
+            hk::sys::parallel_for( hk::arrlen( visited ), 0, []( void*, hk::usize begin, hk::usize end ) {
+                for ( hk::usize i = begin; i < end; ++i ) {
+                    visited[i].fetch_add( 1 );
                 }
-                const hk::u64 t2 = hk::sys::get_cpu_ticks();
-                base_time = t2 - t1;
-                dbgmsg( "std::vector benchmark took %" PRIu64 " cycles", base_time );
+            }, nullptr );
+            for ( auto& v : visited ) {
+                HK_ASSERT( v == 1 );
             }
-            {
-                const hk::u64 t1 = hk::sys::get_cpu_ticks();
-                for ( hk::i32 i = 1; i <= 10000; ++i ) {
-                    hk::Array<hk::i32> test_vec = hk::Array<hk::i32>();
-                    for ( hk::i32 j = 1; j <= 1000; ++j ) {
-                        test_vec.append( i % j );
-                    }
-                }
-                const hk::u64 t2 = hk::sys::get_cpu_ticks();
-                const hk::u64 dt = t2 - t1;
-                dbgmsg( "Array<T> benchmark took     %" PRIu64 " cycles (%.2f%% execution time)", dt, ((hk::f64)dt / (hk::f64)base_time) * 100.0f );
+        }
+
+        // Continuations only start once their dependency has finished
+        {
+            static std::atomic<hk::u32> stage1_done = 0;
+            static std::atomic<bool> stage2_early = false;
+            hk::sys::Job stage1[64] = { };
+            hk::sys::Job stage2[64] = { };
+            for ( auto& j : stage1 ) {
+                j.fn = []( void* ) { stage1_done.fetch_add( 1 ); };
+            }
+            for ( auto& j : stage2 ) {
+                j.fn = []( void* ) { stage2_early = stage2_early || stage1_done != 64; };
             }
+            hk::sys::JobCounter c1, c2;
+            hk::sys::run_jobs( stage1, hk::arrlen( stage1 ), &c1 );
+            hk::sys::run_jobs_after( &c1, stage2, hk::arrlen( stage2 ), &c2 );
+            hk::sys::wait_jobs( &c2 );
+            HK_ASSERT( c1.pending == 0 && c2.pending == 0 );
+            HK_ASSERT( !stage2_early );
+
+            // Counters can be reused once finished
+            hk::sys::run_jobs( stage1, hk::arrlen( stage1 ), &c1 );
+            hk::sys::wait_jobs( &c1 );
+            HK_ASSERT( stage1_done == 128 );
+
+            // A counter that never ran anything is done, continuations on it start right away
+            hk::sys::JobCounter idle, after;
+            hk::sys::wait_jobs( &idle );
+            hk::sys::run_jobs_after( &idle, stage1, hk::arrlen( stage1 ), &after );
+            hk::sys::wait_jobs( &after );
+            HK_ASSERT( stage1_done == 192 );
+        }
+
+        hk::sys::shutdown_jobs();
+    }
+    CHECK_LEAKS();
+
+    // SpscRing<T, N>
+    {
+        static hk::SpscRing<hk::u32, 8> ring;
+        hk::u32 out[8] = { };
+        for ( hk::u32 lap = 0; lap < 4; ++lap ) {
+            const hk::u32 in[5] = { lap, lap + 1, lap + 2, lap + 3, lap + 4 };
+            HK_ASSERT( ring.push_n( in, 5 ) == 5 );
+            HK_ASSERT( ring.push_n( in, 5 ) == 3 );
+            HK_ASSERT( !ring.push( 0 ) );
+            HK_ASSERT( ring.pop_n( out, 6 ) == 6 );
+            HK_ASSERT( out[0] == lap && out[4] == lap + 4 && out[5] == lap );
+            HK_ASSERT( ring.pop_n( out, 8 ) == 2 );
+            HK_ASSERT( !ring.pop( out[0] ) );
         }
-        CHECK_LEAKS();
+    }
+
+    // MpscQueue<T>
+    {
+        hk::MpscQueue<hk::u32> queue = hk::MpscQueue<hk::u32>( 8 );
+        hk::u32 out[8] = { };
+        for ( hk::u32 lap = 0; lap < 4; ++lap ) {
+            const hk::u32 in[5] = { lap, lap + 1, lap + 2, lap + 3, lap + 4 };
+            HK_ASSERT( queue.push_n( in, 5 ) == 5 );
+            HK_ASSERT( queue.push_n( in, 5 ) == 3 );
+            HK_ASSERT( !queue.push( 0 ) );
+            HK_ASSERT( queue.pop_n( out, 6 ) == 6 );
+            HK_ASSERT( out[0] == lap && out[4] == lap + 4 && out[5] == lap );
+            HK_ASSERT( queue.pop_n( out, 8 ) == 2 );
+            HK_ASSERT( !queue.pop( out[0] ) );
+        }
+    }
+    CHECK_LEAKS();
+
+    // Ring buffers keep per-producer order under contention, see moth06_bench for timings
+    {
+        // Producer index in the high half, sequence number in the low half
+        constexpr hk::u64 MESSAGES_PER_PRODUCER = 1 << 14;
+        constexpr hk::u64 NUM_PRODUCERS = 3;
+        static hk::SpscRing<hk::u64, 4096> spsc;
+        static hk::MpscQueue<hk::u64>* mpsc = nullptr;
+        hk::MpscQueue<hk::u64> mpsc_queue = hk::MpscQueue<hk::u64>( 4096 );
+
+        const auto produce = []( void* user ) {
+            const hk::u64 idx = (hk::u64)(hk::usize)user;
+            for ( hk::u64 seq = 0; seq < MESSAGES_PER_PRODUCER; ++seq ) {
+                while ( !( mpsc ? mpsc->push( idx << 32 | seq ) : spsc.push( idx << 32 | seq ) ) ) {
+                    hk::sys::yield_thread();
+                }
+            }
+        };
+        const auto consume = [&]( hk::u64 num_producers ) {
+            hk::sys::Thread* threads[NUM_PRODUCERS] = { };
+            hk::u64 next_seq[NUM_PRODUCERS] = { };
+            for ( hk::u64 i = 0; i < num_producers; ++i ) {
+                threads[i] = hk::sys::create_thread( produce, (void*)(hk::usize)i );
+            }
+            for ( hk::u64 received = 0; received < num_producers * MESSAGES_PER_PRODUCER; ) {
+                hk::u64 msg = 0;
+                if ( !( mpsc ? mpsc->pop( msg ) : spsc.pop( msg ) ) ) {
+                    hk::sys::yield_thread();
+                    continue;
+                }
+                HK_ASSERT( ( msg & 0xFFFFFFFF ) == next_seq[msg >> 32]++ );
+                ++received;
+            }
+            for ( hk::u64 i = 0; i < num_producers; ++i ) {
+                hk::sys::join_thread( threads[i] );
+            }
+        };
+        consume( 1 );
+        mpsc = &mpsc_queue;
+        consume( NUM_PRODUCERS );
+        mpsc = nullptr;
+    }
+    CHECK_LEAKS();
+
+    // Logger formatting matches printf
+    {
+        char buf[256], expected[256];
+        const char* str = "string";
+        const hk::logging::Record r = hk::logging::encode( "%d %u %5.2f %s %" PRIu64 " %c %x %%", -12, 34u, 3.14159f, str, (hk::u64)1 << 40, 'x', (hk::u8)0xAB );
+        std::snprintf( expected, sizeof( expected ), "%d %u %5.2f %s %" PRIu64 " %c %x %%", -12, 34u, 3.14159f, str, (hk::u64)1 << 40, 'x', (hk::u8)0xAB );
+        HK_ASSERT( hk::logging::format( r, buf, sizeof( buf ) ) == std::strlen( expected ) );
+        HK_ASSERT( std::strcmp( buf, expected ) == 0 );
+
+        // '*' width and precision
+        const hk::logging::Record stars = hk::logging::encode( "[%*d] [%.*s] [%*.*f]", 5, 42, 3, str, 8, 2, 1.5 );
+        hk::logging::format( stars, buf, sizeof( buf ) );
+        HK_ASSERT( std::strcmp( buf, "[   42] [str] [    1.50]" ) == 0 );
+
+        // Mismatched and missing arguments don't read garbage
+        const hk::logging::Record bad = hk::logging::encode( "%s %d", 12 );
+        hk::logging::format( bad, buf, sizeof( buf ) );
+        HK_ASSERT( std::strcmp( buf, "<?> <?>" ) == 0 );
+
+        // Truncation
+        HK_ASSERT( hk::logging::format( r, buf, 4 ) == std::strlen( expected ) );
+        HK_ASSERT( std::strcmp( buf, "-12" ) == 0 );
     }
 
     // BitStream
@@ -126,4 +325,189 @@ void moth06_test() {
         HK_ASSERT( bits.overrun() );
     }
     CHECK_LEAKS();
+
+    // Sprite batches. Allocated inside moth06_gfx.cc, so not counted by the leak checks
+    {
+        const auto sprite = []( hk::u8 layer, GfxBlend blend, GfxTexture texture, hk::u32 color ) {
+            GfxSprite s = { };
+            s.x = 10.0f;
+            s.y = 20.0f;
+            s.width = 4.0f;
+            s.height = 2.0f;
+            s.u1 = 1.0f;
+            s.v1 = 1.0f;
+            s.color = color;
+            s.texture = texture;
+            s.blend = blend;
+            s.layer = layer;
+            return s;
+        };
+        GfxSprite sprites[] = {
+            sprite( 1, GfxBlend::Alpha, 2, 0 ),
+            sprite( 0, GfxBlend::Add, 1, 1 ),
+            sprite( 0, GfxBlend::Alpha, 2, 2 ),
+            sprite( 1, GfxBlend::Alpha, 2, 3 ),
+            sprite( 0, GfxBlend::Alpha, 1, 4 ),
+            sprite( 0, GfxBlend::Alpha, 2, 5 ),
+        };
+        sprites[4].rotation = 1.57079632679f;
+
+        // Queued from two threads, the second with the earlier order
+        GfxCommandBuffer buffers[2] = { };
+        push_sprites( buffers[0], sprites + 3, 3, 7 );
+        push_sprites( buffers[1], sprites, 3, 2 );
+        GfxSpriteBatches b = { };
+        merge_sprite_batches( buffers, hk::arrlen( buffers ), b );
+        HK_ASSERT( b.vertices.length() == 4 * hk::arrlen( sprites ) );
+        HK_ASSERT( b.indices.length() >= 6 * hk::arrlen( sprites ) );
+        HK_ASSERT( buffers[0].keys.length() == 0 && buffers[1].vertices.length() == 0 );
+
+        // Layer, then blend, then texture, then queue order
+        const GfxBatch expected[] = {
+            { 1, GfxBlend::Alpha, 0, 1 },
+            { 2, GfxBlend::Alpha, 4, 2 },
+            { 1, GfxBlend::Add, 12, 1 },
+            { 2, GfxBlend::Alpha, 16, 2 },
+        };
+        HK_ASSERT( b.batches.length() == hk::arrlen( expected ) );
+        for ( hk::usize i = 0; i < hk::arrlen( expected ); ++i ) {
+            HK_ASSERT( b.batches[i].texture == expected[i].texture && b.batches[i].blend == expected[i].blend );
+            HK_ASSERT( b.batches[i].first_vertex == expected[i].first_vertex && b.batches[i].sprites == expected[i].sprites );
+        }
+        const hk::u8 order[] = { 4, 2, 5, 1, 0, 3 };
+        for ( hk::usize i = 0; i < hk::arrlen( order ); ++i ) {
+            HK_ASSERT( b.vertices[i * 4].color.r == order[i] );
+        }
+
+        // Corners go TL, TR, BL, BR around the centre
+        const auto near = []( float a, float b ) { return std::fabs( a - b ) < 1e-4f; };
+        const SDL_Vertex* quad = &b.vertices[8];
+        HK_ASSERT( near( quad[0].position.x, 8.0f ) && near( quad[0].position.y, 19.0f ) );
+        HK_ASSERT( near( quad[3].position.x, 12.0f ) && near( quad[3].position.y, 21.0f ) );
+        HK_ASSERT( quad[1].tex_coord.x == 1.0f && quad[1].tex_coord.y == 0.0f );
+        HK_ASSERT( quad[2].tex_coord.x == 0.0f && quad[2].tex_coord.y == 1.0f );
+        // A quarter turn puts the top left corner at the top right
+        quad = &b.vertices[0];
+        HK_ASSERT( near( quad[0].position.x, 11.0f ) && near( quad[0].position.y, 18.0f ) );
+        const int indices[] = { 4, 5, 6, 6, 5, 7 };
+        for ( hk::usize i = 0; i < hk::arrlen( indices ); ++i ) {
+            HK_ASSERT( b.indices[6 + i] == indices[i] );
+        }
+
+        // Equal keys keep the order of the buffers, then of the calls
+        push_sprites( buffers[1], sprites + 2, 1, 0 );
+        push_sprites( buffers[0], sprites + 5, 1, 0 );
+        push_sprites( buffers[0], sprites + 4, 1, 0 );
+        sprites[4].texture = 2;
+        push_sprites( buffers[0], sprites + 4, 1, 0 );
+        merge_sprite_batches( buffers, hk::arrlen( buffers ), b );
+        HK_ASSERT( b.batches.length() == 2 && b.batches[1].sprites == 3 );
+        HK_ASSERT( b.vertices[4].color.r == 5 && b.vertices[8].color.r == 4 && b.vertices[12].color.r == 2 );
+    }
+
+    // Software rasteriser
+    {
+        // SIMD blending matches scalar, through a partial last vector
+        hk::u32 src[37], dst[37], expected[37];
+        for ( hk::u32 i = 0; i < hk::arrlen( src ); ++i ) {
+            src[i] = ( (hk::u32)std::rand() << 16 ) ^ (hk::u32)std::rand();
+            src[i] = ( i % 5 == 0 ) ? ( src[i] | 0xFF000000 ) : ( i % 7 == 0 ) ? ( src[i] & 0x00FFFFFF ) : src[i];
+        }
+        for ( GfxBlend blend : { GfxBlend::Alpha, GfxBlend::Add } ) {
+            for ( hk::u32 i = 0; i < hk::arrlen( dst ); ++i ) {
+                dst[i] = expected[i] = ( (hk::u32)std::rand() << 16 ) ^ (hk::u32)std::rand();
+            }
+            soft_blend_row( dst, src, hk::arrlen( dst ), blend );
+            soft_blend_row_scalar( expected, src, hk::arrlen( expected ), blend );
+            HK_ASSERT( std::memcmp( dst, expected, sizeof( dst ) ) == 0 );
+        }
+        hk::u32 px = 0xFFFF0000;
+        const hk::u32 half_red = 0x800000FF;
+        soft_blend_row( &px, &half_red, 1, GfxBlend::Alpha );
+        HK_ASSERT( px == 0xFF7F0080 );
+
+        // Opaque red, green added over its right half, and a textured sprite with a white and a blue texel
+        const auto sprite = []( hk::f32 x, hk::f32 y, hk::u32 color, GfxBlend blend, GfxTexture texture, hk::u8 layer ) {
+            GfxSprite s = { };
+            s.x = x;
+            s.y = y;
+            s.width = 20.0f;
+            s.height = 10.0f;
+            s.u1 = 1.0f;
+            s.v1 = 1.0f;
+            s.color = color;
+            s.blend = blend;
+            s.texture = texture;
+            s.layer = layer;
+            return s;
+        };
+        const GfxSprite sprites[] = {
+            sprite( 110.0f, 100.0f, 0x8000FF00, GfxBlend::Add, 0, 1 ),
+            sprite( 100.0f, 100.0f, 0xFF0000FF, GfxBlend::Alpha, 0, 0 ),
+            sprite( 300.0f, 300.0f, 0xFFFFFFFF, GfxBlend::Alpha, 1, 0 ),
+        };
+        hk::u32 texels[2] = { 0xFFFFFFFF, 0xFFFF0000 };
+        const SoftTexture textures[2] = { { }, { 2, 1, texels } };
+        GfxCommandBuffer buffer = { };
+        push_sprites( buffer, sprites, hk::arrlen( sprites ), 0 );
+        GfxSpriteBatches b = { };
+        merge_sprite_batches( &buffer, 1, b );
+        SoftRasterizer r = { };
+        r.clear_color = 0xFF000000;
+        soft_draw( r, b, textures );
+        const auto pixel = [&]( hk::u32 x, hk::u32 y ) { return r.frame[y * SOFT_WIDTH + x]; };
+        HK_ASSERT( pixel( 89, 100 ) == 0xFF000000 && pixel( 90, 100 ) == 0xFF0000FF && pixel( 95, 95 ) == 0xFF0000FF );
+        HK_ASSERT( pixel( 105, 100 ) == 0xFF0080FF && pixel( 115, 104 ) == 0xFF008000 && pixel( 120, 100 ) == 0xFF000000 );
+        HK_ASSERT( pixel( 100, 94 ) == 0xFF000000 && pixel( 100, 105 ) == 0xFF000000 );
+        HK_ASSERT( pixel( 295, 300 ) == 0xFFFFFFFF && pixel( 305, 300 ) == 0xFFFF0000 );
+    }
+
+    // Frame capture
+    {
+        // White, black, red and blue, then each 2x2 block sharing chroma
+        const hk::u32 pixels[8] = { 0xFFFFFFFF, 0xFFFFFFFF, 0xFF0000FF, 0xFF0000FF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFF0000, 0xFFFF0000 };
+        hk::u8 y[8], u[2], v[2];
+        rgba_to_yuv420( pixels, 4, 2, y, u, v );
+        HK_ASSERT( y[0] == 235 && y[2] == 82 && y[6] == 41 );
+        HK_ASSERT( u[0] == 128 && v[0] == 128 );
+        HK_ASSERT( u[1] == 165 && v[1] == 175 );
+        const hk::u32 black = 0xFF000000;
+        rgba_to_yuv420( &black, 1, 1, y, u, v );
+        HK_ASSERT( y[0] == 16 );
+
+        // One buffer: a second frame before the first is submitted is dropped
+        const char* path = "moth06_test_capture.y4m";
+        CaptureParams params = { };
+        params.path = path;
+        params.format = CaptureFormat::Y4m;
+        params.width = 4;
+        params.height = 2;
+        params.buffers = 1;
+        const bool started = start_capture( params );
+        HK_ASSERT( started && is_capturing() );
+        hk::u32* frame = acquire_capture_frame();
+        hk::u32* dropped = acquire_capture_frame();
+        HK_ASSERT( frame && !dropped );
+        std::memcpy( frame, pixels, sizeof( pixels ) );
+        submit_capture_frame( frame );
+        stop_capture();
+        const CaptureStats stats = get_capture_stats();
+        HK_ASSERT( !is_capturing() && stats.frames_captured == 1 && stats.frames_dropped == 1 && stats.frames_written == 1 );
+        std::FILE* f = std::fopen( path, "rb" );
+        if ( !f ) {
+            die( "Failed to read back %s", path );
+        }
+        char contents[128] = { };
+        const hk::usize length = std::fread( contents, 1, sizeof( contents ), f );
+        std::fclose( f );
+        std::remove( path );
+        const char header[] = "YUV4MPEG2 W4 H2 F60:1 Ip A1:1 C420jpeg\nFRAME\n";
+        HK_ASSERT( length == sizeof( header ) - 1 + 12 && std::memcmp( contents, header, sizeof( header ) - 1 ) == 0 );
+        HK_ASSERT( (hk::u8)contents[sizeof( header ) - 1] == 235 && (hk::u8)contents[length - 1] == 175 );
+
+        // Odd sizes don't fit 4:2:0
+        params.width = 3;
+        const bool started_odd = start_capture( params );
+        HK_ASSERT( !started_odd );
+    }
 }
\ No newline at end of file